@@ -87,8 +87,10 @@ STATS=4
 ISREADY=5
 SHUTDOWN=6
 WORKER_UP_TIME_STATS=7
+WORK_BINARY=8
+NEW_WORKER_BINARY=9
 
-messages = (WORK, RESPONSE, NEW_WORKER, REQUEST_STATS, STATS, ISREADY, SHUTDOWN, WORKER_UP_TIME_STATS)
+messages = (WORK, RESPONSE, NEW_WORKER, REQUEST_STATS, STATS, ISREADY, SHUTDOWN, WORKER_UP_TIME_STATS, WORK_BINARY, NEW_WORKER_BINARY)
 
 class TaggedMessage(CStruct):
   struct = struct.Struct("ii")
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Sweep the master's policy parameters over one trace with the cluster
+# simulator, one configuration per process, all cores in parallel.
+#
+#   ./scripts/sim_sweep.sh tests/grading_nonuniform1.txt [cluster_sim flags]
+#
+# Prints one line per configuration: its flags, then the simulator's
+# summary (worker seconds, mean and p99 latency, wrong/missing
+# responses).  Override the grid through the environment, e.g.
+# THREAD_NUMS="24 30" SCHEDULERS=cost ./scripts/sim_sweep.sh ...
+
+if [ -z "$1" ]
+then
+  echo "usage: $0 tracefile [cluster_sim flags]"
+  exit 1
+fi
+trace=$1
+shift
+
+THREAD_NUMS=${THREAD_NUMS:-"20 24 30 36 48"}
+THRESHOLDS=${THRESHOLDS:-"1.2 1.4 1.6"}
+SCHEDULERS=${SCHEDULERS:-"cost slots"}
+AUTOSCALERS=${AUTOSCALERS:-"predictive reactive"}
+
+for thread_num in $THREAD_NUMS; do
+  for threshold in $THRESHOLDS; do
+    for scheduler in $SCHEDULERS; do
+      for autoscaler in $AUTOSCALERS; do
+        echo "--thread_num=$thread_num --threshold=$threshold --scheduler=$scheduler --autoscaler=$autoscaler"
+      done
+    done
+  done
+done | xargs -P $(nproc) -I {} sh -c \
+  "echo \"{} \$(./cluster_sim {} $* $trace 2>/dev/null | grep '^summary:' | cut -d' ' -f2-)\""
@@ -0,0 +1,278 @@
+// Trace replay: the master's slot admission vs. per-node resource
+// budgets (tools/node_budget.h), on a simple model of the worker
+// nodes.
+//
+//   ./admission_replay tests/grading_nonuniform1.txt [nodes]
+//   ./admission_replay mixed [nodes]
+//
+// None of the traces in tests/ has bandwidth requests, so "mixed"
+// replays a synthetic minute of 418wisdom, bandwidth, projectidea and
+// tellmenow requests instead.
+//
+// Requests arrive at their trace times and go first fit to a node
+// that admits them, as in myserver/master.cpp.  Each node then runs
+// its jobs side by side:
+//
+//  - more runnable threads than hardware threads time-slice
+//  - streaming jobs beyond the bandwidth budget share it
+//  - a projectidea whose working set does not fit in the LLC next to
+//    everything else runs LLC_THRASH_RATE times slower
+//
+// Service times are the master's cost priors (countprimes scaled by
+// n), so absolute numbers are rough; the point is the comparison.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "server/messages.h"
+#include "tools/node_budget.h"
+#include "tools/node_model.h"
+
+static const int THREAD_SLOTS = 30;
+static const int PROJECT_IDEA_SLOTS = 5;
+static const double STEP_MS = 1.0;
+
+static const double MIXED_DURATION_MS = 60 * 1000;
+static const double MIXED_INTERVAL_MS = 40;
+
+enum Scheme { SCHEME_SLOTS, SCHEME_BUDGETS };
+
+struct TraceRequest {
+  double arrival_ms;
+  std::string cmd;
+  std::vector<int> jobs;
+  int jobs_left;
+  double finish_ms;
+};
+
+struct Job {
+  int request;
+  std::string cmd;
+  ResourceDemand demand;
+  double work_ms;
+  int node;
+};
+
+struct Node {
+  NodeUsage usage;
+  int slots_used;
+  bool running_project_idea;
+  std::vector<int> running;
+
+  Node() : slots_used(0), running_project_idea(false) {}
+};
+
+static void add_request(double arrival_ms, const Request_msg& req,
+                        std::vector<TraceRequest>* requests,
+                        std::vector<Job>* jobs) {
+  TraceRequest r;
+  r.arrival_ms = arrival_ms;
+  r.cmd = req.get_arg("cmd");
+  r.finish_ms = -1;
+  if (r.cmd == "lastrequest") {
+    return;
+  }
+
+  // compareprimes is four countprimes, as the master splits it
+  std::vector<Request_msg> parts;
+  if (r.cmd == "compareprimes") {
+    const char* args[4] = { "n1", "n2", "n3", "n4" };
+    for (int i = 0; i < 4; ++i) {
+      Request_msg part(0);
+      part.set_arg("cmd", "countprimes");
+      part.set_arg("n", req.get_arg(args[i]));
+      parts.push_back(part);
+    }
+  } else {
+    parts.push_back(req);
+  }
+
+  for (size_t i = 0; i < parts.size(); ++i) {
+    Job j;
+    j.request = requests->size();
+    j.cmd = parts[i].get_arg("cmd");
+    j.demand = resource_demand(j.cmd);
+    j.work_ms = node_service_ms(parts[i].get_arg("cmd"), atof(parts[i].get_arg("n").c_str()));
+    j.node = -1;
+    r.jobs.push_back(jobs->size());
+    jobs->push_back(j);
+  }
+  r.jobs_left = r.jobs.size();
+  requests->push_back(r);
+}
+
+static void load_trace(const char* path, std::vector<TraceRequest>* requests,
+                       std::vector<Job>* jobs) {
+  std::ifstream in(path);
+  if (!in) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    std::string work = trace_json_field(line, "work");
+    if (!work.empty()) {
+      add_request(atof(trace_json_field(line, "time").c_str()), Request_msg(0, work),
+                  requests, jobs);
+    }
+  }
+}
+
+static void mixed_trace(std::vector<TraceRequest>* requests, std::vector<Job>* jobs) {
+  const char* cmds[] = { "418wisdom", "418wisdom", "bandwidth", "bandwidth",
+                         "projectidea", "tellmenow" };
+  unsigned int seed = 418;
+  for (double t = 0; t < MIXED_DURATION_MS; t += MIXED_INTERVAL_MS) {
+    Request_msg req(0);
+    req.set_arg("cmd", cmds[rand_r(&seed) % 6]);
+    add_request(t, req, requests, jobs);
+  }
+}
+
+static bool admits(Scheme scheme, const Node& node, const Job& job) {
+  if (scheme == SCHEME_BUDGETS) {
+    return node.usage.admits(job.demand, THREAD_SLOTS);
+  }
+  if (job.cmd == "projectidea") {
+    return !node.running_project_idea &&
+           node.slots_used + PROJECT_IDEA_SLOTS <= THREAD_SLOTS;
+  }
+  return node.slots_used < THREAD_SLOTS;
+}
+
+static void start(Node* node, int node_id, Job* job, int job_id) {
+  job->node = node_id;
+  node->usage.acquire(job->demand);
+  node->slots_used += job->cmd == "projectidea" ? PROJECT_IDEA_SLOTS : 1;
+  if (job->cmd == "projectidea") {
+    node->running_project_idea = true;
+  }
+  node->running.push_back(job_id);
+}
+
+static void finish(Node* node, Job* job, int job_id) {
+  node->usage.release(job->demand);
+  node->slots_used -= job->cmd == "projectidea" ? PROJECT_IDEA_SLOTS : 1;
+  if (job->cmd == "projectidea") {
+    node->running_project_idea = false;
+  }
+  node->running.erase(std::find(node->running.begin(), node->running.end(), job_id));
+}
+
+// Progress a job makes per ms of wall time on its node.
+static double rate(const Node& node, const Job& job) {
+  return node_job_rate(node.running.size(), node.usage, job.cmd, job.demand);
+}
+
+static void replay(Scheme scheme, int num_nodes, std::vector<TraceRequest> requests,
+                   std::vector<Job> jobs) {
+  std::vector<Node> nodes(num_nodes);
+  std::vector<int> pending;
+  size_t next_job = 0;
+  size_t done = 0;
+  double now = 0.0;
+
+  while (done < jobs.size()) {
+    while (next_job < jobs.size() &&
+           requests[jobs[next_job].request].arrival_ms <= now) {
+      pending.push_back(next_job++);
+    }
+
+    // first fit, skipping jobs that nothing admits yet
+    for (size_t i = 0; i < pending.size(); ) {
+      Job& job = jobs[pending[i]];
+      int chosen = -1;
+      for (int n = 0; n < num_nodes && chosen < 0; ++n) {
+        if (admits(scheme, nodes[n], job)) {
+          chosen = n;
+        }
+      }
+      if (chosen < 0) {
+        ++i;
+        continue;
+      }
+      start(&nodes[chosen], chosen, &job, pending[i]);
+      pending.erase(pending.begin() + i);
+    }
+
+    now += STEP_MS;
+    for (int n = 0; n < num_nodes; ++n) {
+      Node& node = nodes[n];
+      std::vector<int> finished;
+      for (size_t i = 0; i < node.running.size(); ++i) {
+        Job& job = jobs[node.running[i]];
+        job.work_ms -= STEP_MS * rate(node, job);
+        if (job.work_ms <= 0) {
+          finished.push_back(node.running[i]);
+        }
+      }
+      for (size_t i = 0; i < finished.size(); ++i) {
+        Job& job = jobs[finished[i]];
+        finish(&node, &job, finished[i]);
+        TraceRequest& r = requests[job.request];
+        if (--r.jobs_left == 0) {
+          r.finish_ms = now;
+        }
+        done++;
+      }
+    }
+  }
+
+  std::vector<double> latencies;
+  std::map<std::string, std::pair<double, int> > by_cmd;
+  for (size_t i = 0; i < requests.size(); ++i) {
+    double latency = requests[i].finish_ms - requests[i].arrival_ms;
+    latencies.push_back(latency);
+    by_cmd[requests[i].cmd].first += latency;
+    by_cmd[requests[i].cmd].second++;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  double total = 0.0;
+  for (size_t i = 0; i < latencies.size(); ++i) {
+    total += latencies[i];
+  }
+
+  printf("%-8s makespan %8.0f ms  mean %7.1f ms  p50 %7.1f  p95 %7.1f  max %7.1f\n",
+         scheme == SCHEME_SLOTS ? "slots" : "budgets", now,
+         total / latencies.size(), latencies[latencies.size() / 2],
+         latencies[latencies.size() * 95 / 100], latencies.back());
+  for (std::map<std::string, std::pair<double, int> >::const_iterator it = by_cmd.begin();
+       it != by_cmd.end(); ++it) {
+    printf("         %-14s n=%-5d mean %7.1f ms\n", it->first.c_str(),
+           it->second.second, it->second.first / it->second.second);
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s tracefile|mixed [nodes]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  int num_nodes = argc > 2 ? atoi(argv[2]) : 2;
+
+  std::vector<TraceRequest> requests;
+  std::vector<Job> jobs;
+  if (strcmp(argv[1], "mixed") == 0) {
+    mixed_trace(&requests, &jobs);
+  } else {
+    load_trace(argv[1], &requests, &jobs);
+  }
+  if (requests.empty()) {
+    fprintf(stderr, "No requests in %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  printf("%s: %zu requests, %zu jobs, %d nodes\n", argv[1], requests.size(),
+         jobs.size(), num_nodes);
+
+  replay(SCHEME_SLOTS, num_nodes, requests, jobs);
+  replay(SCHEME_BUDGETS, num_nodes, requests, jobs);
+  return 0;
+}
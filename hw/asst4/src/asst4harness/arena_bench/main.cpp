@@ -0,0 +1,183 @@
+// Microbenchmark for the bandwidth and projectidea jobs' buffers.
+//
+// --mode=faults: minor page faults and run time per request,
+// allocating per request (before init_work_engine() maps the job
+// arenas) vs. from the pre-faulted arenas.
+//
+// --mode=pages: data TLB misses and run time per request with arenas
+// on small pages, transparent huge pages and hugetlb pages (if any
+// are reserved).
+//
+// Every request is answered every way and the responses must match.
+
+#include <gflags/gflags.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "server/messages.h"
+#include "server/worker.h"
+#include "tools/cycle_timer.h"
+#include "tools/job_arena.h"
+
+extern void init_work_engine();
+extern JobArenaPool* job_arenas;
+
+DEFINE_string(mode, "all", "faults, pages or all");
+
+static const int NUM_REQUESTS = 3;
+static const int PAGE_MODE_REQUESTS = 1;
+static const char* COMMANDS[] = { "bandwidth", "projectidea" };
+static const int NUM_COMMANDS = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+struct Run {
+  double ms;
+  double faults;
+  double tlb_misses;   // -1 without a counter
+  std::string responses[NUM_REQUESTS];
+};
+
+static long minor_faults() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt;
+}
+
+// dTLB load misses of this thread in user space, or -1 if perf
+// events are not available
+static int open_tlb_counter() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static Run run(const char* cmd, int requests) {
+  Run r;
+  int counter = open_tlb_counter();
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  long faults = minor_faults();
+  double startTime = CycleTimer::currentSeconds();
+  for (int i = 0; i < requests; ++i) {
+    char x[32];
+    sprintf(x, "%d", 418 + i);
+    Request_msg req(i);
+    req.set_arg("cmd", cmd);
+    req.set_arg("x", x);
+    Response_msg resp(i);
+    execute_work(req, resp);
+    r.responses[i] = resp.get_response();
+  }
+  r.ms = (CycleTimer::currentSeconds() - startTime) * 1e3 / requests;
+  r.faults = static_cast<double>(minor_faults() - faults) / requests;
+  r.tlb_misses = -1;
+  if (counter >= 0) {
+    long long misses;
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter, &misses, sizeof(misses)) == sizeof(misses)) {
+      r.tlb_misses = static_cast<double>(misses) / requests;
+    }
+    close(counter);
+  }
+  return r;
+}
+
+static void check(const char* cmd, const char* what, const Run& expected, const Run& got,
+                  int requests) {
+  for (int i = 0; i < requests; ++i) {
+    if (got.responses[i] != expected.responses[i]) {
+      fprintf(stderr, "%s request %d: %s expected, %s %s\n", cmd, i,
+              expected.responses[i].c_str(), got.responses[i].c_str(), what);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void fault_report() {
+  Run before[NUM_COMMANDS];
+  for (int c = 0; c < NUM_COMMANDS; ++c) {
+    before[c] = run(COMMANDS[c], NUM_REQUESTS);
+  }
+
+  long faults = minor_faults();
+  double startTime = CycleTimer::currentSeconds();
+  init_work_engine();
+  if (job_arenas == NULL) {
+    fprintf(stderr, "no job arenas (--job_arenas=0?)\n");
+    exit(EXIT_FAILURE);
+  }
+  printf("boot: %d arenas of %zu MB, %ld minor faults, %.1f ms\n",
+         job_arenas->arena_count(), job_arenas->bytes_per_arena() >> 20,
+         minor_faults() - faults, (CycleTimer::currentSeconds() - startTime) * 1e3);
+
+  for (int c = 0; c < NUM_COMMANDS; ++c) {
+    Run after = run(COMMANDS[c], NUM_REQUESTS);
+    check(COMMANDS[c], "with arenas", before[c], after, NUM_REQUESTS);
+    printf("[%s]:\tper request %8.0f -> %6.0f minor faults,  %8.1f -> %8.1f ms\n",
+           COMMANDS[c], before[c].faults, after.faults, before[c].ms, after.ms);
+  }
+  printf("%d requests per command, responses identical\n", NUM_REQUESTS);
+}
+
+static void page_report() {
+  const ArenaPages modes[] = { ARENA_SMALL_PAGES, ARENA_TRANSPARENT_HUGE_PAGES,
+                               ARENA_HUGETLB_PAGES };
+  const int num_modes = sizeof(modes) / sizeof(modes[0]);
+  JobArenaPool* saved = job_arenas;
+  size_t bytes = saved != NULL ? saved->bytes_per_arena() : 64 << 20;
+
+  printf("\n%d request(s) per command and page size:\n", PAGE_MODE_REQUESTS);
+  for (int c = 0; c < NUM_COMMANDS; ++c) {
+    Run small;
+    for (int m = 0; m < num_modes; ++m) {
+      JobArenaPool pool(1, bytes, modes[m]);
+      if (pool.arena_count() != 1 || pool.arenas_with(modes[m]) != 1) {
+        printf("  [%s, %s]:\tnot available\n", COMMANDS[c], arena_pages_name(modes[m]));
+        continue;
+      }
+      job_arenas = &pool;
+      Run r = run(COMMANDS[c], PAGE_MODE_REQUESTS);
+      job_arenas = saved;
+      if (m == 0) {
+        small = r;
+      } else {
+        check(COMMANDS[c], arena_pages_name(modes[m]), small, r, PAGE_MODE_REQUESTS);
+      }
+      if (r.tlb_misses >= 0) {
+        printf("  [%s, %s]:\t%10.0f dTLB misses, %8.1f ms\n", COMMANDS[c],
+               arena_pages_name(modes[m]), r.tlb_misses, r.ms);
+      } else {
+        printf("  [%s, %s]:\tdTLB misses n/a, %8.1f ms\n", COMMANDS[c],
+               arena_pages_name(modes[m]), r.ms);
+      }
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_mode == "faults" || FLAGS_mode == "all") {
+    fault_report();
+  }
+  if (FLAGS_mode == "pages" || FLAGS_mode == "all") {
+    page_report();
+  }
+  return 0;
+}
@@ -0,0 +1,610 @@
+// Discrete-event simulator of the whole cluster: the real master
+// handlers (myserver/master.cpp) linked against a simulated harness,
+// so a trace replays in seconds and on simulated time.
+//
+//   ./cluster_sim [--max_workers=4] [--boot_ms=5000] [master flags] tests/grading_wisdom.txt
+//
+// This file implements the harness side of server/master.h: clients
+// send the trace's requests at their trace times once the server is
+// ready, workers come online --boot_ms after they are requested,
+// handle_tick runs every tick period and start_timer timers fire on
+// time.  Everything happens on one simulated clock
+// (master_time_seconds()), one event at a time, so a run is
+// deterministic.
+//
+// Workers are modeled as in admission_replay (tools/node_model.h):
+// every job runs at once and makes progress at a rate that drops when
+// more jobs than hardware threads share the node, when streaming jobs
+// exceed the bandwidth budget, or, for projectidea, when the LLC is
+// oversubscribed.  Service times are the master's cost priors
+// (countprimes scaled by n).  Responses come from the trace, or for
+// countprimes from a sieve, so the master's responses are checked
+// just as workgen.py checks them.  Workers booted with a memo cache
+// (--routing=hash) answer requests they have seen before at no cost,
+// and workers booted with "stats_ms" push load reports: their jobs
+// (all running), smoothed service times, and bandwidth at the peak
+// once the streaming jobs fill the bandwidth budget.
+//
+// The master's policy flags (--scheduler, --admission, --autoscaler,
+// --cache_policy, --thread_num, --threshold, ...) are all available;
+// each run is one process, so scripts/sim_sweep.sh runs a grid of them
+// in parallel.
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "server/master.h"
+#include "server/messages.h"
+#include "tools/cycle_timer.h"
+#include "tools/hdr_histogram.h"
+#include "tools/node_budget.h"
+#include "tools/node_model.h"
+#include "tools/prime_sieve.h"
+#include "tools/response_cache.h"
+
+DEFINE_int32(max_workers, 2, "Maximum number of workers the master can request");
+DEFINE_int32(boot_ms, 5000, "Time from request_new_worker_node to the worker being online");
+DEFINE_int32(drain_s, 600, "Simulated seconds to wait for responses after the last arrival");
+DEFINE_bool(verbose, false, "Print every incorrect response");
+
+static const int64_t SIEVE_LIMIT = 1 << 27;
+
+// a job with less work left than this is done
+static const double WORK_EPSILON_MS = 1e-6;
+
+// smoothing of the service times in load reports, as on a worker
+static const double SERVICE_TIME_ALPHA = 0.3;
+
+enum EventKind {
+  EVENT_ARRIVAL,        // arg: trace request
+  EVENT_WORKER_ONLINE,  // arg: tag
+  EVENT_WORKER,         // arg: worker id; a job may have finished
+  EVENT_TICK,
+  EVENT_TIMER,          // arg: timer handle
+  EVENT_STATS,          // arg: worker id; generation 1 for a pushed report
+};
+
+struct Event {
+  double time_ms;
+  long seq;             // ties go first come, first served
+  EventKind kind;
+  uint64_t arg;
+  long generation;      // EVENT_WORKER only
+
+  bool operator>(const Event& other) const {
+    if (time_ms != other.time_ms) {
+      return time_ms > other.time_ms;
+    }
+    return seq > other.seq;
+  }
+};
+
+struct TraceRequest {
+  double time_ms;
+  std::string work;
+  std::string resp;
+  std::string cmd;
+
+  double arrival_ms;
+  double response_ms;   // -1 until answered
+  int responses;
+  bool correct;
+};
+
+struct Job {
+  int tag;
+  std::string cmd;
+  ResourceDemand demand;
+  double work_ms;       // left
+  double cost_ms;       // modeled service time
+  double start_ms;
+  std::string response;
+  std::string memo_key; // "" unless the worker memoizes it
+};
+
+struct SimWorker {
+  int id;
+  int tag;
+  bool alive;
+  double online_ms;
+  double updated_ms;    // jobs' work_ms is as of this time
+  long generation;      // of the pending EVENT_WORKER
+  std::vector<Job> jobs;
+  NodeUsage usage;
+  ResponseCache* memo;  // as the master's "memo_mb" boot arg asks, or NULL
+  int stats_ms;         // load report period, 0 = only when asked
+  int stats_seq;
+  double service_ms[NUM_STATS_COMMANDS];
+};
+
+struct Timer {
+  void (*callback)(void* arg);
+  void* arg;
+};
+
+static struct Sim_state {
+  double now_ms;
+  long next_seq;
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event> > events;
+
+  std::vector<TraceRequest> trace;
+  std::map<std::string, std::string> responses;   // canonical request -> resp
+  PrimeCountTable* primes;
+  size_t answered;
+  bool ready;
+  double ready_ms;
+  double last_arrival_ms;
+  uint64_t arrival_ns;
+
+  int tick_ms;
+  Timer_handle next_timer;
+  std::map<Timer_handle, Timer> timers;
+
+  std::map<int, std::string> boot_args;   // tag -> boot request of a worker
+  std::vector<SimWorker*> workers;
+  int alive_workers;
+  int peak_workers;
+  int boots;
+  long lost_jobs;
+  double worker_ms;
+} sim;
+
+static void push_event(double time_ms, EventKind kind, uint64_t arg, long generation = 0) {
+  Event e;
+  e.time_ms = time_ms;
+  e.seq = sim.next_seq++;
+  e.kind = kind;
+  e.arg = arg;
+  e.generation = generation;
+  sim.events.push(e);
+}
+
+/*
+ * Worker model
+ */
+
+// Progress 'job' makes per ms on 'w'.
+static double rate(const SimWorker& w, const Job& job) {
+  return node_job_rate(w.jobs.size(), w.usage, job.cmd, job.demand);
+}
+
+// Bring the jobs of 'w' up to now at their current rates.
+static void progress(SimWorker* w) {
+  double elapsed = sim.now_ms - w->updated_ms;
+  if (elapsed > 0) {
+    for (size_t i = 0; i < w->jobs.size(); ++i) {
+      w->jobs[i].work_ms -= elapsed * rate(*w, w->jobs[i]);
+    }
+  }
+  w->updated_ms = sim.now_ms;
+}
+
+// Rates change whenever jobs come or go: replace the pending
+// completion event of 'w' with one for its next job to finish.
+static void reschedule(SimWorker* w) {
+  w->generation++;
+  if (w->jobs.empty()) {
+    return;
+  }
+  double next = 0.0;
+  for (size_t i = 0; i < w->jobs.size(); ++i) {
+    double t = std::max(0.0, w->jobs[i].work_ms) / rate(*w, w->jobs[i]);
+    if (i == 0 || t < next) {
+      next = t;
+    }
+  }
+  push_event(sim.now_ms + next, EVENT_WORKER, w->id, w->generation);
+}
+
+// The request string the trace has for 'req', without the arguments
+// the master adds on the way to a worker.
+static std::string canonical_request(const Request_msg& req) {
+  std::string str = req.get_request_string();
+  size_t pos = str.find("deadline=");
+  if (pos != std::string::npos && (pos == 0 || str[pos - 1] == ';')) {
+    size_t end = str.find(';', pos);
+    if (end == std::string::npos) {
+      str.erase(pos > 0 ? pos - 1 : pos);
+    } else {
+      str.erase(pos, end - pos + 1);
+    }
+  }
+  return str;
+}
+
+static std::string worker_response(const Request_msg& req) {
+  if (req.get_arg("cmd") == "countprimes") {
+    std::ostringstream oss;
+    oss << sim.primes->count_primes(atoll(req.get_arg("n").c_str()));
+    return oss.str();
+  }
+  std::map<std::string, std::string>::const_iterator it =
+    sim.responses.find(canonical_request(req));
+  return it != sim.responses.end() ? it->second : "";
+}
+
+static void worker_event(SimWorker* w) {
+  progress(w);
+  std::vector<Job> done;
+  for (size_t i = 0; i < w->jobs.size(); ) {
+    if (w->jobs[i].work_ms <= WORK_EPSILON_MS) {
+      done.push_back(w->jobs[i]);
+      w->usage.release(w->jobs[i].demand);
+      w->jobs.erase(w->jobs.begin() + i);
+    } else {
+      ++i;
+    }
+  }
+  reschedule(w);
+  for (size_t i = 0; i < done.size(); ++i) {
+    int c = stats_command(done[i].cmd);
+    if (c >= 0) {
+      double ms = sim.now_ms - done[i].start_ms;
+      double& recent = w->service_ms[c];
+      recent = recent == 0.0 ? ms : recent + SERVICE_TIME_ALPHA * (ms - recent);
+    }
+  }
+  for (size_t i = 0; i < done.size() && w->memo != NULL; ++i) {
+    if (!done[i].memo_key.empty()) {
+      w->memo->insert(done[i].memo_key, done[i].response, done[i].cost_ms);
+    }
+  }
+  for (size_t i = 0; i < done.size() && w->alive; ++i) {
+    Response_msg resp(done[i].tag);
+    resp.set_response(done[i].response);
+    handle_worker_response(w, resp);
+  }
+}
+
+static void send_worker_report(SimWorker* w) {
+  worker_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  stats.seq = ++w->stats_seq;
+  stats.busy_threads = w->jobs.size();
+  int streaming = 0;
+  for (size_t i = 0; i < w->jobs.size(); ++i) {
+    streaming += w->jobs[i].demand.bandwidth;
+  }
+  for (int c = 0; c < NUM_STATS_COMMANDS; ++c) {
+    stats.service_ms[c] = w->service_ms[c];
+  }
+  stats.bandwidth_mbps = std::min(NODE_MEMORY_BANDWIDTH_MBPS,
+                                  streaming * NODE_MEMORY_BANDWIDTH_MBPS / NODE_BANDWIDTH_UNITS);
+  handle_worker_stats(w, stats);
+}
+
+/*
+ * The harness API of server/master.h
+ */
+
+void send_client_response(Client_handle client_handle, const Response_msg& resp) {
+  size_t index = reinterpret_cast<uintptr_t>(client_handle) - 1;
+  CHECK_LT(index, sim.trace.size()) << "Response to an unknown client";
+  TraceRequest& r = sim.trace[index];
+  if (r.responses++ > 0) {
+    LOG(ERROR) << "Second response to request " << index << ": " << r.work;
+    return;
+  }
+  r.response_ms = sim.now_ms;
+  r.correct = resp.get_response() == r.resp;
+  if (!r.correct && FLAGS_verbose) {
+    printf("ERROR: incorrect response to req %zu: (req: %s)\n", index, r.work.c_str());
+    printf("       expected: '%s'\n", r.resp.c_str());
+    printf("       received: '%s'\n", resp.get_response().c_str());
+  }
+  sim.answered++;
+}
+
+void send_request_to_worker(Worker_handle worker_handle, const Request_msg& req) {
+  SimWorker* w = static_cast<SimWorker*>(worker_handle);
+  CHECK(w->alive) << "Attempt to send work to invalid worker";
+  progress(w);
+  Job job;
+  job.tag = req.get_tag();
+  job.cmd = req.get_arg("cmd");
+  job.demand = resource_demand(job.cmd);
+  job.cost_ms = node_service_ms(req.get_arg("cmd"), atof(req.get_arg("n").c_str()));
+  job.work_ms = job.cost_ms;
+  job.start_ms = sim.now_ms;
+  job.response = worker_response(req);
+  // the worker memoizes all but tellmenow; a hit costs no work
+  if (w->memo != NULL && job.cmd != "tellmenow") {
+    job.memo_key = canonical_request(req);
+    if (w->memo->lookup(job.memo_key) != NULL) {
+      job.work_ms = 0.0;
+      job.memo_key.clear();
+    }
+  }
+  w->jobs.push_back(job);
+  w->usage.acquire(job.demand);
+  reschedule(w);
+}
+
+void request_worker_stats(Worker_handle worker_handle) {
+  SimWorker* w = static_cast<SimWorker*>(worker_handle);
+  CHECK(w->alive) << "Attempt to request stats of invalid worker";
+  push_event(sim.now_ms, EVENT_STATS, w->id);
+}
+
+void request_new_worker_node(const Request_msg& req) {
+  sim.boots++;
+  sim.boot_args[req.get_tag()] = req.get_request_string();
+  push_event(sim.now_ms + FLAGS_boot_ms, EVENT_WORKER_ONLINE, req.get_tag());
+}
+
+void kill_worker_node(Worker_handle worker_handle) {
+  SimWorker* w = static_cast<SimWorker*>(worker_handle);
+  CHECK(w->alive) << "Attempt to kill non worker";
+  w->alive = false;
+  w->generation++;
+  sim.lost_jobs += w->jobs.size();
+  w->jobs.clear();
+  delete w->memo;
+  w->memo = NULL;
+  sim.worker_ms += sim.now_ms - w->online_ms;
+  sim.alive_workers--;
+}
+
+void server_init_complete() {
+  if (sim.ready) {
+    return;
+  }
+  sim.ready = true;
+  sim.ready_ms = sim.now_ms;
+  for (size_t i = 0; i < sim.trace.size(); ++i) {
+    sim.trace[i].arrival_ms = sim.ready_ms + sim.trace[i].time_ms;
+    sim.last_arrival_ms = std::max(sim.last_arrival_ms, sim.trace[i].arrival_ms);
+    push_event(sim.trace[i].arrival_ms, EVENT_ARRIVAL, i);
+  }
+}
+
+Timer_handle start_timer(int delay_ms, void (*callback)(void* arg), void* arg) {
+  Timer_handle handle = sim.next_timer++;
+  Timer& t = sim.timers[handle];
+  t.callback = callback;
+  t.arg = arg;
+  push_event(sim.now_ms + std::max(1, delay_ms), EVENT_TIMER, handle);
+  return handle;
+}
+
+bool cancel_timer(Timer_handle timer) {
+  return sim.timers.erase(timer) > 0;
+}
+
+uint64_t client_request_arrival_ns() {
+  return sim.arrival_ns;
+}
+
+double master_time_seconds() {
+  return sim.now_ms / 1000.0;
+}
+
+/*
+ * Driver
+ */
+
+static void load_trace(const char* path) {
+  std::ifstream in(path);
+  if (!in) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    std::string work = trace_json_field(line, "work");
+    if (work.empty()) {
+      continue;
+    }
+    TraceRequest r;
+    r.time_ms = atof(trace_json_field(line, "time").c_str());
+    r.work = work;
+    r.resp = trace_json_field(line, "resp");
+    r.cmd = Request_msg(0, work).get_arg("cmd");
+    r.arrival_ms = 0.0;
+    r.response_ms = -1.0;
+    r.responses = 0;
+    r.correct = false;
+    sim.trace.push_back(r);
+    sim.responses[Request_msg(0, work).get_request_string()] = r.resp;
+  }
+}
+
+static void run_event(const Event& e) {
+  switch (e.kind) {
+  case EVENT_ARRIVAL: {
+    TraceRequest& r = sim.trace[e.arg];
+    sim.arrival_ns = static_cast<uint64_t>(sim.now_ms * 1e6);
+    handle_client_request(reinterpret_cast<Client_handle>(e.arg + 1),
+                          Request_msg(0, r.work));
+    break;
+  }
+  case EVENT_WORKER_ONLINE: {
+    SimWorker* w = new SimWorker;
+    w->id = sim.workers.size();
+    w->alive = true;
+    w->online_ms = sim.now_ms;
+    w->updated_ms = sim.now_ms;
+    w->generation = 0;
+    w->memo = NULL;
+    Request_msg boot(0, sim.boot_args[e.arg]);
+    sim.boot_args.erase(e.arg);
+    // as worker/main.cpp does, the worker registers under the tag in
+    // its boot params
+    w->tag = atoi(boot.get_arg("tag").c_str());
+    int memo_mb = atoi(boot.get_arg("memo_mb").c_str());
+    if (memo_mb > 0) {
+      w->memo = new ResponseCache(static_cast<size_t>(memo_mb) * 1024 * 1024, CACHE_COST);
+    }
+    w->stats_ms = atoi(boot.get_arg("stats_ms").c_str());
+    w->stats_seq = 0;
+    for (int c = 0; c < NUM_STATS_COMMANDS; ++c) {
+      w->service_ms[c] = 0.0;
+    }
+    if (w->stats_ms > 0) {
+      push_event(sim.now_ms + w->stats_ms, EVENT_STATS, w->id, 1);
+    }
+    sim.workers.push_back(w);
+    sim.alive_workers++;
+    sim.peak_workers = std::max(sim.peak_workers, sim.alive_workers);
+    handle_new_worker_online(w, w->tag);
+    break;
+  }
+  case EVENT_WORKER: {
+    SimWorker* w = sim.workers[e.arg];
+    if (w->alive && e.generation == w->generation) {
+      worker_event(w);
+    }
+    break;
+  }
+  case EVENT_STATS: {
+    SimWorker* w = sim.workers[e.arg];
+    if (!w->alive) {
+      break;
+    }
+    if (e.generation == 1) {
+      push_event(sim.now_ms + w->stats_ms, EVENT_STATS, w->id, 1);
+    }
+    progress(w);
+    send_worker_report(w);
+    break;
+  }
+  case EVENT_TICK:
+    handle_tick();
+    push_event(sim.now_ms + sim.tick_ms, EVENT_TICK, 0);
+    break;
+  case EVENT_TIMER: {
+    std::map<Timer_handle, Timer>::iterator it = sim.timers.find(e.arg);
+    if (it != sim.timers.end()) {
+      Timer t = it->second;
+      sim.timers.erase(it);
+      t.callback(t.arg);
+    }
+    break;
+  }
+  }
+}
+
+static void print_histogram(const char* name, const HdrHistogram& h) {
+  std::ostringstream out;
+  h.dump(out);
+  printf("  %-14s %s\n", name, out.str().c_str());
+}
+
+static int report(const char* path, double wall_seconds) {
+  HdrHistogram all;
+  std::map<std::string, HdrHistogram> by_cmd;
+  int correct = 0;
+  int incorrect = 0;
+  int missing = 0;
+  for (size_t i = 0; i < sim.trace.size(); ++i) {
+    const TraceRequest& r = sim.trace[i];
+    if (r.response_ms < 0) {
+      missing++;
+      continue;
+    }
+    uint64_t latency_us = static_cast<uint64_t>((r.response_ms - r.arrival_ms) * 1000.0);
+    all.record(latency_us);
+    by_cmd[r.cmd].record(latency_us);
+    if (r.correct) {
+      correct++;
+    } else {
+      incorrect++;
+    }
+  }
+  double worker_seconds = sim.worker_ms / 1000.0;
+  double elapsed = sim.ready ? (sim.now_ms - sim.ready_ms) / 1000.0 : 0.0;
+
+  printf("%s: %zu requests, max_workers=%d boot_ms=%d (%.2f s to simulate)\n", path,
+         sim.trace.size(), FLAGS_max_workers, FLAGS_boot_ms, wall_seconds);
+  printf("Requests:             %d correct, %d incorrect, %d missing\n",
+         correct, incorrect, missing);
+  printf("Total test time:      %.2f sec (simulated)\n", elapsed);
+  printf("Compute used:         %.2f sec (%d boots, at most %d workers, %ld jobs lost to kills)\n",
+         worker_seconds, sim.boots, sim.peak_workers, sim.lost_jobs);
+  printf("Latency (us):\n");
+  print_histogram("all", all);
+  for (std::map<std::string, HdrHistogram>::const_iterator it = by_cmd.begin();
+       it != by_cmd.end(); ++it) {
+    print_histogram(it->first.c_str(), it->second);
+  }
+  // one line for scripts/sim_sweep.sh
+  printf("summary: worker_seconds=%.2f mean_ms=%.1f p99_ms=%.1f incorrect=%d missing=%d\n",
+         worker_seconds, all.mean() / 1000.0, all.percentile(99.0) / 1000.0,
+         incorrect, missing);
+  return incorrect > 0 || missing > 0 ? EXIT_FAILURE : 0;
+}
+
+int main(int argc, char** argv) {
+  google::SetUsageMessage("cluster_sim [flags] tracefile");
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s [flags] tracefile\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  load_trace(argv[1]);
+  if (sim.trace.empty()) {
+    fprintf(stderr, "No requests in %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  sim.now_ms = 0.0;
+  sim.next_seq = 0;
+  sim.primes = new PrimeCountTable(SIEVE_LIMIT);
+  sim.answered = 0;
+  sim.ready = false;
+  sim.ready_ms = 0.0;
+  sim.last_arrival_ms = 0.0;
+  sim.arrival_ns = 0;
+  sim.next_timer = 1;       // 0 is "no timer" to the master
+  sim.alive_workers = 0;
+  sim.peak_workers = 0;
+  sim.boots = 0;
+  sim.lost_jobs = 0;
+  sim.worker_ms = 0.0;
+
+  double start = CycleTimer::currentSeconds();
+  int tick_seconds;
+  master_node_init(FLAGS_max_workers, tick_seconds);
+  sim.tick_ms = std::max(1, tick_seconds * 1000);
+  push_event(sim.tick_ms, EVENT_TICK, 0);
+
+  while (sim.answered < sim.trace.size() && !sim.events.empty()) {
+    Event e = sim.events.top();
+    sim.events.pop();
+    double limit = (sim.ready ? sim.last_arrival_ms : 0.0) + FLAGS_drain_s * 1000.0;
+    if (e.time_ms > limit) {
+      break;
+    }
+    sim.now_ms = e.time_ms;
+    run_event(e);
+  }
+
+  // workers still up are charged until the end, as the harness does
+  for (size_t i = 0; i < sim.workers.size(); ++i) {
+    if (sim.workers[i]->alive) {
+      sim.worker_ms += sim.now_ms - sim.workers[i]->online_ms;
+    }
+  }
+  int status = report(argv[1], CycleTimer::currentSeconds() - start);
+
+  for (size_t i = 0; i < sim.workers.size(); ++i) {
+    delete sim.workers[i]->memo;
+    delete sim.workers[i];
+  }
+  delete sim.primes;
+  return status;
+}
@@ -0,0 +1,100 @@
+// Microbenchmark: master -> worker request round trip in the text
+// ("k=v;k=v") encoding vs. the binary encoding.
+//
+// Each round trip is what one request costs between the master's
+// send_request_to_worker() and the worker's main loop: serialize the
+// Request_msg, then rebuild it from the bytes on the wire.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "server/messages.h"
+#include "tools/cycle_timer.h"
+
+static const int NUM_ROUND_TRIPS = 1000 * 1000;
+static const int NUM_TRIALS = 3;
+
+// one of each request type, as they appear in tests/*.txt
+static const char* SAMPLE_REQUESTS[] = {
+  "cmd=418wisdom;x=84443",
+  "cmd=countprimes;n=193425",
+  "cmd=compareprimes;n1=102381;n2=180421;n3=58213;n4=291871",
+  "cmd=bandwidth;x=31",
+  "cmd=tellmenow;x=1212",
+  "cmd=projectidea;x=76",
+};
+static const int NUM_SAMPLES = sizeof(SAMPLE_REQUESTS) / sizeof(SAMPLE_REQUESTS[0]);
+
+static double run_text(const std::vector<Request_msg>& reqs, size_t* bytes) {
+  double startTime = CycleTimer::currentSeconds();
+  size_t total = 0;
+  for (int i = 0; i < NUM_ROUND_TRIPS; ++i) {
+    const Request_msg& req = reqs[i % reqs.size()];
+    std::string wire = req.get_request_string();
+    Request_msg decoded(req.get_tag(), wire.data(), wire.size());
+    total += wire.size() + decoded.get_tag();
+  }
+  double endTime = CycleTimer::currentSeconds();
+  *bytes = total;
+  return endTime - startTime;
+}
+
+static double run_binary(const std::vector<Request_msg>& reqs, size_t* bytes) {
+  double startTime = CycleTimer::currentSeconds();
+  size_t total = 0;
+  std::string wire;
+  for (int i = 0; i < NUM_ROUND_TRIPS; ++i) {
+    const Request_msg& req = reqs[i % reqs.size()];
+    req.get_request_binary(wire);
+    Request_msg decoded(req.get_tag());
+    if (!decoded.parse_request_binary(wire.data(), wire.size())) {
+      fprintf(stderr, "binary decode failed\n");
+      exit(EXIT_FAILURE);
+    }
+    total += wire.size() + decoded.get_tag();
+  }
+  double endTime = CycleTimer::currentSeconds();
+  *bytes = total;
+  return endTime - startTime;
+}
+
+int main() {
+  std::vector<Request_msg> reqs;
+  for (int i = 0; i < NUM_SAMPLES; ++i) {
+    reqs.push_back(Request_msg(0, SAMPLE_REQUESTS[i]));
+
+    // both encodings must give back exactly the same request
+    std::string wire;
+    reqs.back().get_request_binary(wire);
+    Request_msg decoded(0);
+    if (!decoded.parse_request_binary(wire.data(), wire.size()) ||
+        decoded.get_request_string() != reqs.back().get_request_string()) {
+      fprintf(stderr, "binary round trip mismatch for %s\n", SAMPLE_REQUESTS[i]);
+      exit(EXIT_FAILURE);
+    }
+    printf("%-60s text=%2zu bytes  binary=%2zu bytes\n", SAMPLE_REQUESTS[i],
+           reqs.back().get_request_string().size(), wire.size());
+  }
+
+  double minText = 1e30;
+  double minBinary = 1e30;
+  size_t textBytes = 0;
+  size_t binaryBytes = 0;
+  for (int i = 0; i < NUM_TRIALS; ++i) {
+    minText = std::min(minText, run_text(reqs, &textBytes));
+    minBinary = std::min(minBinary, run_binary(reqs, &binaryBytes));
+  }
+
+  printf("[text round trip]:\t[%.1f] ns/request\t[%.1f] bytes/request\n",
+         minText * 1e9 / NUM_ROUND_TRIPS,
+         static_cast<double>(textBytes) / NUM_ROUND_TRIPS);
+  printf("[binary round trip]:\t[%.1f] ns/request\t[%.1f] bytes/request\t(%.2fx speedup)\n",
+         minBinary * 1e9 / NUM_ROUND_TRIPS,
+         static_cast<double>(binaryBytes) / NUM_ROUND_TRIPS,
+         minText / minBinary);
+  return 0;
+}
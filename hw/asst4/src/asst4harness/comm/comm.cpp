@@ -3,17 +3,34 @@
 #include <assert.h>
 #include <boost/make_shared.hpp>
 #include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string.h>
 
 #include "comm/comm.h"
 
+// Sockets the master reads without blocking are O_NONBLOCK, so a
+// write can fail with EAGAIN when the peer is slow; wait for room.
+static bool wait_writable(int fd) {
+  if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    return false;
+  }
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+  return poll(&pfd, 1, -1) >= 0 || errno == EINTR;
+}
+
 static int send_all(int fd, const void* buf, size_t len) {
   const char* cbuf = reinterpret_cast<const char*>(buf);
   size_t sent = 0;
   do {
     ssize_t ret = send(fd, &cbuf[sent], len - sent, 0);
-    if (ret == -1 && errno != EINTR) {
+    if (ret == -1 && (errno == EINTR || wait_writable(fd))) {
+      continue;
+    } else if (ret == -1) {
       return -1;
     } else if (ret == 0) {
       return -1;
@@ -24,6 +41,46 @@ static int send_all(int fd, const void* buf, size_t len) {
   return 0;
 }
 
+// Write every iovec, resuming after partial writes.
+static int writev_all(int fd, struct iovec* iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t ret = writev(fd, iov, iovcnt);
+    if (ret == -1 && (errno == EINTR || wait_writable(fd))) {
+      continue;
+    } else if (ret <= 0) {
+      return -1;
+    }
+    size_t written = ret;
+    while (iovcnt > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = reinterpret_cast<char*>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+// Send header, length and payload of a message with one writev().
+static int send_framed(int fd, message_t message, int tag,
+                       const int* buf_len, const char* buf) {
+  tagged_message_t header;
+  header.message = message;
+  header.tag = tag;
+
+  struct iovec iov[3];
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = const_cast<int*>(buf_len);
+  iov[1].iov_len = sizeof(*buf_len);
+  iov[2].iov_base = const_cast<char*>(buf);
+  iov[2].iov_len = *buf_len;
+  return writev_all(fd, iov, 3);
+}
+
 static int recv_all(int fd, void* buf, size_t len) {
   char* cbuf = reinterpret_cast<char*>(buf);
   size_t received = 0;
@@ -72,14 +129,11 @@ int recv_work(int fd, work_t* work) {
 }
 
 int send_work(int fd, const work_t& work, int tag) {
-  int err = send_message(fd, WORK, tag);
-  if (err == 0) {
-    err = send_all(fd, &work.buf_len, sizeof(work.buf_len));
-    if (err == 0) {
-      err = send_all(fd, work.buf.get(), work.buf_len);
-    }
-  }
-  return err;
+  return send_work(fd, work, tag, WORK);
+}
+
+int send_work(int fd, const work_t& work, int tag, message_t message) {
+  return send_framed(fd, message, tag, &work.buf_len, work.buf.get());
 }
 
 int recv_resp(int fd, resp_t* resp) {
@@ -92,21 +146,21 @@ int recv_resp(int fd, resp_t* resp) {
 }
 
 int send_resp(int fd, const resp_t& resp, int tag) {
-  int err = send_message(fd, RESPONSE, tag);
-  if (err == 0) {
-    err = send_all(fd, &resp.buf_len, sizeof(resp.buf_len));
-    if (err == 0) {
-      err = send_all(fd, resp.buf.get(), resp.buf_len);
-    }
-  }
-  return err;
+  return send_framed(fd, RESPONSE, tag, &resp.buf_len, resp.buf.get());
 }
 
 int recv_worker_stats(int fd, worker_stats_t* stats) {
+  int len;
+  int err = recv_all(fd, &len, sizeof(len));
+  if (err < 0) return err;
+  if (len != sizeof(*stats)) return -1;
   return recv_all(fd, stats, sizeof(*stats));
 }
 
 int send_worker_stats(int fd, const worker_stats_t& stats) {
+  int len = sizeof(stats);
+  int err = send_all(fd, &len, sizeof(len));
+  if (err < 0) return err;
   return send_all(fd, &stats, sizeof(stats));
 }
 
@@ -117,3 +171,209 @@ int send_string(int fd, const std::string& s) {
   if (err < 0) return err;
   return send_all(fd, s.c_str(), len);
 }
+
+int send_raw(int fd, const std::string& bytes) {
+  return send_all(fd, bytes.data(), bytes.size());
+}
+
+void MessageWriter::append_message(message_t message, int tag) {
+  tagged_message_t header;
+  header.message = message;
+  header.tag = tag;
+  pending_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+void MessageWriter::append_frame(message_t message, int tag,
+                                 const char* buf, int len) {
+  append_message(message, tag);
+  pending_.append(reinterpret_cast<const char*>(&len), sizeof(len));
+  pending_.append(buf, len);
+}
+
+void MessageWriter::append_work(const work_t& work, int tag, message_t message) {
+  append_frame(message, tag, work.buf.get(), work.buf_len);
+}
+
+void MessageWriter::append_resp(const resp_t& resp, int tag) {
+  append_frame(RESPONSE, tag, resp.buf.get(), resp.buf_len);
+}
+
+void MessageWriter::append_stats(const worker_stats_t& stats, int tag) {
+  append_frame(STATS, tag, reinterpret_cast<const char*>(&stats), sizeof(stats));
+}
+
+void MessageWriter::take_pending(std::string* out) {
+  out->clear();
+  out->swap(pending_);
+}
+
+int MessageWriter::flush() {
+  if (pending_.empty()) {
+    return 0;
+  }
+  int err = send_all(fd_, pending_.data(), pending_.size());
+  pending_.clear();
+  return err;
+}
+
+// big enough for a few hundred typical requests or responses
+static const size_t READ_BUFFER_SIZE = 64 * 1024;
+
+MessageReader::MessageReader(int fd)
+  : fd_(fd), buffer_(READ_BUFFER_SIZE), start_(0), end_(0) {}
+
+int MessageReader::read_exact(void* buf, size_t len) {
+  char* cbuf = reinterpret_cast<char*>(buf);
+  size_t copied = 0;
+  while (copied < len) {
+    if (start_ == end_) {
+      // Large payloads bypass the buffer; otherwise refill it with
+      // whatever the socket has ready.
+      if (len - copied >= buffer_.size()) {
+        return recv_all(fd_, cbuf + copied, len - copied);
+      }
+      start_ = end_ = 0;
+      ssize_t ret = recv(fd_, &buffer_[0], buffer_.size(), 0);
+      if (ret == -1 && errno == EINTR) {
+        continue;
+      } else if (ret <= 0) {
+        return -1;
+      }
+      end_ = ret;
+    }
+    size_t n = end_ - start_;
+    if (n > len - copied) {
+      n = len - copied;
+    }
+    memcpy(cbuf + copied, &buffer_[start_], n);
+    start_ += n;
+    copied += n;
+  }
+  return 0;
+}
+
+int MessageReader::recv_message(message_t* message, int* tag) {
+  tagged_message_t to_recv;
+  int ret = read_exact(&to_recv, sizeof(to_recv));
+  if (ret == 0) {
+    *tag = to_recv.tag;
+    *message = to_recv.message;
+  }
+  return ret;
+}
+
+int MessageReader::recv_work(work_t* work) {
+  int err = read_exact(&work->buf_len, sizeof(work->buf_len));
+  if (err == 0) {
+    work->buf = boost::make_shared<char[]>(work->buf_len);
+    err = read_exact(work->buf.get(), work->buf_len);
+  }
+  return err;
+}
+
+int MessageReader::recv_resp(resp_t* resp) {
+  int err = read_exact(&resp->buf_len, sizeof(resp->buf_len));
+  if (err == 0) {
+    resp->buf = boost::make_shared<char[]>(resp->buf_len);
+    err = read_exact(resp->buf.get(), resp->buf_len);
+  }
+  return err;
+}
+
+bool MessageReader::has_buffered_message() const {
+  return end_ - start_ >= sizeof(tagged_message_t);
+}
+
+bool message_has_payload(message_t message) {
+  // SHUTDOWN is handled as a WORK message by the master
+  return message == WORK || message == WORK_BINARY ||
+         message == RESPONSE || message == SHUTDOWN || message == STATS;
+}
+
+// Read chunk size, and how much one fill() may pull in before
+// returning to the event loop (the socket stays readable, so the rest
+// is picked up on the next wakeup).
+static const size_t INPUT_CHUNK_SIZE = 64 * 1024;
+static const size_t INPUT_FILL_LIMIT = 1024 * 1024;
+
+InputBuffer::InputBuffer()
+  : buffer_(INPUT_CHUNK_SIZE), start_(0), end_(0) {}
+
+int InputBuffer::fill(int fd) {
+  size_t total = 0;
+  while (total < INPUT_FILL_LIMIT) {
+    // slide the unparsed tail to the front, growing if a large
+    // payload needs more room
+    if (start_ > 0) {
+      memmove(&buffer_[0], &buffer_[start_], end_ - start_);
+      end_ -= start_;
+      start_ = 0;
+    }
+    if (buffer_.size() - end_ < INPUT_CHUNK_SIZE / 2) {
+      buffer_.resize(buffer_.size() * 2);
+    }
+
+    size_t space = buffer_.size() - end_;
+    ssize_t ret = recv(fd, &buffer_[end_], space, 0);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    } else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else if (ret <= 0) {
+      return -1;
+    }
+    end_ += ret;
+    total += ret;
+    if (static_cast<size_t>(ret) < space) {
+      break;  // drained; skip the extra recv() that would say EAGAIN
+    }
+  }
+  return total;
+}
+
+bool InputBuffer::peek_message(message_t* message) const {
+  tagged_message_t header;
+  if (end_ - start_ < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, &buffer_[start_], sizeof(header));
+  *message = header.message;
+  return true;
+}
+
+int InputBuffer::next_message(message_t* message, int* tag,
+                               const char** payload, int* payload_len) {
+  size_t avail = end_ - start_;
+  tagged_message_t header;
+  if (avail < sizeof(header)) {
+    return 0;
+  }
+  memcpy(&header, &buffer_[start_], sizeof(header));
+
+  size_t frame = sizeof(header);
+  int len = 0;
+  bool has_payload = message_has_payload(header.message);
+  if (has_payload) {
+    if (avail < frame + sizeof(len)) {
+      return 0;
+    }
+    memcpy(&len, &buffer_[start_ + frame], sizeof(len));
+    frame += sizeof(len);
+    if (len < 0) {
+      return -1;
+    }
+    if (avail < frame + len) {
+      return 0;
+    }
+  }
+
+  *message = header.message;
+  *tag = header.tag;
+  *payload = has_payload ? buffer_.data() + start_ + frame : NULL;
+  *payload_len = len;
+  start_ += frame + len;
+  if (start_ == end_) {
+    start_ = end_ = 0;
+  }
+  return 1;
+}
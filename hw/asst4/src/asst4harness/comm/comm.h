@@ -4,6 +4,7 @@
 #define COMM_COMM_H_
 
 #include <string>
+#include <vector>
 
 #include "types/types.h"
 
@@ -12,6 +13,7 @@ int send_message(int fd, const message_t message, const int tag);
 
 int recv_work(int fd, work_t* work);
 int send_work(int fd, const work_t& work, int tag);
+int send_work(int fd, const work_t& work, int tag, message_t message);
 
 int recv_worker_stats(int fd, worker_stats_t* stats);
 int send_worker_stats(int fd, const worker_stats_t& stats);
@@ -22,4 +24,112 @@ int send_resp(int fd, const resp_t& resp, int tag);
 
 int send_string(int fd, const std::string& args);
 
+// Send bytes that are already framed (e.g. a MessageWriter batch).
+int send_raw(int fd, const std::string& bytes);
+
+/*
+ * MessageWriter --
+ *
+ * Per-connection output buffer.  Messages are framed exactly as
+ * send_work()/send_resp() would send them but only appended to memory;
+ * flush() then writes the whole batch with as few syscalls as the
+ * socket allows.  Not thread safe.
+ */
+class MessageWriter {
+ public:
+  explicit MessageWriter(int fd) : fd_(fd) {}
+
+  void append_message(message_t message, int tag);
+  void append_frame(message_t message, int tag, const char* buf, int len);
+  void append_work(const work_t& work, int tag, message_t message);
+  void append_resp(const resp_t& resp, int tag);
+  void append_stats(const worker_stats_t& stats, int tag);
+
+  // Hand the buffered bytes to the caller (leaving the buffer empty),
+  // e.g. to write them without holding a lock.
+  void take_pending(std::string* out);
+
+  int flush();
+
+  int fd() const { return fd_; }
+  size_t pending_bytes() const { return pending_.size(); }
+
+ private:
+  int fd_;
+  std::string pending_;
+};
+
+/*
+ * MessageReader --
+ *
+ * Buffered input side of a connection: each recv() pulls in as much
+ * as the socket has (up to the buffer size), so a burst of small
+ * messages is decoded from one syscall.  The recv_* calls mirror the
+ * free functions above and block until the requested part has
+ * arrived.  Not thread safe.
+ */
+class MessageReader {
+ public:
+  explicit MessageReader(int fd);
+
+  int recv_message(message_t* message, int* tag);
+  int recv_work(work_t* work);
+  int recv_resp(resp_t* resp);
+
+  // True if a complete message header is already buffered.
+  bool has_buffered_message() const;
+
+  int fd() const { return fd_; }
+
+ private:
+  int read_exact(void* buf, size_t len);
+
+  int fd_;
+  std::vector<char> buffer_;
+  size_t start_;
+  size_t end_;
+};
+
+// True for messages whose header is followed by a length-prefixed
+// payload (work_t, resp_t or worker_stats_t).
+bool message_has_payload(message_t message);
+
+/*
+ * InputBuffer --
+ *
+ * Non-blocking input side of a connection, for event loops.  fill()
+ * takes whatever an O_NONBLOCK socket has ready without waiting, and
+ * next_message() peels complete frames off the front, returning false
+ * while only part of the next frame has arrived, so a slow peer never
+ * stalls the loop.  Not thread safe.
+ */
+class InputBuffer {
+ public:
+  InputBuffer();
+
+  // Returns the number of bytes read (0 if nothing was ready), or -1
+  // once the peer has closed the connection or on error.  Bytes read
+  // before the close stay buffered.
+  int fill(int fd);
+
+  // Decode the next complete message: returns 1 if one was decoded, 0
+  // if the next frame is still incomplete, -1 if it is malformed.  For
+  // messages with a payload, 'payload' points into the buffer and stays
+  // valid until the next fill(); otherwise it is NULL and
+  // 'payload_len' is 0.
+  int next_message(message_t* message, int* tag,
+                    const char** payload, int* payload_len);
+
+  // Type of the next message without consuming it; false until its
+  // header has arrived.
+  bool peek_message(message_t* message) const;
+
+  size_t buffered_bytes() const { return end_ - start_; }
+
+ private:
+  std::vector<char> buffer_;
+  size_t start_;
+  size_t end_;
+};
+
 #endif  // COMM_COMM_H_
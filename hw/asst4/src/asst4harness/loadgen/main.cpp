@@ -0,0 +1,532 @@
+// Load generator: replays a trace (tests/*.txt) against a running
+// master, open loop, as scripts/workgen.py does but without its limits.
+//
+//   ./loadgen [--speed=4] [--threads=2] [--connections=512] host:port tests/grading_wisdom.txt
+//
+// Every request is sent at its trace time (divided by --speed)
+// whether or not earlier ones have been answered, so a slow server
+// shows up as latency rather than as a slower client.  Each thread
+// runs one epoll loop over its own connections, each with at most one
+// request outstanding (responses carry no request id); a request that
+// finds no idle connection opens a new one.  A timerfd wakes the loop
+// at the next send time, and how late each send actually went out is
+// reported, so the generator's own accuracy is visible.
+//
+// Responses are checked against the trace's "resp".  At the end the
+// throughput, latency percentiles per command and the workers' up
+// time (WORKER_UP_TIME_STATS) are printed.  Exits non-zero if any
+// response was wrong or missing.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "comm/comm.h"
+#include "comm/connect.h"
+#include "tools/hdr_histogram.h"
+
+DEFINE_double(speed, 1.0, "Replay the trace this many times faster than recorded");
+DEFINE_int32(threads, 1, "Generator threads, each with its own epoll loop");
+DEFINE_int32(connections, 64, "Connections each thread opens before the trace starts");
+DEFINE_int32(timeout, 60, "Seconds to wait for responses after the last send");
+DEFINE_bool(verbose, false, "Print every incorrect response");
+
+static const int MAX_EVENTS = 256;
+
+struct TraceRequest {
+  uint64_t time_ns;     // send time, after --speed
+  std::string work;
+  std::string resp;
+  std::string cmd;
+};
+
+enum Outcome {
+  PENDING,
+  CORRECT,
+  INCORRECT,
+  FAILED,       // connection lost, or no response before the timeout
+};
+
+struct Result {
+  Outcome outcome;
+  uint64_t sent_ns;
+  uint64_t latency_ns;
+  std::string actual;   // only kept for incorrect responses
+};
+
+struct Conn {
+  int fd;
+  int request;          // outstanding request, -1 if idle
+  InputBuffer in;
+  MessageWriter out;
+
+  explicit Conn(int f) : fd(f), request(-1), out(f) {}
+};
+
+struct Generator {
+  int id;
+  const char* hostport;
+  const std::vector<TraceRequest>* trace;
+  std::vector<int> requests;        // indices into trace, in send order
+  std::vector<Result>* results;
+  uint64_t start_ns;
+
+  std::vector<Conn*> conns;         // open connections of this thread
+  HdrHistogram send_lag_us;
+  int opened;                       // connections, incl. the initial ones
+  int max_in_flight;
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Trace parsing.  Lines are JSON objects but with a fixed shape, so
+ * this only looks up "name": and reads the string or number after it
+ * (unescaping \" and \\), straight out of the mapped file.
+ */
+static const char* json_value(const char* line, const char* end, const char* name) {
+  std::string key = std::string("\"") + name + "\":";
+  const char* p = static_cast<const char*>(memmem(line, end - line, key.data(), key.size()));
+  if (p == NULL) {
+    return NULL;
+  }
+  p += key.size();
+  while (p < end && *p == ' ') {
+    p++;
+  }
+  return p < end ? p : NULL;
+}
+
+static bool json_string(const char* line, const char* end, const char* name,
+                        std::string* out) {
+  const char* p = json_value(line, end, name);
+  if (p == NULL || *p != '"') {
+    return false;
+  }
+  out->clear();
+  for (++p; p < end && *p != '"'; ++p) {
+    if (*p == '\\' && p + 1 < end) {
+      ++p;
+    }
+    out->push_back(*p);
+  }
+  return p < end;
+}
+
+static bool json_number(const char* line, const char* end, const char* name, double* out) {
+  const char* p = json_value(line, end, name);
+  if (p == NULL) {
+    return false;
+  }
+  std::string number(p, std::min<size_t>(end - p, 32));
+  char* stop;
+  *out = strtod(number.c_str(), &stop);
+  return stop != number.c_str();
+}
+
+static bool load_trace(const char* path, std::vector<TraceRequest>* trace) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    fprintf(stderr, "%s: empty trace\n", path);
+    close(fd);
+    return false;
+  }
+  const char* data = static_cast<const char*>(
+    mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+  madvise(const_cast<char*>(data), st.st_size, MADV_SEQUENTIAL);
+
+  const char* end = data + st.st_size;
+  int lineno = 0;
+  for (const char* line = data; line < end; ) {
+    const char* eol = static_cast<const char*>(memchr(line, '\n', end - line));
+    if (eol == NULL) {
+      eol = end;
+    }
+    lineno++;
+    if (memchr(line, '{', eol - line) != NULL) {
+      TraceRequest r;
+      double time_ms;
+      if (!json_number(line, eol, "time", &time_ms) ||
+          !json_string(line, eol, "work", &r.work) ||
+          !json_string(line, eol, "resp", &r.resp)) {
+        fprintf(stderr, "%s:%d: malformed request\n", path, lineno);
+        munmap(const_cast<char*>(data), st.st_size);
+        return false;
+      }
+      r.time_ns = static_cast<uint64_t>(time_ms * 1e6 / FLAGS_speed);
+      size_t cmd = r.work.find("cmd=");
+      if (cmd != std::string::npos) {
+        r.cmd = r.work.substr(cmd + 4, r.work.find(';', cmd) - cmd - 4);
+      }
+      trace->push_back(r);
+    }
+    line = eol + 1;
+  }
+  munmap(const_cast<char*>(data), st.st_size);
+  return true;
+}
+
+// One blocking query (ISREADY, WORKER_UP_TIME_STATS) on a fresh
+// connection; false if the master is not reachable.
+static bool query(const char* hostport, message_t message, std::string* reply) {
+  int fd = connect_to(hostport);
+  if (fd < 0) {
+    return false;
+  }
+  message_t msg;
+  int tag;
+  resp_t resp;
+  bool ok = send_message(fd, message, 0) == 0 &&
+            recv_message(fd, &msg, &tag) == 0 &&
+            recv_resp(fd, &resp) == 0;
+  if (ok) {
+    reply->assign(resp.buf.get(), resp.buf_len);
+  }
+  close(fd);
+  return ok;
+}
+
+static void wait_for_ready(const char* hostport) {
+  std::string reply;
+  while (!query(hostport, ISREADY, &reply) || reply != "ready") {
+    usleep(500 * 1000);
+  }
+}
+
+static Conn* open_conn(Generator* g, int epfd) {
+  int fd = connect_to(g->hostport);
+  if (fd < 0) {
+    return NULL;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  Conn* c = new Conn(fd);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    close(fd);
+    delete c;
+    return NULL;
+  }
+  g->conns.push_back(c);
+  g->opened++;
+  return c;
+}
+
+static void remove_conn(std::vector<Conn*>* conns, Conn* c) {
+  std::vector<Conn*>::iterator it = std::find(conns->begin(), conns->end(), c);
+  if (it != conns->end()) {
+    conns->erase(it);
+  }
+}
+
+static void close_conn(Generator* g, Conn* c) {
+  std::vector<Result>& results = *g->results;
+  if (c->request >= 0 && results[c->request].outcome == PENDING) {
+    results[c->request].outcome = FAILED;
+  }
+  remove_conn(&g->conns, c);
+  close(c->fd);   // also drops it from the epoll set
+  delete c;
+}
+
+// Read what 'c' has; returns false if the connection is gone.
+static bool handle_readable(Conn* c, const std::vector<TraceRequest>& trace,
+                            std::vector<Result>& results, std::vector<Conn*>* idle,
+                            int* in_flight) {
+  int got = c->in.fill(c->fd);
+  message_t message;
+  int tag;
+  const char* payload;
+  int payload_len;
+  int ret;
+  while ((ret = c->in.next_message(&message, &tag, &payload, &payload_len)) == 1) {
+    if (message != RESPONSE || c->request < 0) {
+      return false;
+    }
+    Result& r = results[c->request];
+    r.latency_ns = now_ns() - r.sent_ns;
+    const std::string& expected = trace[c->request].resp;
+    if (static_cast<size_t>(payload_len) == expected.size() &&
+        memcmp(payload, expected.data(), payload_len) == 0) {
+      r.outcome = CORRECT;
+    } else {
+      r.outcome = INCORRECT;
+      r.actual.assign(payload, payload_len);
+    }
+    c->request = -1;
+    (*in_flight)--;
+    idle->push_back(c);
+  }
+  return ret == 0 && got >= 0;
+}
+
+static void* run_generator(void* arg) {
+  Generator* g = static_cast<Generator*>(arg);
+  const std::vector<TraceRequest>& trace = *g->trace;
+  std::vector<Result>& results = *g->results;
+
+  int epfd = epoll_create1(0);
+  int timer = timerfd_create(CLOCK_MONOTONIC, 0);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;     // the timer
+  epoll_ctl(epfd, EPOLL_CTL_ADD, timer, &ev);
+
+  std::vector<Conn*> idle;
+  for (int i = 0; i < FLAGS_connections; ++i) {
+    Conn* c = open_conn(g, epfd);
+    if (c == NULL) {
+      fprintf(stderr, "thread %d: could only open %d connections\n", g->id, i);
+      break;
+    }
+    idle.push_back(c);
+  }
+  // everyone starts together, once all connections are up
+  while (now_ns() < g->start_ns) {
+    usleep(1000);
+  }
+
+  size_t next = 0;
+  int in_flight = 0;
+  uint64_t deadline = 0;
+  struct epoll_event events[MAX_EVENTS];
+  while (next < g->requests.size() || in_flight > 0) {
+    uint64_t now = now_ns();
+    while (next < g->requests.size() && g->start_ns + trace[g->requests[next]].time_ns <= now) {
+      int i = g->requests[next++];
+      Conn* c;
+      if (!idle.empty()) {
+        c = idle.back();
+        idle.pop_back();
+      } else if ((c = open_conn(g, epfd)) == NULL) {
+        results[i].outcome = FAILED;
+        continue;
+      }
+      results[i].sent_ns = now_ns();
+      c->request = i;
+      c->out.append_frame(WORK, 0, trace[i].work.data(), trace[i].work.size());
+      if (c->out.flush() != 0) {
+        close_conn(g, c);
+        continue;
+      }
+      g->send_lag_us.record((results[i].sent_ns - g->start_ns - trace[i].time_ns) / 1000);
+      in_flight++;
+      if (in_flight > g->max_in_flight) {
+        g->max_in_flight = in_flight;
+      }
+    }
+
+    int timeout_ms = -1;
+    if (next < g->requests.size()) {
+      uint64_t at = g->start_ns + trace[g->requests[next]].time_ns;
+      struct itimerspec its;
+      memset(&its, 0, sizeof(its));
+      its.it_value.tv_sec = at / 1000000000ULL;
+      its.it_value.tv_nsec = at % 1000000000ULL;
+      timerfd_settime(timer, TFD_TIMER_ABSTIME, &its, NULL);
+    } else if (in_flight > 0) {
+      if (deadline == 0) {
+        deadline = now_ns() + FLAGS_timeout * 1000000000ULL;
+      }
+      now = now_ns();
+      if (now >= deadline) {
+        break;    // whatever is still outstanding counts as failed
+      }
+      timeout_ms = (deadline - now) / 1000000 + 1;
+    }
+
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+    for (int e = 0; e < n; ++e) {
+      Conn* c = static_cast<Conn*>(events[e].data.ptr);
+      if (c == NULL) {
+        uint64_t expirations;
+        ssize_t ret = read(timer, &expirations, sizeof(expirations));
+        (void)ret;
+        continue;
+      }
+      if (!handle_readable(c, trace, results, &idle, &in_flight)) {
+        if (c->request >= 0) {
+          in_flight--;
+        }
+        remove_conn(&idle, c);
+        close_conn(g, c);
+      }
+    }
+  }
+
+  // requests still outstanding have timed out
+  while (!g->conns.empty()) {
+    close_conn(g, g->conns.back());
+  }
+  for (size_t i = 0; i < g->requests.size(); ++i) {
+    if (results[g->requests[i]].outcome == PENDING) {
+      results[g->requests[i]].outcome = FAILED;
+    }
+  }
+  close(timer);
+  close(epfd);
+  return NULL;
+}
+
+static void print_histogram(const char* name, const HdrHistogram& h) {
+  std::ostringstream out;
+  h.dump(out);
+  printf("  %-14s %s\n", name, out.str().c_str());
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc != 3 || FLAGS_speed <= 0.0 || FLAGS_threads < 1) {
+    fprintf(stderr, "usage: %s [--speed=N] [--threads=N] [--connections=N] host:port tracefile\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char* hostport = argv[1];
+
+  std::vector<TraceRequest> trace;
+  if (!load_trace(argv[2], &trace)) {
+    return EXIT_FAILURE;
+  }
+  std::vector<Result> results(trace.size());
+  for (size_t i = 0; i < results.size(); ++i) {
+    results[i].outcome = PENDING;
+    results[i].sent_ns = 0;
+    results[i].latency_ns = 0;
+  }
+
+  // thousands of connections need more than the default 1024 fds
+  struct rlimit nofile;
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
+  }
+
+  printf("Waiting for server to initialize...\n");
+  fflush(stdout);
+  wait_for_ready(hostport);
+  printf("Server ready, replaying %zu requests at %.2fx\n", trace.size(), FLAGS_speed);
+  fflush(stdout);
+
+  // requests go round robin over the threads
+  std::vector<Generator> gens(FLAGS_threads);
+  uint64_t start_ns = now_ns() + 1000000000ULL;   // time to open connections
+  for (int t = 0; t < FLAGS_threads; ++t) {
+    Generator& g = gens[t];
+    g.id = t;
+    g.hostport = hostport;
+    g.trace = &trace;
+    g.results = &results;
+    g.start_ns = start_ns;
+    g.opened = 0;
+    g.max_in_flight = 0;
+    for (size_t i = t; i < trace.size(); i += FLAGS_threads) {
+      g.requests.push_back(i);
+    }
+  }
+  std::vector<pthread_t> threads(FLAGS_threads);
+  for (int t = 0; t < FLAGS_threads; ++t) {
+    pthread_create(&threads[t], NULL, run_generator, &gens[t]);
+  }
+  for (int t = 0; t < FLAGS_threads; ++t) {
+    pthread_join(threads[t], NULL);
+  }
+  double elapsed = (now_ns() - start_ns) * 1e-9;
+
+  // latencies in microseconds, overall and per command
+  HdrHistogram all;
+  std::map<std::string, HdrHistogram> by_cmd;
+  int correct = 0;
+  int incorrect = 0;
+  int failed = 0;
+  for (size_t i = 0; i < trace.size(); ++i) {
+    const Result& r = results[i];
+    if (r.outcome == CORRECT || r.outcome == INCORRECT) {
+      all.record(r.latency_ns / 1000);
+      by_cmd[trace[i].cmd].record(r.latency_ns / 1000);
+    }
+    if (r.outcome == CORRECT) {
+      correct++;
+    } else if (r.outcome == INCORRECT) {
+      incorrect++;
+      if (FLAGS_verbose) {
+        printf("ERROR: incorrect response to req %zu: (req: %s)\n", i, trace[i].work.c_str());
+        printf("       expected: '%s'\n", trace[i].resp.c_str());
+        printf("       received: '%s'\n", r.actual.c_str());
+      }
+    } else {
+      failed++;
+    }
+  }
+  HdrHistogram send_lag;
+  int opened = 0;
+  int max_in_flight = 0;
+  for (int t = 0; t < FLAGS_threads; ++t) {
+    send_lag.merge(gens[t].send_lag_us);
+    opened += gens[t].opened;
+    max_in_flight += gens[t].max_in_flight;
+  }
+
+  printf("\nRequests:             %zu (%d correct, %d incorrect, %d failed)\n",
+         trace.size(), correct, incorrect, failed);
+  printf("Total test time:      %.2f sec\n", elapsed);
+  printf("Throughput:           %.1f req/s (offered %.1f req/s)\n",
+         (correct + incorrect) / elapsed,
+         trace.empty() ? 0.0 : trace.size() / (trace.back().time_ns * 1e-9 + 1e-9));
+  printf("Connections:          %d opened, peak in flight %d (summed over threads)\n",
+         opened, max_in_flight);
+  printf("Latency (us):\n");
+  print_histogram("all", all);
+  for (std::map<std::string, HdrHistogram>::const_iterator it = by_cmd.begin();
+       it != by_cmd.end(); ++it) {
+    print_histogram(it->first.c_str(), it->second);
+  }
+  printf("Send lag (us):\n");
+  print_histogram("all", send_lag);
+
+  std::string uptime;
+  if (query(hostport, WORKER_UP_TIME_STATS, &uptime)) {
+    int workers = 0;
+    double seconds = 0.0;
+    sscanf(uptime.c_str(), "%d %lf", &workers, &seconds);
+    printf("Compute used:         %.2f sec (%d workers)\n", seconds, workers);
+  }
+
+  if (incorrect > 0 || failed > 0) {
+    printf("*** WARNING: The server returned incorrect or no responses! ***\n");
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
@@ -0,0 +1,365 @@
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "master/io_threads.h"
+#include "tools/mpmc_queue.h"
+#include "tools/request_trace.h"
+
+// Queue capacities.  A full core queue makes the I/O thread wait; the
+// core never waits on a full response queue (see io_threads_flush()).
+#define CORE_QUEUE_SIZE (64 * 1024)
+#define RESPONSE_QUEUE_SIZE (16 * 1024)
+
+// Events the core handles per wakeup before returning to its event
+// loop, so worker traffic and ticks are not starved by a client burst.
+#define CORE_DRAIN_LIMIT 1024
+
+struct IoThread;
+
+struct ClientConn {
+  IoThread* owner;
+  int fd;
+  struct event event;
+  InputBuffer* input;
+  MessageWriter writer;
+  bool seen_message;
+  // messages forwarded to the core that have not been answered yet;
+  // the connection is freed once it is closed and this drops to 0
+  int outstanding;
+  bool closed;
+
+  ClientConn(IoThread* thread, int conn_fd)
+    : owner(thread), fd(conn_fd), input(new InputBuffer), writer(conn_fd),
+      seen_message(false), outstanding(0), closed(false) {}
+  ~ClientConn() { delete input; }
+};
+
+struct OutgoingResponse {
+  ClientConn* client;
+  std::string resp;
+  bool close_after;
+};
+
+/*
+ * Wakeup --
+ *
+ * An eventfd plus a flag so that a burst of queued items costs the
+ * producer one write() and the consumer one wakeup.  The consumer
+ * clears the flag before draining its queue; the fences make sure
+ * that either the producer sees the flag cleared (and writes), or
+ * the consumer sees the item.
+ */
+struct Wakeup {
+  int fd;
+  std::atomic<bool> pending;
+
+  Wakeup() : pending(false) {
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    PCHECK(fd >= 0) << "Cannot create eventfd";
+  }
+
+  void signal() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!pending.exchange(true)) {
+      uint64_t one = 1;
+      PCHECK(write(fd, &one, sizeof(one)) == sizeof(one) || errno == EAGAIN)
+        << "Cannot signal eventfd";
+    }
+  }
+
+  void acknowledge() {
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+    pending.store(false);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+};
+
+struct IoThread {
+  int index;
+  struct event_base* base;
+  struct event accept_event;
+  struct event wakeup_event;
+  Wakeup wakeup;
+  MPMCWorkQueue<OutgoingResponse*> responses;
+  std::vector<ClientConn*> dirty;
+
+  // core side: got responses since the last io_threads_flush(), and
+  // responses that did not fit in the queue yet
+  bool needs_wakeup;
+  std::deque<OutgoingResponse*> overflow;
+  std::atomic<bool> has_overflow;
+
+  IoThread()
+    : responses(RESPONSE_QUEUE_SIZE), needs_wakeup(false), has_overflow(false) {}
+};
+
+static std::vector<IoThread*> io_threads;
+static MPMCWorkQueue<CoreEvent*>* core_events;
+static Wakeup* core_wakeup;
+
+static void push_core_event(CoreEvent* event) {
+  core_events->put_work(event);
+}
+
+static void close_client(ClientConn* client) {
+  if (!client->closed) {
+    client->closed = true;
+    LOG_IF(ERROR, event_del(&client->event) < 0)
+      << "Error deleting event " << client->fd;
+    PLOG_IF(ERROR, close(client->fd)) << "Error closing fd " << client->fd;
+    std::vector<ClientConn*>& dirty = client->owner->dirty;
+    dirty.erase(std::remove(dirty.begin(), dirty.end(), client), dirty.end());
+  }
+  if (client->outstanding == 0) {
+    delete client;
+  }
+}
+
+static void flush_client(ClientConn* client) {
+  if (client->writer.flush() < 0) {
+    LOG(WARNING) << "Lost client connection " << client->fd;
+    close_client(client);
+  }
+}
+
+static bool is_client_message(message_t message) {
+  return message == WORK || message == SHUTDOWN ||
+         message == ISREADY || message == WORKER_UP_TIME_STATS;
+}
+
+// Hand a connection that turned out not to be a client to the core,
+// with its first message still buffered.
+static void hand_off(ClientConn* client) {
+  LOG_IF(ERROR, event_del(&client->event) < 0)
+    << "Error deleting event " << client->fd;
+  CoreEvent* event = new CoreEvent;
+  event->kind = CoreEvent::NEW_CONNECTION;
+  event->client = NULL;
+  event->fd = client->fd;
+  event->input = client->input;
+  client->input = NULL;
+  delete client;
+  push_core_event(event);
+}
+
+static void handle_client_read(int fd, int16_t events, void* arg) {
+  (void)events;
+  ClientConn* client = reinterpret_cast<ClientConn*>(arg);
+  int got = client->input->fill(fd);
+
+  bool forwarded = false;
+  message_t message;
+  int tag;
+  const char* payload;
+  int payload_len;
+  int ret = 0;
+  while (true) {
+    if (!client->seen_message && client->input->peek_message(&message) &&
+        !is_client_message(message)) {
+      hand_off(client);
+      core_wakeup->signal();
+      return;
+    }
+    ret = client->input->next_message(&message, &tag, &payload, &payload_len);
+    if (ret <= 0) {
+      break;
+    }
+    client->seen_message = true;
+    if (!is_client_message(message)) {
+      LOG(ERROR) << "Unexpected message " << message << " from client " << fd;
+      ret = -1;
+      break;
+    }
+
+    CoreEvent* event = new CoreEvent;
+    event->kind = CoreEvent::CLIENT_MESSAGE;
+    event->client = client;
+    event->fd = fd;
+    event->input = NULL;
+    event->message = message;
+    event->tag = tag;
+    event->arrival_ns = trace_now_ns();
+    if (payload != NULL) {
+      // parse here rather than on the core
+      event->request = Request_msg(0, payload, payload_len);
+    }
+    client->outstanding++;
+    push_core_event(event);
+    forwarded = true;
+  }
+
+  if (forwarded) {
+    core_wakeup->signal();
+  }
+  if (ret < 0 || got < 0) {
+    close_client(client);
+  }
+}
+
+static void handle_responses(int fd, int16_t events, void* arg) {
+  (void)fd;
+  (void)events;
+  IoThread* thread = reinterpret_cast<IoThread*>(arg);
+  thread->wakeup.acknowledge();
+
+  OutgoingResponse* out;
+  while (thread->responses.try_get_work(out)) {
+    ClientConn* client = out->client;
+    client->outstanding--;
+    if (client->closed) {
+      // the client went away; drop the response
+      if (client->outstanding == 0) {
+        delete client;
+      }
+    } else {
+      client->writer.append_frame(RESPONSE, 0, out->resp.data(), out->resp.size());
+      if (out->close_after) {
+        LOG_IF(WARNING, client->writer.flush() < 0)
+          << "Lost client connection " << client->fd;
+        close_client(client);
+      } else if (std::find(thread->dirty.begin(), thread->dirty.end(), client)
+                 == thread->dirty.end()) {
+        thread->dirty.push_back(client);
+      }
+    }
+    delete out;
+  }
+  if (thread->has_overflow.load()) {
+    // the core has more for us once there is room
+    core_wakeup->signal();
+  }
+
+  // flush_client() may close (and so unlist) a connection
+  std::vector<ClientConn*> dirty;
+  dirty.swap(thread->dirty);
+  for (size_t i = 0; i < dirty.size(); i++) {
+    flush_client(dirty[i]);
+  }
+}
+
+static void handle_accept(int fd, int16_t events, void* arg) {
+  (void)events;
+  IoThread* thread = reinterpret_cast<IoThread*>(arg);
+
+  // All I/O threads watch the listening socket; whoever loses the race
+  // for a connection just sees EAGAIN.
+  struct sockaddr addr;
+  socklen_t addr_len = sizeof(addr);
+  int conn_fd = accept(fd, &addr, &addr_len);
+  if (conn_fd < 0) {
+    PLOG_IF(ERROR, errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      << "Failure accepting new connection!";
+    return;
+  }
+
+  int flags = fcntl(conn_fd, F_GETFL, 0);
+  PCHECK(flags >= 0 && fcntl(conn_fd, F_SETFL, flags | O_NONBLOCK) == 0)
+    << "Cannot make connection " << conn_fd << " non-blocking";
+
+  ClientConn* client = new ClientConn(thread, conn_fd);
+  event_set(&client->event, conn_fd, EV_READ|EV_PERSIST, handle_client_read, client);
+  event_base_set(thread->base, &client->event);
+  event_add(&client->event, NULL);
+}
+
+static void* io_thread_main(void* arg) {
+  IoThread* thread = reinterpret_cast<IoThread*>(arg);
+  event_base_dispatch(thread->base);
+  LOG(FATAL) << "I/O thread " << thread->index << " event loop exited";
+  return NULL;
+}
+
+void io_threads_start(int count, int accept_fd) {
+  core_events = new MPMCWorkQueue<CoreEvent*>(CORE_QUEUE_SIZE);
+  core_wakeup = new Wakeup;
+
+  int flags = fcntl(accept_fd, F_GETFL, 0);
+  PCHECK(flags >= 0 && fcntl(accept_fd, F_SETFL, flags | O_NONBLOCK) == 0)
+    << "Cannot make listening socket non-blocking";
+
+  for (int i = 0; i < count; i++) {
+    IoThread* thread = new IoThread;
+    thread->index = i;
+    thread->base = event_base_new();
+    CHECK(thread->base != NULL) << "Cannot create event base";
+
+    event_set(&thread->accept_event, accept_fd, EV_READ|EV_PERSIST,
+              handle_accept, thread);
+    event_base_set(thread->base, &thread->accept_event);
+    event_add(&thread->accept_event, NULL);
+
+    event_set(&thread->wakeup_event, thread->wakeup.fd, EV_READ|EV_PERSIST,
+              handle_responses, thread);
+    event_base_set(thread->base, &thread->wakeup_event);
+    event_add(&thread->wakeup_event, NULL);
+
+    io_threads.push_back(thread);
+
+    pthread_t tid;
+    CHECK_EQ(pthread_create(&tid, NULL, io_thread_main, thread), 0)
+      << "Cannot start I/O thread";
+    pthread_detach(tid);
+  }
+}
+
+int io_threads_core_fd() {
+  return core_wakeup->fd;
+}
+
+void io_threads_drain(void (*handler)(CoreEvent* event)) {
+  core_wakeup->acknowledge();
+  CoreEvent* event;
+  for (int i = 0; i < CORE_DRAIN_LIMIT; i++) {
+    if (!core_events->try_get_work(event)) {
+      return;
+    }
+    handler(event);
+  }
+  // more left: come back after the rest of the loop had a turn
+  core_wakeup->signal();
+}
+
+void io_threads_send_response(ClientConn* client, const std::string& resp,
+                              bool close_after) {
+  OutgoingResponse* out = new OutgoingResponse;
+  out->client = client;
+  out->resp = resp;
+  out->close_after = close_after;
+  IoThread* thread = client->owner;
+  if (!thread->overflow.empty() || !thread->responses.try_put_work(out)) {
+    thread->overflow.push_back(out);
+    thread->has_overflow.store(true);
+  }
+  thread->needs_wakeup = true;
+}
+
+// The core must never block on an I/O thread (which may itself be
+// waiting for room in the core queue), so responses that do not fit
+// wait here and are retried on later flushes.
+void io_threads_flush() {
+  for (size_t i = 0; i < io_threads.size(); i++) {
+    IoThread* thread = io_threads[i];
+    while (!thread->overflow.empty() &&
+           thread->responses.try_put_work(thread->overflow.front())) {
+      thread->overflow.pop_front();
+    }
+    thread->has_overflow.store(!thread->overflow.empty());
+    if (thread->needs_wakeup) {
+      thread->needs_wakeup = false;
+      thread->wakeup.signal();
+    }
+  }
+}
@@ -0,0 +1,69 @@
+// Client I/O threads for the master (--io_threads=N).  Each thread has
+// its own event base and owns the client connections it accepts: it
+// reads and parses their requests and writes their responses.  Every
+// decision still happens on one scheduling thread, the "core", which
+// runs the student callbacks one at a time exactly as in the single
+// threaded loop, so scheduling stays deterministic for a given order
+// of arrivals.  The two sides talk over lock-free MPMC queues.
+
+#ifndef MASTER_IO_THREADS_H_
+#define MASTER_IO_THREADS_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "comm/comm.h"
+#include "server/messages.h"
+#include "types/types.h"
+
+// A client connection owned by one I/O thread.  Opaque to the core,
+// which only passes it back in io_threads_send_response().
+struct ClientConn;
+
+/*
+ * CoreEvent --
+ *
+ * Something an I/O thread hands to the scheduling core:
+ *
+ *   CLIENT_MESSAGE  a message from a client; for WORK and SHUTDOWN the
+ *                   request is already parsed into 'request'
+ *   NEW_CONNECTION  a connection whose first message is not a client
+ *                   message (i.e. a worker registering); the core
+ *                   takes over 'fd' and 'input', which still holds
+ *                   that message
+ */
+struct CoreEvent {
+  enum Kind { CLIENT_MESSAGE, NEW_CONNECTION };
+
+  Kind kind;
+  ClientConn* client;
+  int fd;
+  InputBuffer* input;
+  message_t message;
+  int tag;
+  Request_msg request;
+  uint64_t arrival_ns;   // trace_now_ns() when it was parsed
+};
+
+// Start 'count' I/O threads, each with its own event base, sharing the
+// (now non-blocking) listening socket.
+void io_threads_start(int count, int accept_fd);
+
+// Readable whenever core events may be pending.
+int io_threads_core_fd();
+
+// Core thread only: call when io_threads_core_fd() is readable.
+// Hands each pending event to 'handler', which deletes it.
+void io_threads_drain(void (*handler)(CoreEvent* event));
+
+// Core thread only.  Queue 'resp' for the client (dropped if it has
+// disconnected), optionally closing the connection after it is sent.
+void io_threads_send_response(ClientConn* client, const std::string& resp,
+                              bool close_after);
+
+// Core thread only.  Wake the I/O threads that got responses since the
+// last call; call once per core callback.
+void io_threads_flush();
+
+#endif  // MASTER_IO_THREADS_H_
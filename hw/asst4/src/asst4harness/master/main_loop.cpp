@@ -0,0 +1,620 @@
+// Copyright 2013 15418 Course Staff.
+// This was most helpful: http://eradman.com/posts/kqueue-tcp.html
+
+#include <assert.h>
+#include <algorithm>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <boost/make_shared.hpp>
+
+#include "comm/comm.h"
+#include "master/io_threads.h"
+#include "types/types.h"
+#include "server/messages.h"
+#include "server/master.h"
+
+#include  "tools/cycle_timer.h"
+#include "tools/request_trace.h"
+#include "tools/timer_wheel.h"
+
+#define MAX_EVENTS 1024
+
+// Flush a connection's output buffer early once this much is queued.
+#define FLUSH_THRESHOLD (64 * 1024)
+
+// Student timers: 1 ms ticks, and a lap (4 s) longer than the usual
+// request deadline.
+#define TIMER_RESOLUTION_MS 1
+#define TIMER_WHEEL_SLOTS 4096
+
+extern int launcher_fd;
+extern int accept_fd;
+
+DEFINE_bool(log_network, false, "Log network traffic.");
+DEFINE_bool(binary_protocol, true, "Send work to workers in the binary request encoding.");
+DEFINE_int32(io_threads, 0, "Threads that accept and serve client connections "
+             "(0: the scheduling thread does it all).");
+
+#define NETLOG(level) DLOG_IF(level, FLAGS_log_network)
+
+static bool is_server_initialized = false;
+static int num_instances_booted = 0;
+static double total_worker_seconds;
+
+std::map<Worker_handle, double> worker_boot_times;
+boost::unordered_set<Worker_handle> workers;
+// workers that registered with NEW_WORKER_BINARY
+boost::unordered_set<Worker_handle> binary_workers;
+
+// Outgoing messages are buffered per connection and written in one
+// go when the current event callback returns (or earlier, once a
+// buffer passes FLUSH_THRESHOLD), so work for the same worker, or
+// responses for the same client, produced by one event share syscalls.
+static boost::unordered_map<int, MessageWriter*> writers;
+static std::vector<MessageWriter*> dirty_writers;
+
+static MessageWriter* get_writer(int fd) {
+  MessageWriter*& writer = writers[fd];
+  if (writer == NULL) {
+    writer = new MessageWriter(fd);
+  }
+  return writer;
+}
+
+static void flush_writer(MessageWriter* writer) {
+  CHECK_EQ(writer->flush(), 0)
+    << "Unexpected connection failure on " << writer->fd();
+}
+
+static void mark_dirty(MessageWriter* writer) {
+  if (writer->pending_bytes() >= FLUSH_THRESHOLD) {
+    flush_writer(writer);
+    return;
+  }
+  if (std::find(dirty_writers.begin(), dirty_writers.end(), writer)
+      == dirty_writers.end()) {
+    dirty_writers.push_back(writer);
+  }
+}
+
+static void flush_all_writers() {
+  for (size_t i = 0; i < dirty_writers.size(); i++) {
+    flush_writer(dirty_writers[i]);
+  }
+  dirty_writers.clear();
+}
+
+static void drop_writer(int fd) {
+  boost::unordered_map<int, MessageWriter*>::iterator it = writers.find(fd);
+  if (it == writers.end()) {
+    return;
+  }
+  dirty_writers.erase(std::remove(dirty_writers.begin(), dirty_writers.end(),
+                                  it->second),
+                      dirty_writers.end());
+  delete it->second;
+  writers.erase(it);
+}
+
+// When the client request being handled was read (see
+// client_request_arrival_ns()).
+static uint64_t request_arrival_ns = 0;
+
+uint64_t client_request_arrival_ns() {
+  return request_arrival_ns;
+}
+
+double master_time_seconds() {
+  return CycleTimer::currentSeconds();
+}
+
+// Per-connection input buffers: sockets are non-blocking and messages
+// are decoded only once all their bytes have arrived.
+static boost::unordered_map<int, InputBuffer*> inputs;
+
+static void close_connection(void* connection_handle) {
+  struct event* event = reinterpret_cast<struct event*>(connection_handle);
+  CHECK_NE(EVENT_FD(event), accept_fd) << "Critical connection failed\n";
+  CHECK_NE(EVENT_FD(event), launcher_fd) << "Critical connection failed\n";
+
+  // We should never call close_connection() on a worker handle, because
+  // kill_worker() first removes the worker from the worker set and then
+  // we remove it from the event loop here.
+  CHECK(workers.find(connection_handle) == workers.end())
+    << "Unexpected close of worker handle " << EVENT_FD(event);
+
+  NETLOG(INFO) << "Connection closed " << EVENT_FD(event);
+  drop_writer(EVENT_FD(event));
+  boost::unordered_map<int, InputBuffer*>::iterator input = inputs.find(EVENT_FD(event));
+  if (input != inputs.end()) {
+    delete input->second;
+    inputs.erase(input);
+  }
+
+  PLOG_IF(ERROR, close(EVENT_FD(event)))
+    << "Error closing fd " << EVENT_FD(event);
+  LOG_IF(ERROR, event_del(event) < 0)
+    << "Error deleting event " << EVENT_FD(event);
+  delete event;
+}
+
+unsigned pending_worker_requests = 0;
+void request_new_worker_node(const Request_msg& req) {
+
+  // HACK(kayvonf): stick the tag in the dictionary to avoid a lot of
+  // extra plumbing
+  Request_msg modified(req);
+
+  char tmp_buffer[32];
+  sprintf(tmp_buffer, "%d", req.get_tag());
+  modified.set_arg("tag", tmp_buffer);
+
+  // offer the binary encoding; the worker accepts it by registering
+  // with NEW_WORKER_BINARY
+  if (FLAGS_binary_protocol) {
+    modified.set_arg("wire", "binary");
+  }
+
+  std::string str = modified.get_request_string();
+
+  DLOG(INFO) << "Requesting worker " << str;
+  CHECK_EQ(send_string(launcher_fd, str), 0)
+    << "Cannot talk launcher\n";
+  pending_worker_requests++;
+}
+
+static void accumulate_time(Worker_handle worker_handle) {
+  double start_time = worker_boot_times[worker_handle];
+  double end_time = CycleTimer::currentSeconds();
+  double worker_up_time = end_time - start_time;
+  total_worker_seconds += worker_up_time;
+
+  //printf("*** MASTER: accumulating %.2f sec\n", worker_up_time);
+}
+
+void kill_worker_node(Worker_handle worker_handle) {
+
+  CHECK_EQ(workers.erase(worker_handle), 1U) << "Attempt to kill non worker";
+  // anything queued for it this callback still goes out first
+  struct event* event = reinterpret_cast<struct event*>(worker_handle);
+  boost::unordered_map<int, MessageWriter*>::iterator it = writers.find(EVENT_FD(event));
+  if (it != writers.end()) {
+    flush_writer(it->second);
+  }
+  binary_workers.erase(worker_handle);
+  close_connection(worker_handle);
+  accumulate_time(worker_handle);
+  worker_boot_times.erase(worker_handle);
+}
+
+void send_request_to_worker(Client_handle worker_handle, const Request_msg& job) {
+  work_t comm_work;
+  message_t message = WORK;
+
+  std::string contents;
+  if (binary_workers.find(worker_handle) != binary_workers.end()) {
+    job.get_request_binary(contents);
+    message = WORK_BINARY;
+  } else {
+    contents = job.get_request_string();
+  }
+  int allocation_size = contents.size();
+  comm_work.buf = boost::make_shared<char[]>(allocation_size);
+  comm_work.buf_len = allocation_size;
+  memcpy(comm_work.buf.get(), contents.data(), allocation_size);
+
+  // now perform the send
+  CHECK(workers.find(worker_handle) != workers.end())
+    << "Attempt to send work to invalid worker";
+  // TODO(awreece) Lock the worker handle!
+  struct event* event = reinterpret_cast<struct event*>(worker_handle);
+  NETLOG(INFO) << "Sending work (" << job.get_tag() << "," << comm_work << ") to "
+               << EVENT_FD(event);
+  MessageWriter* writer = get_writer(EVENT_FD(event));
+  writer->append_work(comm_work, job.get_tag(), message);
+  mark_dirty(writer);
+}
+
+void request_worker_stats(Worker_handle worker_handle) {
+  CHECK(workers.find(worker_handle) != workers.end())
+    << "Attempt to request stats of invalid worker";
+  struct event* event = reinterpret_cast<struct event*>(worker_handle);
+  NETLOG(INFO) << "Requesting stats from " << EVENT_FD(event);
+  MessageWriter* writer = get_writer(EVENT_FD(event));
+  writer->append_message(REQUEST_STATS, 0);
+  mark_dirty(writer);
+}
+
+void send_client_response(Client_handle client_handle, const Response_msg& resp) {
+
+  if (FLAGS_io_threads > 0) {
+    // the client belongs to an I/O thread
+    io_threads_send_response(reinterpret_cast<ClientConn*>(client_handle),
+                             resp.get_response(), false);
+    return;
+  }
+
+  resp_t comm_resp;
+
+  std::string resp_str = resp.get_response();
+  int allocation_size = resp_str.size();
+  comm_resp.buf = boost::make_shared<char[]>(allocation_size);
+  comm_resp.buf_len = allocation_size;
+  strncpy(comm_resp.buf.get(), resp_str.c_str(), allocation_size);
+
+  // send to comm layer
+  struct event* event = reinterpret_cast<struct event*>(client_handle);
+  NETLOG(INFO) << "Sending response " << comm_resp << " to " << EVENT_FD(event);
+  MessageWriter* writer = get_writer(EVENT_FD(event));
+  writer->append_resp(comm_resp, 0);
+  mark_dirty(writer);
+}
+
+void server_init_complete() {
+  is_server_initialized = true;
+}
+
+static void shutdown() {
+  LOG(INFO) << "Shutting down";
+  exit(0);
+}
+
+bool should_shutdown = false;
+static void request_shutdown() {
+  if (pending_worker_requests == 0) {
+    shutdown();
+  } else {
+    should_shutdown = true;
+  }
+}
+
+static std::string ready_string() {
+  return is_server_initialized ? "ready" : "not_ready";
+}
+
+static std::string worker_up_time_string() {
+  // Accumulate time for all the workers that HAVE NOT yet been shut
+  // down
+  for (std::map<Worker_handle, double>::const_iterator it=worker_boot_times.begin();
+       it != worker_boot_times.end(); it++)
+    accumulate_time(it->first);
+
+  char tmp_buffer[128];
+  sprintf(tmp_buffer,"%d %.2f", num_instances_booted, total_worker_seconds);
+  return std::string(tmp_buffer);
+}
+
+// Answer a one-shot client query and close its connection.
+static void reply_and_close(void* arg, const std::string& resp_str) {
+  resp_t comm_resp;
+
+  int allocation_size = resp_str.size();
+  comm_resp.buf = boost::make_shared<char[]>(allocation_size);
+  comm_resp.buf_len = allocation_size;
+  strncpy(comm_resp.buf.get(), resp_str.c_str(), allocation_size);
+
+  // send to comm layer
+  struct event* event = reinterpret_cast<struct event*>(arg);
+  NETLOG(INFO) << "Sending response " << comm_resp << " to " << EVENT_FD(event);
+  CHECK_EQ(send_resp(EVENT_FD(event), comm_resp, 0), 0)
+    << "Unexpected connection failure with client " << EVENT_FD(event);
+
+  close_connection(arg);
+}
+
+// Handle one complete message from connection 'arg'.  Returns false
+// if the connection was closed.
+static bool dispatch_message(int fd, void* arg, message_t message, int tag,
+                             const char* payload, int payload_len) {
+  NETLOG(INFO) << "Got message (" << message << "," << tag << ")";
+
+  switch (message) {
+
+  case ISREADY: {
+    reply_and_close(arg, ready_string());
+    return false;
+  }
+
+  case WORKER_UP_TIME_STATS: {
+    reply_and_close(arg, worker_up_time_string());
+    return false;
+  }
+
+    case SHUTDOWN: {
+      request_shutdown();
+    }
+    case WORK: {
+      // A new request from a client.
+      NETLOG(INFO) << "Got new work (" << payload_len << " bytes) from " << fd;
+
+      // parse straight out of the input buffer (not null terminated,
+      // so by length)
+      Request_msg client_req(0, payload, payload_len);
+
+      handle_client_request(arg, client_req);
+      break;
+    }
+
+    case RESPONSE: {
+      // Worker job is done response.
+      NETLOG(INFO) << "Got worker response (" << tag << ","
+        << std::string(payload, payload_len) << ") from " << fd;
+
+      // convert the payload into a Response_msg to pass to student code
+      Response_msg resp(tag);
+      resp.set_response(std::string(payload, payload_len));
+
+      handle_worker_response(arg, resp);
+      break;
+    }
+
+    case STATS: {
+      // A worker's load report.
+      if (workers.find(arg) == workers.end() ||
+          payload_len != static_cast<int>(sizeof(worker_stats_t))) {
+        NETLOG(ERROR) << "Unexpected stats (" << payload_len << " bytes) from " << fd;
+        close_connection(arg);
+        return false;
+      }
+      worker_stats_t stats;
+      memcpy(&stats, payload, sizeof(stats));
+      NETLOG(INFO) << "Got " << stats << " from " << fd;
+
+      handle_worker_stats(arg, stats);
+      break;
+    }
+
+    case NEW_WORKER_BINARY:
+    case NEW_WORKER: {
+      pending_worker_requests--;
+      if (should_shutdown && pending_worker_requests == 0) {
+  shutdown();
+      }
+      // Notification that a worker has booted.
+      NETLOG(INFO) << "New worker " << tag << " on " << fd;
+      workers.insert(arg);
+      if (message == NEW_WORKER_BINARY) {
+        binary_workers.insert(arg);
+      }
+      worker_boot_times[arg] = CycleTimer::currentSeconds();
+      num_instances_booted++;
+      handle_new_worker_online(arg, tag);
+      break;
+    }
+
+    default: {
+      NETLOG(ERROR) << "Unexpected message " << message << " from " << fd;
+      close_connection(arg);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Handle every complete message buffered in 'input'; a partial one
+// stays buffered until the rest shows up.  'got' is the result of the
+// last fill().
+static void process_input(int fd, void* arg, InputBuffer* input, int got) {
+  message_t message;
+  int tag;
+  const char* payload;
+  int payload_len;
+  int ret;
+  while ((ret = input->next_message(&message, &tag, &payload, &payload_len)) > 0) {
+    if (!dispatch_message(fd, arg, message, tag, payload, payload_len)) {
+      return;
+    }
+    // student code may have killed this very worker
+    boost::unordered_map<int, InputBuffer*>::iterator it = inputs.find(fd);
+    if (it == inputs.end() || it->second != input) {
+      return;
+    }
+  }
+
+  if (ret < 0) {
+    NETLOG(ERROR) << "Malformed message on " << fd;
+    close_connection(arg);
+  } else if (got < 0) {
+    if (input->buffered_bytes() > 0) {
+      NETLOG(ERROR) << "Unexpected connection close on " << fd;
+    } else {
+      NETLOG(WARNING) << "Connection closed on " << fd;
+    }
+    close_connection(arg);
+  }
+}
+
+static void flush_output() {
+  flush_all_writers();
+  if (FLAGS_io_threads > 0) {
+    io_threads_flush();
+  }
+}
+
+// The wheel's libevent timer is only armed while a student timer is
+// pending, so an idle master does not wake up every millisecond.
+static TimerWheel* timer_wheel = NULL;
+static struct event wheel_event;
+static bool wheel_event_ready = false;
+static bool wheel_armed = false;
+
+static TimerWheel* get_timer_wheel() {
+  if (timer_wheel == NULL) {
+    timer_wheel = new TimerWheel(TIMER_RESOLUTION_MS, TIMER_WHEEL_SLOTS,
+                                 CycleTimer::currentSeconds() * 1000.0);
+  }
+  return timer_wheel;
+}
+
+static void arm_timer_wheel() {
+  if (wheel_event_ready && !wheel_armed && get_timer_wheel()->size() > 0) {
+    struct timeval resolution;
+    resolution.tv_sec = 0;
+    resolution.tv_usec = TIMER_RESOLUTION_MS * 1000;
+    event_add(&wheel_event, &resolution);
+    wheel_armed = true;
+  }
+}
+
+static void handle_timer_wheel(int fd, int16_t events, void* arg) {
+  (void)fd;
+  (void)events;
+  (void)arg;
+
+  wheel_armed = false;
+  get_timer_wheel()->advance(CycleTimer::currentSeconds() * 1000.0);
+  flush_output();
+  arm_timer_wheel();
+}
+
+Timer_handle start_timer(int delay_ms, void (*callback)(void* arg), void* arg) {
+  Timer_handle timer = get_timer_wheel()->schedule(
+      CycleTimer::currentSeconds() * 1000.0, delay_ms, callback, arg);
+  arm_timer_wheel();
+  return timer;
+}
+
+bool cancel_timer(Timer_handle timer) {
+  return get_timer_wheel()->cancel(timer);
+}
+
+static void handle_read(int fd, int16_t events, void* arg) {
+  assert(events & EV_READ);
+  InputBuffer* input = inputs[fd];
+  int got = input->fill(fd);
+  request_arrival_ns = trace_now_ns();
+  process_input(fd, arg, input, got);
+  flush_output();
+}
+
+// A worker's connection handed over by an I/O thread: watch it on the
+// core's event loop from now on.
+static void adopt_connection(int fd, InputBuffer* input) {
+  struct event* event = new struct event;
+  event_set(event, fd, EV_READ|EV_PERSIST, handle_read, event);
+  event_add(event, NULL);
+  inputs[fd] = input;
+  process_input(fd, event, input, 0);
+}
+
+static void handle_core_event(CoreEvent* ev) {
+  if (ev->kind == CoreEvent::NEW_CONNECTION) {
+    NETLOG(INFO) << "Adopting connection " << ev->fd;
+    adopt_connection(ev->fd, ev->input);
+    delete ev;
+    return;
+  }
+
+  NETLOG(INFO) << "Got client message (" << ev->message << "," << ev->tag
+               << ") from " << ev->fd;
+  void* client = ev->client;
+  request_arrival_ns = ev->arrival_ns;
+  switch (ev->message) {
+    case ISREADY:
+      io_threads_send_response(ev->client, ready_string(), true);
+      break;
+    case WORKER_UP_TIME_STATS:
+      io_threads_send_response(ev->client, worker_up_time_string(), true);
+      break;
+    case SHUTDOWN:
+      request_shutdown();
+      // fall through
+    case WORK:
+      handle_client_request(client, ev->request);
+      break;
+    default:
+      LOG(FATAL) << "Unexpected client message " << ev->message;
+  }
+  delete ev;
+}
+
+static void handle_core_events(int fd, int16_t events, void* arg) {
+  (void)fd;
+  (void)events;
+  (void)arg;
+  io_threads_drain(handle_core_event);
+  flush_output();
+}
+
+static void handle_accept(int fd, int16_t events, void* arg) {
+  (void)arg;
+  assert(events & EV_READ);
+
+  struct sockaddr addr;
+  socklen_t addr_len = sizeof(addr);
+  fd = accept(fd, &addr, &addr_len);
+
+  PCHECK(fd >= 0) << "Failure accepting new connection!";
+  NETLOG(INFO) << "New connection on " << fd;
+
+  // Reads never block the loop: handle_read() takes what is ready and
+  // keeps partial messages in the connection's InputBuffer.  (Writes
+  // still wait for socket space; see send_all().)
+  int flags = fcntl(fd, F_GETFL, 0);
+  PCHECK(flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0)
+    << "Cannot make connection " << fd << " non-blocking";
+  inputs[fd] = new InputBuffer;
+
+  // Send event struct as arg to make it easy to stop the event.
+  struct event* event = new struct event;
+  // I would really rather use event_self_cbarg().
+  event_set(event, fd, EV_READ|EV_PERSIST, handle_read, event);
+  event_add(event, NULL);
+}
+
+static void handle_timer(int fd, int16_t events, void* arg) {
+  (void)fd;
+  (void)events;
+  (void)arg;
+
+  NETLOG(INFO) << "Timer tick";
+  handle_tick();
+  flush_output();
+}
+
+void harness_init() {
+  num_instances_booted = 0;
+  total_worker_seconds = 0.0;
+}
+
+void harness_begin_main_loop(struct timeval* tick_period) {
+  event_init();
+  struct event accept_event, core_event, timer_event;
+
+  if (FLAGS_io_threads > 0) {
+    // Clients are accepted and served by the I/O threads; this thread
+    // only sees their parsed messages (and the workers' connections).
+    io_threads_start(FLAGS_io_threads, accept_fd);
+    event_set(&core_event, io_threads_core_fd(), EV_READ|EV_PERSIST,
+              handle_core_events, NULL);
+    event_add(&core_event, NULL);
+  } else {
+    // Set up the accept event.
+    event_set(&accept_event, accept_fd, EV_READ|EV_PERSIST,
+              handle_accept, &accept_event);
+    event_add(&accept_event, NULL);
+  }
+
+  // Set up the timer event.
+  event_set(&timer_event, -1, EV_PERSIST, handle_timer, NULL);
+  event_add(&timer_event, tick_period);
+
+  // timers started before the loop (e.g. in master_node_init)
+  event_set(&wheel_event, -1, 0, handle_timer_wheel, NULL);
+  wheel_event_ready = true;
+  arm_timer_wheel();
+
+  NETLOG(INFO) << "Starting event loop";
+  event_dispatch();
+}
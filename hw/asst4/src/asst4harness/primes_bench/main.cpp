@@ -0,0 +1,151 @@
+// Microbenchmark: countprimes by the reference job (trial division,
+// ten times over) vs. the worker's sieve table (tools/prime_sieve.h).
+//
+// Every n is answered both ways and the responses must match
+// exactly.  The sieve is timed cold (a fresh table that has to sieve
+// up to n first) and warm (the table already covers n).
+//
+// Then, for the worker's parallel fallback (sieve=0): one trial
+// division pass over [3, n) on one thread vs. split into chunks on a
+// pool of PARALLEL_THREADS threads, per n.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "server/messages.h"
+#include "server/worker.h"
+#include "tools/cycle_timer.h"
+#include "tools/prime_sieve.h"
+#include "tools/work_stealing.h"
+
+void count_primes_job(const Request_msg& req, Response_msg& resp);
+
+// the range of n in tests/*.txt
+static const int MIN_N = 100 * 1000;
+static const int MAX_N = 1000 * 1000 + 100;
+static const int NUM_QUERIES = 20;
+static const int WARM_QUERIES = 1000 * 1000;
+static const int64_t SIEVE_LIMIT = 1 << 27;
+
+static const int PARALLEL_THREADS = 8;
+static const int CHUNKS_PER_THREAD = 4;
+static const int PARALLEL_NS[] = { 100000, 250000, 500000, 1000000, 2000000, 4000000 };
+static const int NUM_PARALLEL_NS = sizeof(PARALLEL_NS) / sizeof(PARALLEL_NS[0]);
+
+struct Chunk {
+  int lo;
+  int hi;
+  std::atomic<long>* count;
+  std::atomic<int>* remaining;
+};
+
+static void run_chunk(const Chunk& c) {
+  c.count->fetch_add(count_odd_primes(c.lo, c.hi));
+  c.remaining->fetch_sub(1);
+}
+
+static long parallel_count(WorkStealingPool<Chunk>* pool, int lane, int n) {
+  int chunks = PARALLEL_THREADS * CHUNKS_PER_THREAD;
+  int span = (n + chunks - 1) / chunks;
+  std::atomic<long> count(n >= 2 ? 1 : 0);
+  std::atomic<int> remaining(chunks);
+  for (int i = 0; i < chunks; ++i) {
+    Chunk c;
+    c.lo = i * span;
+    c.hi = std::min(n, c.lo + span);
+    c.count = &count;
+    c.remaining = &remaining;
+    pool->put_work(c, lane);
+  }
+  while (remaining.load() > 0) {
+    usleep(100);
+  }
+  return count.load();
+}
+
+static void parallel_report(PrimeCountTable* table) {
+  WorkStealingPool<Chunk> pool(run_chunk, PARALLEL_THREADS);
+  int lane = pool.add_lane(PARALLEL_THREADS);
+
+  printf("\nparallel trial division, %d threads, %d chunks:\n", PARALLEL_THREADS,
+         PARALLEL_THREADS * CHUNKS_PER_THREAD);
+  for (int i = 0; i < NUM_PARALLEL_NS; ++i) {
+    int n = PARALLEL_NS[i];
+    double startTime = CycleTimer::currentSeconds();
+    long serial = (n >= 2 ? 1 : 0) + count_odd_primes(0, n);
+    double serial_time = CycleTimer::currentSeconds() - startTime;
+
+    startTime = CycleTimer::currentSeconds();
+    long parallel = parallel_count(&pool, lane, n);
+    double parallel_time = CycleTimer::currentSeconds() - startTime;
+
+    if (serial != table->count_primes(n) || parallel != serial) {
+      fprintf(stderr, "countprimes(%d): sieve %ld, serial %ld, parallel %ld\n", n,
+              table->count_primes(n), serial, parallel);
+      exit(EXIT_FAILURE);
+    }
+    printf("  n=%-8d serial %8.2f ms  parallel %7.2f ms  (%.1fx speedup)\n", n,
+           serial_time * 1e3, parallel_time * 1e3, serial_time / parallel_time);
+  }
+}
+
+int main() {
+  unsigned int seed = 418;
+  std::vector<int> ns;
+  for (int i = 0; i < NUM_QUERIES; ++i) {
+    ns.push_back(MIN_N + rand_r(&seed) % (MAX_N - MIN_N));
+  }
+  ns.push_back(MAX_N);
+
+  double reference = 0.0;
+  double cold = 0.0;
+  PrimeCountTable warm_table(SIEVE_LIMIT);
+  for (size_t i = 0; i < ns.size(); ++i) {
+    char n[32];
+    sprintf(n, "%d", ns[i]);
+    Request_msg req(0);
+    req.set_arg("cmd", "countprimes");
+    req.set_arg("n", n);
+    Response_msg resp(0);
+
+    double startTime = CycleTimer::currentSeconds();
+    count_primes_job(req, resp);
+    reference += CycleTimer::currentSeconds() - startTime;
+
+    startTime = CycleTimer::currentSeconds();
+    PrimeCountTable table(SIEVE_LIMIT);
+    long primes = table.count_primes(ns[i]);
+    cold += CycleTimer::currentSeconds() - startTime;
+
+    char sieved[32];
+    sprintf(sieved, "%ld", primes);
+    if (resp.get_response() != sieved || warm_table.count_primes(ns[i]) != primes) {
+      fprintf(stderr, "countprimes(%d): reference %s, sieve %s\n", ns[i],
+              resp.get_response().c_str(), sieved);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  long checksum = 0;
+  double startTime = CycleTimer::currentSeconds();
+  for (int i = 0; i < WARM_QUERIES; ++i) {
+    checksum += warm_table.count_primes(ns[i % ns.size()]);
+  }
+  double warm = CycleTimer::currentSeconds() - startTime;
+
+  printf("%zu values of n in [%d, %d], responses identical\n", ns.size(), MIN_N, MAX_N);
+  printf("[reference job]:\t[%.3f] ms/request\n", reference * 1e3 / ns.size());
+  printf("[sieve, cold]:\t\t[%.3f] ms/request\t(%.0fx speedup)\n",
+         cold * 1e3 / ns.size(), reference / cold);
+  printf("[sieve, warm]:\t\t[%.1f] ns/request\t(checksum %ld)\n",
+         warm * 1e9 / WARM_QUERIES, checksum);
+
+  parallel_report(&warm_table);
+  return 0;
+}
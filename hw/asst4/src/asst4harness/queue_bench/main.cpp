@@ -0,0 +1,138 @@
+// Microbenchmark: WorkQueue (mutex + condvar) vs. MPMCWorkQueue
+// (lock-free ring + futex parking).
+//
+// For every thread count in 1..64 it runs two shapes: a single
+// producer feeding N consumers (the worker node's main loop feeding
+// its pool) and N producers feeding N consumers (worst-case
+// contention on both ends).
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "tools/cycle_timer.h"
+#include "tools/mpmc_queue.h"
+#include "tools/work_queue.h"
+
+static const int ITEMS_PER_PRODUCER = 100 * 1000;
+static const int NUM_TRIALS = 3;
+
+template <class Q>
+struct BenchArgs {
+  Q* queue;
+  int items;
+  long long checksum;
+};
+
+template <class Q>
+static void* producer(void* arg) {
+  BenchArgs<Q>* args = reinterpret_cast<BenchArgs<Q>*>(arg);
+  for (int i = 0; i < args->items; ++i) {
+    args->queue->put_work(i);
+  }
+  return NULL;
+}
+
+template <class Q>
+static void* consumer(void* arg) {
+  BenchArgs<Q>* args = reinterpret_cast<BenchArgs<Q>*>(arg);
+  long long sum = 0;
+  while (true) {
+    int item = args->queue->get_work();
+    if (item < 0) {
+      break;
+    }
+    sum += item;
+  }
+  args->checksum = sum;
+  return NULL;
+}
+
+/*
+ * run_once --
+ *
+ * Push ITEMS_PER_PRODUCER items from each producer through a fresh
+ * queue and drain them with the consumers.  Returns elapsed seconds.
+ */
+template <class Q>
+static double run_once(int num_producers, int num_consumers) {
+  Q* queue = new Q;
+  pthread_t* producers = new pthread_t[num_producers];
+  pthread_t* consumers = new pthread_t[num_consumers];
+  BenchArgs<Q>* pargs = new BenchArgs<Q>[num_producers];
+  BenchArgs<Q>* cargs = new BenchArgs<Q>[num_consumers];
+
+  double startTime = CycleTimer::currentSeconds();
+
+  for (int i = 0; i < num_consumers; ++i) {
+    cargs[i].queue = queue;
+    cargs[i].checksum = 0;
+    pthread_create(&consumers[i], NULL, consumer<Q>, &cargs[i]);
+  }
+  for (int i = 0; i < num_producers; ++i) {
+    pargs[i].queue = queue;
+    pargs[i].items = ITEMS_PER_PRODUCER;
+    pthread_create(&producers[i], NULL, producer<Q>, &pargs[i]);
+  }
+  for (int i = 0; i < num_producers; ++i) {
+    pthread_join(producers[i], NULL);
+  }
+  // one poison pill per consumer
+  for (int i = 0; i < num_consumers; ++i) {
+    queue->put_work(-1);
+  }
+  long long total = 0;
+  for (int i = 0; i < num_consumers; ++i) {
+    pthread_join(consumers[i], NULL);
+    total += cargs[i].checksum;
+  }
+
+  double endTime = CycleTimer::currentSeconds();
+
+  long long expected = static_cast<long long>(num_producers) *
+    ITEMS_PER_PRODUCER * (ITEMS_PER_PRODUCER - 1) / 2;
+  if (total != expected) {
+    fprintf(stderr, "checksum mismatch: %lld != %lld\n", total, expected);
+    exit(EXIT_FAILURE);
+  }
+
+  delete [] producers;
+  delete [] consumers;
+  delete [] pargs;
+  delete [] cargs;
+  delete queue;
+  return endTime - startTime;
+}
+
+template <class Q>
+static double best_of(int num_producers, int num_consumers) {
+  double best = 1e30;
+  for (int i = 0; i < NUM_TRIALS; ++i) {
+    best = std::min(best, run_once<Q>(num_producers, num_consumers));
+  }
+  return best;
+}
+
+static void report(const char* shape, int producers, int consumers) {
+  double items = static_cast<double>(producers) * ITEMS_PER_PRODUCER;
+  double locked = best_of<WorkQueue<int> >(producers, consumers);
+  double lockfree = best_of<MPMCWorkQueue<int> >(producers, consumers);
+  printf("[%s %2dP x %2dC]:\t[%8.3f] Mops/s mutex\t[%8.3f] Mops/s mpmc\t(%.2fx)\n",
+         shape, producers, consumers,
+         items / locked / 1e6, items / lockfree / 1e6, locked / lockfree);
+}
+
+int main() {
+  const int thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+  const int num_counts = sizeof(thread_counts) / sizeof(thread_counts[0]);
+
+  for (int i = 0; i < num_counts; ++i) {
+    report("1-to-N", 1, thread_counts[i]);
+  }
+  for (int i = 0; i < num_counts; ++i) {
+    report("N-to-N", thread_counts[i], thread_counts[i]);
+  }
+  return 0;
+}
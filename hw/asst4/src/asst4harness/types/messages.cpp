@@ -1,8 +1,10 @@
 // Copyright 2013 15418 Course Staff.
 
+#include <stdint.h>
+#include <string.h>
+
 #include <map>
 #include <string>
-#include <sstream>
 
 #include "server/messages.h"
 #include "types/types.h"
@@ -143,6 +145,30 @@ Request_msg::Request_msg(int argTag, const std::string& str) {
 }
 
 
+/*
+ * Request_msg constructor --
+ *
+ * Same as parsing std::string(buf, len), but splits the ';'
+ * separated tokens straight out of a (not null terminated) network
+ * buffer.
+ */
+Request_msg::Request_msg(int argTag, const char* buf, size_t len) {
+  tag = argTag;
+  size_t start = 0;
+  while (start < len) {
+    const char* end = static_cast<const char*>(memchr(buf + start, ';', len - start));
+    size_t token_end = end ? static_cast<size_t>(end - buf) : len;
+    if (token_end > start) {
+      std::string key;
+      std::string value;
+      ParseKeyValue(key, value, std::string(buf + start, token_end - start));
+      if (key.size() != 0)
+        dict[key] = value;
+    }
+    start = token_end + 1;
+  }
+}
+
 Request_msg::Request_msg(int arg_tag, const Request_msg& r) {
   tag = arg_tag;
   dict = r.dict;
@@ -153,6 +179,12 @@ Request_msg::Request_msg(const Request_msg& r) {
   dict = r.dict;
 }
 
+Request_msg& Request_msg::operator=(const Request_msg& r) {
+  tag = r.tag;
+  dict = r.dict;
+  return *this;
+}
+
 void Request_msg::set_arg(const std::string& key, const std::string& value) {
   dict[key] = value;
 }
@@ -169,14 +201,233 @@ std::string Request_msg::get_request_string() const {
 
   // serialize dict
 
-  bool first = true;
-  std::ostringstream oss;
+  size_t size = 0;
   for (std::map<std::string, std::string>::const_iterator it = dict.begin(); it != dict.end(); it++) {
-    if (!first)
-      oss << ";";
-    oss << it->first << "=" << it->second;
-    first = false;
+    size += it->first.size() + it->second.size() + 2;
   }
 
-  return oss.str();
+  std::string str;
+  str.reserve(size);
+  for (std::map<std::string, std::string>::const_iterator it = dict.begin(); it != dict.end(); it++) {
+    if (!str.empty())
+      str += ';';
+    str += it->first;
+    str += '=';
+    str += it->second;
+  }
+
+  return str;
+}
+
+
+/*
+ * Binary request encoding --
+ *
+ *   u8  command id (CMD_NONE: no cmd, or an unknown one sent as an
+ *       ordinary string argument)
+ *   u16 number of arguments that follow
+ *   per argument:
+ *     u8  key id (KEY_INLINE: u32 length + key bytes follow)
+ *     u8  value type
+ *     VALUE_INT32:  i32 (host byte order; master and workers run on
+ *                   the same kind of machine)
+ *     VALUE_STRING: u32 length + bytes
+ *
+ * A value is only sent as VALUE_INT32 if printing the integer gives
+ * back exactly the same string, so decoding always reproduces the
+ * original dictionary.
+ */
+
+static const char* const COMMAND_NAMES[] = {
+  "",  // CMD_NONE
+  "418wisdom",
+  "countprimes",
+  "bandwidth",
+  "tellmenow",
+  "projectidea",
+  "compareprimes",
+  "lastrequest",
+};
+static const int NUM_COMMANDS = sizeof(COMMAND_NAMES) / sizeof(COMMAND_NAMES[0]);
+static const uint8_t CMD_NONE = 0;
+
+static const char* const KEY_NAMES[] = {
+  "",  // KEY_INLINE
+  "x",
+  "n",
+  "n1",
+  "n2",
+  "n3",
+  "n4",
+  "tag",
+};
+static const int NUM_KEYS = sizeof(KEY_NAMES) / sizeof(KEY_NAMES[0]);
+static const uint8_t KEY_INLINE = 0;
+
+static const uint8_t VALUE_INT32 = 0;
+static const uint8_t VALUE_STRING = 1;
+
+static uint8_t
+LookupName(const char* const* names, int count, const std::string& name) {
+  for (int i = 1; i < count; i++) {
+    if (name == names[i])
+      return i;
+  }
+  return 0;
+}
+
+/*
+ * ParseCanonicalInt --
+ *
+ * Returns true if 'str' is exactly the decimal form of a 32-bit
+ * integer (no sign other than '-', no leading zeros, no whitespace).
+ */
+static bool
+ParseCanonicalInt(const std::string& str, int32_t* result) {
+  size_t i = (str.size() > 0 && str[0] == '-') ? 1 : 0;
+  size_t digits = str.size() - i;
+  if (digits == 0 || digits > 10 || (str[i] == '0' && str.size() != 1))
+    return false;
+  int64_t value = 0;
+  for (; i < str.size(); i++) {
+    if (str[i] < '0' || str[i] > '9')
+      return false;
+    value = value * 10 + (str[i] - '0');
+  }
+  if (str[0] == '-')
+    value = -value;
+  if (value < INT32_MIN || value > INT32_MAX)
+    return false;
+  *result = static_cast<int32_t>(value);
+  return true;
+}
+
+/*
+ * FormatInt --
+ *
+ * Decimal form of 'value' (what sprintf("%d") prints, without the
+ * format string parsing).
+ */
+static std::string
+FormatInt(int32_t value) {
+  char tmp_buffer[16];
+  char* end = tmp_buffer + sizeof(tmp_buffer);
+  char* p = end;
+  uint32_t magnitude = value < 0 ? 0u - static_cast<uint32_t>(value)
+                                 : static_cast<uint32_t>(value);
+  do {
+    *--p = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (value < 0)
+    *--p = '-';
+  return std::string(p, end - p);
+}
+
+static void
+AppendString(std::string& out, const std::string& str) {
+  uint32_t len = str.size();
+  out.append(reinterpret_cast<const char*>(&len), sizeof(len));
+  out += str;
+}
+
+static bool
+ReadString(const char* buf, size_t len, size_t* pos, std::string* str) {
+  uint32_t str_len;
+  if (*pos + sizeof(str_len) > len)
+    return false;
+  memcpy(&str_len, buf + *pos, sizeof(str_len));
+  *pos += sizeof(str_len);
+  if (*pos + str_len > len)
+    return false;
+  str->assign(buf + *pos, str_len);
+  *pos += str_len;
+  return true;
+}
+
+void Request_msg::get_request_binary(std::string& out) const {
+  out.clear();
+
+  uint8_t cmd = CMD_NONE;
+  std::map<std::string, std::string>::const_iterator cmd_it = dict.find("cmd");
+  if (cmd_it != dict.end())
+    cmd = LookupName(COMMAND_NAMES, NUM_COMMANDS, cmd_it->second);
+
+  uint16_t num_args = dict.size() - (cmd != CMD_NONE ? 1 : 0);
+  out += static_cast<char>(cmd);
+  out.append(reinterpret_cast<const char*>(&num_args), sizeof(num_args));
+
+  for (std::map<std::string, std::string>::const_iterator it = dict.begin(); it != dict.end(); it++) {
+    if (cmd != CMD_NONE && it == cmd_it)
+      continue;
+
+    uint8_t key = LookupName(KEY_NAMES, NUM_KEYS, it->first);
+    out += static_cast<char>(key);
+    if (key == KEY_INLINE)
+      AppendString(out, it->first);
+
+    int32_t value;
+    if (ParseCanonicalInt(it->second, &value)) {
+      out += static_cast<char>(VALUE_INT32);
+      out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    } else {
+      out += static_cast<char>(VALUE_STRING);
+      AppendString(out, it->second);
+    }
+  }
+}
+
+bool Request_msg::parse_request_binary(const char* buf, size_t len) {
+  dict.clear();
+  uint8_t cmd;
+  uint16_t num_args;
+  if (len < sizeof(cmd) + sizeof(num_args))
+    return false;
+
+  cmd = buf[0];
+  memcpy(&num_args, buf + 1, sizeof(num_args));
+  size_t pos = sizeof(cmd) + sizeof(num_args);
+  if (cmd >= NUM_COMMANDS)
+    return false;
+  if (cmd != CMD_NONE)
+    dict["cmd"] = COMMAND_NAMES[cmd];
+
+  // arguments were written in dictionary order, so each one goes
+  // right after the previous (cmd aside)
+  std::map<std::string, std::string>::iterator hint = dict.end();
+
+  for (int i = 0; i < num_args; i++) {
+    if (pos + 1 > len)
+      return false;
+    uint8_t key_id = buf[pos++];
+    std::string key;
+    if (key_id == KEY_INLINE) {
+      if (!ReadString(buf, len, &pos, &key))
+        return false;
+    } else if (key_id < NUM_KEYS) {
+      key = KEY_NAMES[key_id];
+    } else {
+      return false;
+    }
+
+    if (pos + 1 > len)
+      return false;
+    uint8_t type = buf[pos++];
+    if (type == VALUE_INT32) {
+      int32_t value;
+      if (pos + sizeof(value) > len)
+        return false;
+      memcpy(&value, buf + pos, sizeof(value));
+      pos += sizeof(value);
+      hint = dict.insert(hint, std::make_pair(key, FormatInt(value)));
+    } else if (type == VALUE_STRING) {
+      std::string value;
+      if (!ReadString(buf, len, &pos, &value))
+        return false;
+      hint = dict.insert(hint, std::make_pair(key, value));
+    } else {
+      return false;
+    }
+  }
+  return pos == len;
 }
@@ -40,6 +40,12 @@ std::ostream& operator<< (std::ostream &out, const message_t &message) {
     case WORKER_UP_TIME_STATS:
       out << "WORKER_UP_TIME_STATS";
       break;
+    case WORK_BINARY:
+      out << "WORK_BINARY";
+      break;
+    case NEW_WORKER_BINARY:
+      out << "NEW_WORKER_BINARY";
+      break;
     default:
       LOG(FATAL) << "Invalid message " << std::hex << static_cast<int>(message);
   }
@@ -47,7 +53,34 @@ std::ostream& operator<< (std::ostream &out, const message_t &message) {
 }
 
 std::ostream& operator<< (std::ostream &out, const worker_stats_t &stats) {
-  return out << "Stats(cpu_threads=" << stats.cpu_threads
-             << ", memory_threads=" << stats.memory_threads
-             << ", io_threads=" << stats.io_threads << ")";
+  out << "Stats(cpu_threads=" << stats.cpu_threads
+      << ", memory_threads=" << stats.memory_threads
+      << ", io_threads=" << stats.io_threads
+      << ", seq=" << stats.seq
+      << ", busy_threads=" << stats.busy_threads
+      << ", queued=";
+  for (int i = 0; i < NUM_STATS_QUEUES; i++) {
+    out << (i > 0 ? "/" : "") << stats.queue_depth[i];
+  }
+  out << ", service_ms=";
+  for (int i = 0; i < NUM_STATS_COMMANDS; i++) {
+    out << (i > 0 ? "/" : "") << stats.service_ms[i];
+  }
+  return out << ", rss_mb=" << stats.rss_mb
+             << ", bandwidth_mbps=" << stats.bandwidth_mbps << ")";
+}
+
+int stats_command(const std::string& cmd) {
+  if (cmd == "418wisdom") {
+    return STATS_WISDOM;
+  } else if (cmd == "countprimes") {
+    return STATS_COUNTPRIMES;
+  } else if (cmd == "bandwidth") {
+    return STATS_BANDWIDTH;
+  } else if (cmd == "projectidea") {
+    return STATS_PROJECTIDEA;
+  } else if (cmd == "tellmenow") {
+    return STATS_TELLMENOW;
+  }
+  return -1;
 }
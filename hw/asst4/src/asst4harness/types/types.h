@@ -6,6 +6,7 @@
 #include <boost/shared_ptr.hpp>
 
 #include <iostream>
+#include <string>
 
 typedef enum {
   WORK,
@@ -15,7 +16,9 @@ typedef enum {
   STATS,
   ISREADY,
   SHUTDOWN,
-  WORKER_UP_TIME_STATS
+  WORKER_UP_TIME_STATS,
+  WORK_BINARY,        // WORK with a binary encoded request
+  NEW_WORKER_BINARY   // NEW_WORKER that also accepts WORK_BINARY
 } message_t;
 
 typedef struct {
@@ -23,12 +26,42 @@ typedef struct {
   int tag;
 } tagged_message_t;
 
+// Commands and queues of a worker's load report
+typedef enum {
+  STATS_WISDOM,
+  STATS_COUNTPRIMES,
+  STATS_BANDWIDTH,
+  STATS_PROJECTIDEA,
+  STATS_TELLMENOW,
+  NUM_STATS_COMMANDS
+} stats_command_t;
+
+typedef enum {
+  STATS_QUEUE_REQUESTS,
+  STATS_QUEUE_TELLMENOW,
+  STATS_QUEUE_PROJECTIDEA,
+  NUM_STATS_QUEUES
+} stats_queue_t;
+
+// Sent as the payload of a STATS message: on REQUEST_STATS, and
+// periodically by workers that push their load.
 typedef struct {
   int cpu_threads;
   int memory_threads;
   int io_threads;
+
+  // load report, as of when the worker sent it
+  int seq;                                  // counts up per worker
+  int busy_threads;
+  int queue_depth[NUM_STATS_QUEUES];        // waiting, not running
+  float service_ms[NUM_STATS_COMMANDS];     // recent mean, 0 = none yet
+  int rss_mb;
+  int bandwidth_mbps;                       // estimated, of running jobs
 } worker_stats_t;
 
+// stats_command_t of a command name, or -1.
+int stats_command(const std::string& cmd);
+
 typedef struct {
   int buf_len;
   boost::shared_ptr<char[]> buf;
@@ -3,13 +3,16 @@
 #ifndef __ASST4INCLUDE_MASTER_H__
 #define __ASST4INCLUDE_MASTER_H__
 
+#include <stdint.h>
 
+#include "types/types.h"
 
 class Response_msg;
 class Request_msg;
 
 typedef void* Client_handle;
 typedef void* Worker_handle;
+typedef uint64_t Timer_handle;
 
 
 /**
@@ -36,6 +39,14 @@ void send_client_response(Client_handle client_handle, const Response_msg& resp)
  */
 void send_request_to_worker(Worker_handle worker_handle, const Request_msg& req);
 
+/**
+ * @brief Ask a worker for a load report.
+ *
+ * The worker answers with a STATS message, which arrives as a call to
+ * handle_worker_stats().  Workers may also send reports on their own.
+ */
+void request_worker_stats(Worker_handle worker_handle);
+
 /**
  * @brief Request a new worker node
  *
@@ -64,6 +75,43 @@ void kill_worker_node(Worker_handle worker_handle);
  */
 void server_init_complete();
 
+/**
+ * @brief Call callback(arg) once, delay_ms milliseconds from now.
+ *
+ * Timers have millisecond resolution and run on the same thread as
+ * the event handlers, so they can be used for per-request deadlines
+ * or for decisions that should not wait for the next tick.  May be
+ * called from master_node_init.
+ */
+Timer_handle start_timer(int delay_ms, void (*callback)(void* arg), void* arg);
+
+/**
+ * @brief Cancel a timer that has not fired yet.
+ *
+ * Returns false if it already fired or was cancelled, which is
+ * harmless.
+ */
+bool cancel_timer(Timer_handle timer);
+
+/**
+ * @brief When the harness read the request being handled by the
+ * current handle_client_request call from its client, in the
+ * request tracer's clock (trace_now_ns() in tools/request_trace.h).
+ *
+ * With --io_threads this is before the request waited for the
+ * scheduling thread.
+ */
+uint64_t client_request_arrival_ns();
+
+/**
+ * @brief The master's clock, in seconds; time zero is arbitrary.
+ *
+ * This is CycleTimer::currentSeconds() under the real harness.
+ * Handlers should read the time through it, so that they also run
+ * unchanged on the simulated clock of the cluster simulator.
+ */
+double master_time_seconds();
+
 
 
 /**
@@ -98,6 +146,14 @@ void handle_client_request(Client_handle client_handle, const Request_msg& req);
  */
 void handle_worker_response(Worker_handle worker_handle, const Response_msg& resp);
 
+/**
+ * @brief Handle a load report from a worker.
+ *
+ * Called for each STATS message, whether it answers
+ * request_worker_stats() or the worker sent it on its own.
+ */
+void handle_worker_stats(Worker_handle worker_handle, const worker_stats_t& stats);
+
 /**
  * @brief Handle creation of a new worker.
  *
@@ -1,6 +1,8 @@
 #ifndef __LIBASST4_MESSAGES_H__
 #define __LIBASST4_MESSAGES_H__
 
+#include <stddef.h>
+
 #include <map>
 #include <string>
 
@@ -16,8 +18,10 @@ class Request_msg {
   Request_msg() { tag=0; }
   Request_msg(int tag);
   Request_msg(int tag, const std::string& str);
+  Request_msg(int tag, const char* buf, size_t len);
   Request_msg(int tag, const Request_msg& j);
   Request_msg(const Request_msg& j); // copy constructor
+  Request_msg& operator=(const Request_msg& j);
 
   std::string get_arg(const std::string& name) const;
   void set_arg(const std::string& key, const std::string& value);
@@ -26,6 +30,12 @@ class Request_msg {
   int  get_tag() const { return tag; }
 
   std::string get_request_string() const;
+
+  // Compact binary form used between master and workers: a command
+  // enum followed by typed (int32 or string) arguments.  Round-trips
+  // to exactly the same dictionary, and so the same request string.
+  void get_request_binary(std::string& out) const;
+  bool parse_request_binary(const char* buf, size_t len);
 };
 
 
@@ -1,6 +1,8 @@
 #ifndef __ASST4INCLUDE_WORKER_H__
 #define __ASST4INCLUDE_WORKER_H__
 
+#include "types/types.h"
+
 class Request_msg;
 class Response_msg;
 
@@ -16,6 +18,14 @@ class Response_msg;
  */
 void worker_send_response(const Response_msg& resp);
 
+/**
+ * @brief sends a load report (see worker_stats_t) to the master
+ *
+ * Notes: may be called from any thread, at any time after
+ * worker_node_init.  The harness fills in the *_threads fields.
+ */
+void worker_send_stats(const worker_stats_t& stats);
+
 /**
  * @brief: perform the work described by 'req', placing a response
  * string in 'resp'
@@ -53,5 +63,14 @@ void worker_node_init(const Request_msg& params);
  */
 void worker_handle_request(const Request_msg& req);
 
+/**
+ * @brief Fill in a load report for the master
+ *
+ * Notes: called by the harness when the master asks for one
+ * (REQUEST_STATS); 'stats' arrives zeroed and is sent once this
+ * returns.
+ */
+void worker_collect_stats(worker_stats_t* stats);
+
 
 #endif   // __ASST4INCLUDE_WORKER_H__
@@ -0,0 +1,108 @@
+#ifndef __TOOLS_AUTOSCALER_H__
+#define __TOOLS_AUTOSCALER_H__
+
+#include <math.h>
+
+#include <ostream>
+
+/*
+ * Autoscaler --
+ *
+ * Forecasts how many worker threads the next few seconds will keep
+ * busy and turns that into a worker count, so workers are booted
+ * before the load arrives instead of after latency has spiked.
+ *
+ * Every tick the caller reports the work that arrived since the last
+ * one, in thread-milliseconds (requests weighted by their estimated
+ * service time).  Holt's linear smoothing -- an EWMA of the level
+ * plus an EWMA of its trend -- extrapolates that rate 'horizon'
+ * seconds ahead, which should be how long a worker takes to boot.
+ * Work already queued is added as the threads needed to drain it
+ * within the same horizon.
+ *
+ * Hysteresis: the target grows as soon as the forecast asks for it,
+ * but only shrinks, one worker at a time, after the forecast has
+ * stayed below the current size for 'cooldown_ticks' ticks in a row.
+ */
+class Autoscaler {
+public:
+  struct Config {
+    double alpha;               // level smoothing
+    double beta;                // trend smoothing
+    double threads_per_worker;
+    double target_utilization;  // of those threads, at the forecast
+    int cooldown_ticks;
+    int min_workers;
+    int max_workers;
+  };
+
+private:
+  Config config;
+  bool primed;
+  double level;     // threads busy on average
+  double trend;     // change of 'level' per tick
+  double forecast;
+  int below_ticks;
+
+public:
+  explicit Autoscaler(const Config& c)
+    : config(c), primed(false), level(0.0), trend(0.0), forecast(0.0),
+      below_ticks(0) {}
+
+  /*
+   * update --
+   *
+   * Feed one tick and return the number of workers to have (booted
+   * or booting).  'arrived_ms' is the work that arrived during the
+   * last 'tick_seconds'; 'backlog_ms' the work waiting in queues.
+   */
+  int update(double arrived_ms, double tick_seconds, double backlog_ms,
+             double horizon_seconds, int current_workers) {
+    if (tick_seconds <= 0) {
+      return current_workers;
+    }
+    double rate = arrived_ms / (tick_seconds * 1000.0);
+    if (!primed) {
+      level = rate;
+      trend = 0.0;
+      primed = true;
+    } else {
+      double previous = level;
+      level = config.alpha * rate + (1 - config.alpha) * (level + trend);
+      trend = config.beta * (level - previous) + (1 - config.beta) * trend;
+    }
+
+    double ahead = horizon_seconds / tick_seconds;
+    forecast = level + trend * ahead;
+    if (forecast < 0) {
+      forecast = 0;
+    }
+    double drain = backlog_ms / (horizon_seconds > 0 ? horizon_seconds * 1000.0 : 1000.0);
+    double capacity = config.threads_per_worker * config.target_utilization;
+    int desired = static_cast<int>(ceil((forecast + drain) / capacity));
+    if (desired < config.min_workers) desired = config.min_workers;
+    if (desired > config.max_workers) desired = config.max_workers;
+
+    if (desired >= current_workers) {
+      below_ticks = 0;
+      return desired;
+    }
+    if (++below_ticks < config.cooldown_ticks) {
+      return current_workers;
+    }
+    below_ticks = 0;
+    return current_workers - 1;
+  }
+
+  double forecast_threads() const {
+    return forecast;
+  }
+
+  void dump_stats(std::ostream& out) const {
+    out << "autoscaler: level=" << level << " threads"
+        << " trend=" << trend << "/tick"
+        << " forecast=" << forecast << " threads";
+  }
+};
+
+#endif  // __TOOLS_AUTOSCALER_H__
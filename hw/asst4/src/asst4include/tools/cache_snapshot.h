@@ -0,0 +1,713 @@
+#ifndef __TOOLS_CACHE_SNAPSHOT_H__
+#define __TOOLS_CACHE_SNAPSHOT_H__
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tools/flat_hash_map.h"
+#include "tools/response_cache.h"
+
+/*
+ * Files of a cache directory (host byte order; they never leave the
+ * machine):
+ *
+ *   cache.snap    header, records, then an open-addressed index of
+ *                 (hash, record offset) slots.  Read through mmap:
+ *                 opening it costs the same for a thousand entries
+ *                 as for millions, and lookups touch a page or two.
+ *   cache.log     records appended as responses arrive.  Each carries
+ *                 a checksum, so a tail torn by a crash is cut off.
+ *   cache.log.1   the log being merged into cache.snap.
+ */
+
+struct SnapshotHeader {
+  char magic[8];
+  uint64_t records;
+  uint64_t index_offset;
+  uint64_t index_slots;   // power of two, 0 = no records
+  uint64_t file_bytes;
+};
+
+struct SnapshotRecord {
+  uint32_t key_len;
+  uint32_t value_len;
+  uint32_t checksum;
+  uint32_t unused;
+  double cost;
+  // followed by key_len + value_len bytes
+};
+
+struct SnapshotSlot {
+  uint64_t hash;
+  uint64_t offset;   // 0 = empty
+};
+
+static const char SNAPSHOT_MAGIC[8] = {'A', '4', 'S', 'N', 'A', 'P', '0', '1'};
+
+inline uint64_t snapshot_fnv(uint64_t h, const void* data, size_t len) {
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < len; ++i) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+inline uint64_t snapshot_hash(const char* key, size_t len) {
+  uint64_t h = snapshot_fnv(0xcbf29ce484222325ULL, key, len);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+inline uint32_t snapshot_checksum(const char* key, size_t key_len,
+                                  const char* value, size_t value_len,
+                                  double cost) {
+  uint64_t h = snapshot_fnv(0xcbf29ce484222325ULL, &key_len, sizeof(key_len));
+  h = snapshot_fnv(h, key, key_len);
+  h = snapshot_fnv(h, value, value_len);
+  h = snapshot_fnv(h, &cost, sizeof(cost));
+  return static_cast<uint32_t>(h ^ (h >> 32));
+}
+
+/*
+ * The record at 'offset' of a mapping 'bytes' long, with its key and
+ * value.  False if it runs past the end or fails its checksum.
+ */
+inline bool snapshot_read_record(const char* base, size_t bytes, size_t offset,
+                                 SnapshotRecord* rec, const char** key,
+                                 const char** value) {
+  if (offset + sizeof(SnapshotRecord) > bytes) {
+    return false;
+  }
+  memcpy(rec, base + offset, sizeof(SnapshotRecord));
+  size_t end = offset + sizeof(SnapshotRecord) + rec->key_len + rec->value_len;
+  if (end > bytes || end < offset) {
+    return false;
+  }
+  *key = base + offset + sizeof(SnapshotRecord);
+  *value = *key + rec->key_len;
+  return rec->checksum == snapshot_checksum(*key, rec->key_len, *value,
+                                            rec->value_len, rec->cost);
+}
+
+inline bool snapshot_write_record(FILE* f, const char* key, size_t key_len,
+                                  const char* value, size_t value_len,
+                                  double cost) {
+  SnapshotRecord rec;
+  rec.key_len = key_len;
+  rec.value_len = value_len;
+  rec.checksum = snapshot_checksum(key, key_len, value, value_len, cost);
+  rec.unused = 0;
+  rec.cost = cost;
+  return fwrite(&rec, sizeof(rec), 1, f) == 1
+      && fwrite(key, 1, key_len, f) == key_len
+      && fwrite(value, 1, value_len, f) == value_len;
+}
+
+/*
+ * MappedFile --
+ *
+ * A whole file mapped read-only.
+ */
+class MappedFile {
+public:
+  const char* base;
+  size_t bytes;
+
+  MappedFile() : base(NULL), bytes(0) {}
+  ~MappedFile() { close(); }
+
+  bool open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+      ::close(fd);
+      return false;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+    base = static_cast<const char*>(p);
+    bytes = st.st_size;
+    return true;
+  }
+
+  void close() {
+    if (base != NULL) {
+      munmap(const_cast<char*>(base), bytes);
+    }
+    base = NULL;
+    bytes = 0;
+  }
+};
+
+/*
+ * SnapshotFile --
+ *
+ * A mapped cache.snap.  Opening only checks the header; records are
+ * checked as they are read.
+ */
+class SnapshotFile {
+private:
+  MappedFile file;
+  SnapshotHeader header;
+
+public:
+  SnapshotFile() {
+    memset(&header, 0, sizeof(header));
+  }
+
+  /*
+   * open --
+   *
+   * False if 'path' is missing or is not a complete snapshot.
+   */
+  bool open(const std::string& path) {
+    if (!file.open(path)) {
+      return false;
+    }
+    if (file.bytes < sizeof(header)) {
+      file.close();
+      return false;
+    }
+    memcpy(&header, file.base, sizeof(header));
+    uint64_t slots = header.index_slots;
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+        || header.file_bytes != file.bytes
+        || (slots & (slots - 1)) != 0
+        || header.index_offset > file.bytes
+        || slots > (file.bytes - header.index_offset) / sizeof(SnapshotSlot)) {
+      file.close();
+      return false;
+    }
+    return true;
+  }
+
+  bool is_open() const {
+    return file.base != NULL;
+  }
+
+  uint64_t records() const {
+    return is_open() ? header.records : 0;
+  }
+
+  bool lookup(const std::string& key, std::string* value, double* cost) const {
+    if (!is_open() || header.index_slots == 0) {
+      return false;
+    }
+    uint64_t h = snapshot_hash(key.data(), key.size());
+    uint64_t mask = header.index_slots - 1;
+    const char* index = file.base + header.index_offset;
+    uint64_t i = h & mask;
+    for (uint64_t probes = 0; probes < header.index_slots; ++probes, i = (i + 1) & mask) {
+      SnapshotSlot slot;
+      memcpy(&slot, index + i * sizeof(SnapshotSlot), sizeof(slot));
+      if (slot.offset == 0) {
+        return false;
+      }
+      if (slot.hash != h) {
+        continue;
+      }
+      SnapshotRecord rec;
+      const char* k;
+      const char* v;
+      if (snapshot_read_record(file.base, header.index_offset, slot.offset,
+                               &rec, &k, &v)
+          && rec.key_len == key.size()
+          && memcmp(k, key.data(), key.size()) == 0) {
+        value->assign(v, rec.value_len);
+        *cost = rec.cost;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /*
+   * for_each --
+   *
+   * visit(key, key_len, value, value_len, cost) for each record, in
+   * file order.
+   */
+  template <class Visit>
+  void for_each(Visit& visit) const {
+    size_t offset = sizeof(header);
+    for (uint64_t r = 0; is_open() && r < header.records; ++r) {
+      SnapshotRecord rec;
+      const char* k;
+      const char* v;
+      if (!snapshot_read_record(file.base, header.index_offset, offset, &rec, &k, &v)) {
+        return;
+      }
+      visit(k, rec.key_len, v, rec.value_len, rec.cost);
+      offset += sizeof(rec) + rec.key_len + rec.value_len;
+    }
+  }
+};
+
+/*
+ * replay_cache_log --
+ *
+ * visit(key, key_len, value, value_len, cost) for each intact record
+ * of the log at 'path', oldest first.  Returns the length of the
+ * intact prefix (0 if there is no log).
+ */
+template <class Visit>
+size_t replay_cache_log(const std::string& path, Visit& visit) {
+  MappedFile log;
+  if (!log.open(path)) {
+    return 0;
+  }
+  size_t offset = 0;
+  SnapshotRecord rec;
+  const char* k;
+  const char* v;
+  while (snapshot_read_record(log.base, log.bytes, offset, &rec, &k, &v)) {
+    visit(k, rec.key_len, v, rec.value_len, rec.cost);
+    offset += sizeof(rec) + rec.key_len + rec.value_len;
+  }
+  return offset;
+}
+
+/*
+ * CacheSnapshot --
+ *
+ * Keeps the master's response cache across restarts.  Every response
+ * the master caches is appended to cache.log; lookups that miss the
+ * in-memory cache fall back to the mapped cache.snap.  A compaction
+ * moves the log aside and merges it into a new cache.snap on a
+ * background thread (newest record of a key wins), then the master
+ * swaps the new snapshot in at its next poll().  Snapshots hold their
+ * records newest first: the log's from its end back, then the old
+ * snapshot's, so the records beyond the size cap that are dropped are
+ * the oldest.
+ *
+ * load() maps the snapshot and replays the logs into the in-memory
+ * cache, so its cost is bounded by the log, not by the snapshot.
+ *
+ * All methods are for the master's thread.
+ */
+class CacheSnapshot {
+public:
+  struct Stats {
+    uint64_t snapshot_records;
+    long replayed;        // log records replayed by load()
+    double load_ms;
+    long hits;            // lookups answered from the snapshot
+    long misses;
+    long appends;
+    long compactions;
+    long failed_compactions;
+  };
+
+private:
+  enum {
+    COMPACT_IDLE,
+    COMPACT_RUNNING,
+    COMPACT_DONE,
+    COMPACT_FAILED
+  };
+
+  std::string dir;
+  std::string snap_path;
+  std::string log_path;
+  std::string old_log_path;
+  size_t max_bytes;
+
+  SnapshotFile* snapshot;
+  FILE* log;
+  size_t log_bytes;
+
+  pthread_t compactor;
+  std::atomic<int> compact_state;
+  uint64_t compacted_records;   // written by the compactor
+  Stats stats;
+
+  struct CacheInserter {
+    ResponseCache* cache;
+    long count;
+
+    void operator()(const char* k, size_t kl, const char* v, size_t vl, double cost) {
+      cache->insert(std::string(k, kl), std::string(v, vl), cost);
+      count++;
+    }
+  };
+
+  struct SkipRecords {
+    void operator()(const char*, size_t, const char*, size_t, double) {}
+  };
+
+  struct LogEntry {
+    std::string value;
+    double cost;
+    uint64_t seq;     // position of the key's newest record in the log
+  };
+
+  struct LogCollector {
+    FlatHashMap<std::string, LogEntry>* newest;
+    uint64_t seq;
+
+    void operator()(const char* k, size_t kl, const char* v, size_t vl, double cost) {
+      LogEntry& e = (*newest)[std::string(k, kl)];
+      e.value.assign(v, vl);
+      e.cost = cost;
+      e.seq = seq++;
+    }
+  };
+
+  typedef std::pair<uint64_t, FlatHashMap<std::string, LogEntry>::iterator> LogOrder;
+
+  struct SnapshotWriter {
+    FILE* f;
+    size_t offset;
+    size_t max_bytes;
+    bool ok;
+    bool full;        // older records no longer fit
+    std::vector<SnapshotSlot> slots;
+    const FlatHashMap<std::string, LogEntry>* newer;   // skip these keys
+
+    void add(const char* k, size_t kl, const char* v, size_t vl, double cost) {
+      if (!ok || full) {
+        return;
+      }
+      if (offset + sizeof(SnapshotRecord) + kl + vl > max_bytes) {
+        full = true;
+        return;
+      }
+      SnapshotSlot slot;
+      slot.hash = snapshot_hash(k, kl);
+      slot.offset = offset;
+      slots.push_back(slot);
+      ok = snapshot_write_record(f, k, kl, v, vl, cost);
+      offset += sizeof(SnapshotRecord) + kl + vl;
+    }
+
+    void operator()(const char* k, size_t kl, const char* v, size_t vl, double cost) {
+      if (newer == NULL || !newer->contains(std::string(k, kl))) {
+        add(k, kl, v, vl, cost);
+      }
+    }
+  };
+
+  struct NewerFirst {
+    bool operator()(const LogOrder& a, const LogOrder& b) const {
+      return a.first > b.first;
+    }
+  };
+
+  static double now_ms() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+  }
+
+  static bool file_exists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+  }
+
+  // Cut a log back to its first 'intact' bytes (what replay_cache_log
+  // read of it), dropping a tail torn by a crash so that records
+  // appended later are not hidden behind it.
+  static bool trim_log(const std::string& path, size_t intact) {
+    return !file_exists(path) || truncate(path.c_str(), intact) == 0;
+  }
+
+  bool open_log() {
+    log = fopen(log_path.c_str(), "ab");
+    if (log == NULL) {
+      return false;
+    }
+    fseek(log, 0, SEEK_END);
+    log_bytes = ftell(log);
+    return true;
+  }
+
+  /*
+   * Write the merge of cache.snap and cache.log.1 to cache.snap.tmp
+   * and rename it over cache.snap.  Runs on the compactor thread; the
+   * master's thread only reads 'snapshot' meanwhile.
+   */
+  bool compact() {
+    FlatHashMap<std::string, LogEntry> newest;
+    LogCollector collect;
+    collect.newest = &newest;
+    collect.seq = 0;
+    replay_cache_log(old_log_path, collect);
+    std::vector<LogOrder> order;
+    order.reserve(newest.size());
+    for (FlatHashMap<std::string, LogEntry>::iterator it = newest.begin();
+         it != newest.end(); ++it) {
+      order.push_back(LogOrder(it.value().seq, it));
+    }
+    std::sort(order.begin(), order.end(), NewerFirst());
+
+    std::string tmp_path = snap_path + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    if (f == NULL) {
+      return false;
+    }
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    SnapshotWriter writer;
+    writer.f = f;
+    writer.offset = sizeof(header);
+    writer.max_bytes = max_bytes;
+    writer.ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    writer.full = false;
+    writer.newer = NULL;
+    for (size_t i = 0; i < order.size(); ++i) {
+      const std::string& key = order[i].second.key();
+      const LogEntry& e = order[i].second.value();
+      writer.add(key.data(), key.size(), e.value.data(), e.value.size(), e.cost);
+    }
+    writer.newer = &newest;
+    snapshot->for_each(writer);
+
+    // at most half full, so probes stay short
+    uint64_t num_slots = 16;
+    while (num_slots < 2 * writer.slots.size()) {
+      num_slots *= 2;
+    }
+    std::vector<SnapshotSlot> index(num_slots);
+    memset(index.data(), 0, num_slots * sizeof(SnapshotSlot));
+    for (size_t i = 0; i < writer.slots.size(); ++i) {
+      uint64_t pos = writer.slots[i].hash & (num_slots - 1);
+      while (index[pos].offset != 0) {
+        pos = (pos + 1) & (num_slots - 1);
+      }
+      index[pos] = writer.slots[i];
+    }
+
+    size_t pad = (8 - writer.offset % 8) % 8;
+    static const char zeros[8] = {0};
+    bool ok = writer.ok && fwrite(zeros, 1, pad, f) == pad
+        && fwrite(index.data(), sizeof(SnapshotSlot), num_slots, f) == num_slots;
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.records = writer.slots.size();
+    header.index_offset = writer.offset + pad;
+    header.index_slots = num_slots;
+    header.file_bytes = header.index_offset + num_slots * sizeof(SnapshotSlot);
+    ok = ok && fseek(f, 0, SEEK_SET) == 0
+        && fwrite(&header, sizeof(header), 1, f) == 1
+        && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), snap_path.c_str()) != 0) {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+    compacted_records = header.records;
+    return true;
+  }
+
+  static void* compactor_main(void* arg) {
+    CacheSnapshot* self = static_cast<CacheSnapshot*>(arg);
+    bool ok = self->compact();
+    self->compact_state.store(ok ? COMPACT_DONE : COMPACT_FAILED);
+    return NULL;
+  }
+
+  /*
+   * Move cache.log aside as cache.log.1.  A cache.log.1 left by an
+   * earlier failed compaction (or a crash) is kept, trimmed to its
+   * intact records, and the log is appended to it, so nothing is lost.
+   */
+  bool rotate_log() {
+    fclose(log);
+    log = NULL;
+    bool ok;
+    if (!file_exists(old_log_path)) {
+      ok = rename(log_path.c_str(), old_log_path.c_str()) == 0;
+    } else {
+      SkipRecords skip;
+      ok = trim_log(old_log_path, replay_cache_log(old_log_path, skip));
+      FILE* in = fopen(log_path.c_str(), "rb");
+      FILE* out = fopen(old_log_path.c_str(), "ab");
+      ok = ok && in != NULL && out != NULL;
+      char buf[1 << 16];
+      size_t n;
+      while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        ok = fwrite(buf, 1, n, out) == n;
+      }
+      if (in != NULL) fclose(in);
+      if (out != NULL) ok = (fclose(out) == 0) && ok;
+      ok = ok && truncate(log_path.c_str(), 0) == 0;
+    }
+    return open_log() && ok;
+  }
+
+public:
+  CacheSnapshot(const std::string& directory, size_t max_snapshot_bytes)
+    : dir(directory), snap_path(directory + "/cache.snap"),
+      log_path(directory + "/cache.log"),
+      old_log_path(directory + "/cache.log.1"),
+      max_bytes(max_snapshot_bytes), snapshot(new SnapshotFile()),
+      log(NULL), log_bytes(0), compact_state(COMPACT_IDLE),
+      compacted_records(0) {
+    memset(&stats, 0, sizeof(stats));
+  }
+
+  ~CacheSnapshot() {
+    if (compact_state.load() != COMPACT_IDLE) {
+      pthread_join(compactor, NULL);
+    }
+    if (log != NULL) {
+      fclose(log);
+    }
+    delete snapshot;
+  }
+
+  /*
+   * load --
+   *
+   * Map the snapshot and replay the logs into 'cache'.  False if the
+   * directory cannot hold a log, in which case nothing is persisted.
+   */
+  bool load(ResponseCache* cache) {
+    double start = now_ms();
+    mkdir(dir.c_str(), 0755);
+    snapshot->open(snap_path);
+
+    CacheInserter insert;
+    insert.cache = cache;
+    insert.count = 0;
+    // drop torn tails so appends start on a record boundary
+    if (!trim_log(old_log_path, replay_cache_log(old_log_path, insert)) ||
+        !trim_log(log_path, replay_cache_log(log_path, insert))) {
+      return false;
+    }
+
+    stats.snapshot_records = snapshot->records();
+    stats.replayed = insert.count;
+    stats.load_ms = now_ms() - start;
+    return open_log();
+  }
+
+  bool lookup(const std::string& key, std::string* value, double* cost) {
+    if (snapshot->lookup(key, value, cost)) {
+      stats.hits++;
+      return true;
+    }
+    stats.misses++;
+    return false;
+  }
+
+  void append(const std::string& key, const std::string& value, double cost) {
+    if (log == NULL) {
+      return;
+    }
+    snapshot_write_record(log, key.data(), key.size(), value.data(), value.size(), cost);
+    log_bytes += sizeof(SnapshotRecord) + key.size() + value.size();
+    stats.appends++;
+  }
+
+  // Hand buffered appends to the kernel.
+  void flush() {
+    if (log != NULL) {
+      fflush(log);
+    }
+  }
+
+  size_t pending_log_bytes() const {
+    return log_bytes;
+  }
+
+  bool compacting() const {
+    return compact_state.load() != COMPACT_IDLE;
+  }
+
+  /*
+   * start_compaction --
+   *
+   * Rotate the log and merge it into a new snapshot in the
+   * background.  False if a compaction is already running or the log
+   * could not be rotated.
+   */
+  bool start_compaction() {
+    if (log == NULL || compacting()) {
+      return false;
+    }
+    fflush(log);
+    if (!rotate_log()) {
+      return false;
+    }
+    compact_state.store(COMPACT_RUNNING);
+    if (pthread_create(&compactor, NULL, compactor_main, this) != 0) {
+      compact_state.store(COMPACT_IDLE);
+      return false;
+    }
+    return true;
+  }
+
+  /*
+   * poll --
+   *
+   * Swap in the snapshot of a finished compaction.  Cheap; call it
+   * periodically.
+   */
+  void poll() {
+    int state = compact_state.load();
+    if (state != COMPACT_DONE && state != COMPACT_FAILED) {
+      return;
+    }
+    pthread_join(compactor, NULL);
+    if (state == COMPACT_DONE) {
+      SnapshotFile* fresh = new SnapshotFile();
+      if (fresh->open(snap_path)) {
+        delete snapshot;
+        snapshot = fresh;
+        unlink(old_log_path.c_str());
+        stats.snapshot_records = compacted_records;
+      } else {
+        delete fresh;
+      }
+      stats.compactions++;
+    } else {
+      // cache.log.1 stays and is merged by the next compaction
+      stats.failed_compactions++;
+    }
+    compact_state.store(COMPACT_IDLE);
+  }
+
+  const Stats& get_stats() const {
+    return stats;
+  }
+
+  void dump_stats(std::ostream& out) const {
+    out << "cache snapshot: records=" << stats.snapshot_records
+        << " load_ms=" << stats.load_ms
+        << " replayed=" << stats.replayed
+        << " hits=" << stats.hits
+        << " misses=" << stats.misses
+        << " appends=" << stats.appends
+        << " compactions=" << stats.compactions
+        << " failed=" << stats.failed_compactions;
+  }
+};
+
+#endif  // __TOOLS_CACHE_SNAPSHOT_H__
@@ -0,0 +1,165 @@
+#ifndef __TOOLS_CONSISTENT_HASH_H__
+#define __TOOLS_CONSISTENT_HASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * ConsistentHashRing --
+ *
+ * Maps keys (request strings) to nodes so that the same key keeps
+ * going to the same node, and adding or removing a node only moves
+ * the keys of its neighbours on the ring.  Every node is hashed onto
+ * the ring 'replicas' times, from a caller-chosen id that must be
+ * distinct per node (e.g. a counter), so placement does not depend on
+ * pointer values; a key belongs to the first node clockwise of its own
+ * hash.
+ *
+ * pick() implements consistent hashing with bounded loads: the caller
+ * decides whether a node may take the key right now (e.g. its load
+ * is under (1 + eps) times the average), and the walk continues
+ * clockwise to the next distinct node until one accepts.  A hot key
+ * thus spills over to the same few nodes instead of overloading its
+ * own.
+ */
+template <class Node>
+class ConsistentHashRing {
+public:
+  struct Stats {
+    long picks;
+    long home;       // the key's own node accepted it
+    long spilled;    // went further clockwise
+    long rejected;   // no node accepted
+  };
+
+private:
+  struct Point {
+    uint64_t hash;
+    Node node;
+
+    bool operator<(const Point& other) const {
+      return hash < other.hash;
+    }
+  };
+
+  int replicas;
+  std::vector<Point> ring;   // sorted by hash
+  size_t num_nodes;
+  Stats stats;
+
+  // FNV-1a, then a 64-bit finalizer so that nearby ids and keys
+  // spread over the whole ring
+  static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  static uint64_t hash_bytes(const char* data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+      h ^= static_cast<unsigned char>(data[i]);
+      h *= 0x100000001b3ULL;
+    }
+    return mix(h);
+  }
+
+public:
+  explicit ConsistentHashRing(int replicas_per_node = 64)
+    : replicas(replicas_per_node), num_nodes(0) {
+    stats.picks = stats.home = stats.spilled = stats.rejected = 0;
+  }
+
+  static uint64_t hash_key(const std::string& key) {
+    return hash_bytes(key.data(), key.size());
+  }
+
+  void add(Node node, uint64_t id) {
+    for (int r = 0; r < replicas; ++r) {
+      Point p;
+      p.hash = mix(id * 0x9e3779b97f4a7c15ULL + r + 1);
+      p.node = node;
+      ring.push_back(p);
+    }
+    std::sort(ring.begin(), ring.end());
+    num_nodes++;
+  }
+
+  void remove(Node node) {
+    size_t before = ring.size();
+    for (size_t i = 0; i < ring.size(); ) {
+      if (ring[i].node == node) {
+        ring.erase(ring.begin() + i);
+      } else {
+        ++i;
+      }
+    }
+    if (ring.size() < before) {
+      num_nodes--;
+    }
+  }
+
+  size_t size() const {
+    return num_nodes;
+  }
+
+  /*
+   * pick --
+   *
+   * The first node clockwise of 'key' for which accept(node) is true,
+   * trying each node at most once.  Returns false (and leaves *out
+   * alone) if the ring is empty or no node accepts.
+   */
+  template <class Accept>
+  bool pick(const std::string& key, Accept& accept, Node* out) {
+    stats.picks++;
+    if (ring.empty()) {
+      stats.rejected++;
+      return false;
+    }
+    Point probe;
+    probe.hash = hash_key(key);
+    size_t start = std::lower_bound(ring.begin(), ring.end(), probe) - ring.begin();
+    std::vector<Node> tried;
+    for (size_t i = 0; i < ring.size() && tried.size() < num_nodes; ++i) {
+      const Node& node = ring[(start + i) % ring.size()].node;
+      if (std::find(tried.begin(), tried.end(), node) != tried.end()) {
+        continue;
+      }
+      if (accept(node)) {
+        if (tried.empty()) {
+          stats.home++;
+        } else {
+          stats.spilled++;
+        }
+        *out = node;
+        return true;
+      }
+      tried.push_back(node);
+    }
+    stats.rejected++;
+    return false;
+  }
+
+  const Stats& get_stats() const {
+    return stats;
+  }
+
+  void dump_stats(std::ostream& out) const {
+    out << "hash ring: nodes=" << num_nodes
+        << " picks=" << stats.picks
+        << " home=" << stats.home
+        << " spilled=" << stats.spilled
+        << " rejected=" << stats.rejected;
+  }
+};
+
+#endif  // __TOOLS_CONSISTENT_HASH_H__
@@ -0,0 +1,122 @@
+#ifndef __TOOLS_COST_MODEL_H__
+#define __TOOLS_COST_MODEL_H__
+
+#include <stddef.h>
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+// The node resource a request type mostly consumes.
+typedef enum {
+  RESOURCE_CPU,      // compute bound, tiny working set
+  RESOURCE_MEMORY,   // streams memory, bandwidth bound
+  RESOURCE_CACHE,    // working set sized to the LLC
+  RESOURCE_NONE,     // negligible work
+  NUM_RESOURCES
+} resource_t;
+
+/*
+ * CostModel --
+ *
+ * Online per-command service time estimates.  Each command starts
+ * from a prior and every observed service time moves its estimate by
+ * an exponentially weighted moving average, so the model tracks the
+ * machine it actually runs on instead of hand-tuned constants.
+ * Commands that were never registered get the default prior and
+ * count as CPU bound.
+ */
+class CostModel {
+public:
+  struct CommandStats {
+    std::string cmd;
+    resource_t resource;
+    double estimate_ms;
+    long samples;
+    double min_ms;
+    double max_ms;
+  };
+
+private:
+  double alpha;
+  double default_ms;
+  std::vector<CommandStats> commands;   // a handful: linear scan
+
+  const CommandStats* find(const std::string& cmd) const {
+    for (size_t i = 0; i < commands.size(); ++i) {
+      if (commands[i].cmd == cmd) {
+        return &commands[i];
+      }
+    }
+    return NULL;
+  }
+
+  CommandStats* find(const std::string& cmd) {
+    const CostModel* self = this;
+    return const_cast<CommandStats*>(self->find(cmd));
+  }
+
+public:
+  CostModel(double ewma_alpha, double default_prior_ms)
+    : alpha(ewma_alpha), default_ms(default_prior_ms) {}
+
+  void add_command(const std::string& cmd, resource_t resource, double prior_ms) {
+    CommandStats s;
+    s.cmd = cmd;
+    s.resource = resource;
+    s.estimate_ms = prior_ms;
+    s.samples = 0;
+    s.min_ms = 0.0;
+    s.max_ms = 0.0;
+    commands.push_back(s);
+  }
+
+  resource_t resource(const std::string& cmd) const {
+    const CommandStats* s = find(cmd);
+    return s == NULL ? RESOURCE_CPU : s->resource;
+  }
+
+  double predict(const std::string& cmd) const {
+    const CommandStats* s = find(cmd);
+    return s == NULL ? default_ms : s->estimate_ms;
+  }
+
+  void observe(const std::string& cmd, double service_ms) {
+    CommandStats* s = find(cmd);
+    if (s == NULL) {
+      add_command(cmd, RESOURCE_CPU, default_ms);
+      s = &commands.back();
+    }
+    if (s->samples == 0) {
+      // the first real measurement beats any prior
+      s->estimate_ms = service_ms;
+      s->min_ms = s->max_ms = service_ms;
+    } else {
+      s->estimate_ms += alpha * (service_ms - s->estimate_ms);
+      if (service_ms < s->min_ms) s->min_ms = service_ms;
+      if (service_ms > s->max_ms) s->max_ms = service_ms;
+    }
+    s->samples++;
+  }
+
+  const std::vector<CommandStats>& get_stats() const {
+    return commands;
+  }
+
+  void dump_stats(std::ostream& out) const {
+    static const char* resource_names[NUM_RESOURCES] = {
+      "cpu", "memory", "cache", "none"
+    };
+    out << "cost model:";
+    for (size_t i = 0; i < commands.size(); ++i) {
+      const CommandStats& s = commands[i];
+      out << "\n  " << s.cmd << " (" << resource_names[s.resource] << "):"
+          << " estimate=" << s.estimate_ms << "ms"
+          << " samples=" << s.samples
+          << " min=" << s.min_ms << "ms"
+          << " max=" << s.max_ms << "ms";
+    }
+  }
+};
+
+#endif  // __TOOLS_COST_MODEL_H__
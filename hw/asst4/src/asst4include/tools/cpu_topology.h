@@ -0,0 +1,179 @@
+#ifndef __TOOLS_CPU_TOPOLOGY_H__
+#define __TOOLS_CPU_TOPOLOGY_H__
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*
+ * CpuTopology --
+ *
+ * Which CPUs (hardware threads) the machine has, and for each its
+ * physical core, last level cache domain and NUMA node, read from
+ * sysfs.  Only CPUs this process may run on are listed.  Where sysfs
+ * has nothing to say, every CPU is its own core in LLC domain 0 on
+ * node 0, so callers still get a usable (flat) placement.
+ */
+class CpuTopology {
+public:
+  struct Cpu {
+    int id;
+    int core;        // unique per physical core
+    int llc;         // unique per last level cache
+    int node;
+  };
+
+private:
+  std::vector<Cpu> cpus;
+
+  static int read_int(const std::string& path, int fallback) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (f == NULL) {
+      return fallback;
+    }
+    int value;
+    if (fscanf(f, "%d", &value) != 1) {
+      value = fallback;
+    }
+    fclose(f);
+    return value;
+  }
+
+  // lowest CPU of a sysfs cpu list ("0-5,12-17"), which names the set
+  static int read_first_cpu(const std::string& path, int fallback) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (f == NULL) {
+      return fallback;
+    }
+    char line[4096];
+    int first = -1;
+    if (fgets(line, sizeof(line), f) != NULL) {
+      // each range is "a" or "a-b", separated by commas
+      const char* p = line;
+      while (*p >= '0' && *p <= '9') {
+        char* end;
+        int cpu = static_cast<int>(strtol(p, &end, 10));
+        if (first < 0 || cpu < first) {
+          first = cpu;
+        }
+        p = end;
+        if (*p == '-') {
+          strtol(p + 1, &end, 10);
+          p = end;
+        }
+        if (*p != ',') {
+          break;
+        }
+        ++p;
+      }
+    }
+    fclose(f);
+    return first < 0 ? fallback : first;
+  }
+
+  static int find_node(int cpu) {
+    for (int node = 0; node < 64; ++node) {
+      char path[128];
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+      if (access(path, F_OK) == 0) {
+        return node;
+      }
+    }
+    return 0;
+  }
+
+  // sysfs cache directory of the last level cache of 'cpu'
+  static std::string llc_dir(int cpu) {
+    std::string best;
+    int best_level = 0;
+    for (int index = 0; index < 8; ++index) {
+      char dir[128];
+      snprintf(dir, sizeof(dir), "/sys/devices/system/cpu/cpu%d/cache/index%d", cpu, index);
+      int level = read_int(std::string(dir) + "/level", -1);
+      if (level < 0) {
+        break;
+      }
+      if (level >= best_level) {
+        best_level = level;
+        best = dir;
+      }
+    }
+    return best;
+  }
+
+public:
+  CpuTopology() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+      for (int i = 0; i < sysconf(_SC_NPROCESSORS_ONLN); ++i) {
+        CPU_SET(i, &allowed);
+      }
+    }
+    for (int id = 0; id < CPU_SETSIZE; ++id) {
+      if (!CPU_ISSET(id, &allowed)) {
+        continue;
+      }
+      char topology[128];
+      snprintf(topology, sizeof(topology), "/sys/devices/system/cpu/cpu%d/topology", id);
+      Cpu c;
+      c.id = id;
+      c.core = read_first_cpu(std::string(topology) + "/thread_siblings_list", id);
+      std::string llc = llc_dir(id);
+      c.llc = llc.empty() ? 0 : read_first_cpu(llc + "/shared_cpu_list", 0);
+      c.node = find_node(id);
+      cpus.push_back(c);
+    }
+  }
+
+  const std::vector<Cpu>& get_cpus() const {
+    return cpus;
+  }
+
+  // LLC domains, named by their first CPU, in ascending order
+  std::vector<int> llc_domains() const {
+    std::vector<int> domains;
+    for (size_t i = 0; i < cpus.size(); ++i) {
+      if (std::find(domains.begin(), domains.end(), cpus[i].llc) == domains.end()) {
+        domains.push_back(cpus[i].llc);
+      }
+    }
+    std::sort(domains.begin(), domains.end());
+    return domains;
+  }
+
+  const Cpu* find(int id) const {
+    for (size_t i = 0; i < cpus.size(); ++i) {
+      if (cpus[i].id == id) {
+        return &cpus[i];
+      }
+    }
+    return NULL;
+  }
+};
+
+/*
+ * prefer_memory_node --
+ *
+ * Make the calling thread's allocations prefer NUMA node 'node'
+ * (set_mempolicy(MPOL_PREFERRED), without needing libnuma).  Returns
+ * false where the kernel does not support it.
+ */
+inline bool prefer_memory_node(int node) {
+#ifdef SYS_set_mempolicy
+  const int MPOL_PREFERRED_MODE = 1;
+  unsigned long mask = 1UL << node;
+  return syscall(SYS_set_mempolicy, MPOL_PREFERRED_MODE, &mask, sizeof(mask) * 8) == 0;
+#else
+  (void)node;
+  return false;
+#endif
+}
+
+#endif  // __TOOLS_CPU_TOPOLOGY_H__
@@ -0,0 +1,171 @@
+#ifndef __TOOLS_DEADLINE_QUEUE_H__
+#define __TOOLS_DEADLINE_QUEUE_H__
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*
+ * DeadlineQueue --
+ *
+ * Earliest-deadline-first queue: a binary min-heap on the deadline,
+ * with items of equal deadline kept in arrival order, so with a
+ * constant deadline it degenerates to a FIFO.  Has the std::queue
+ * calls the master already uses (front/pop/empty/size); push() takes
+ * the deadline.  Not thread safe.
+ */
+template <class T>
+class DeadlineQueue {
+private:
+  struct Entry {
+    double deadline;
+    unsigned long seq;
+    T item;
+  };
+
+  // std::*_heap keep the largest entry first, so "less" means later
+  struct Later {
+    bool operator()(const Entry& a, const Entry& b) const {
+      if (a.deadline != b.deadline) {
+        return a.deadline > b.deadline;
+      }
+      return a.seq > b.seq;
+    }
+  };
+
+  std::vector<Entry> heap;
+  unsigned long next_seq;
+
+public:
+  DeadlineQueue() : next_seq(0) {}
+
+  void push(const T& item, double deadline) {
+    Entry e;
+    e.deadline = deadline;
+    e.seq = next_seq++;
+    e.item = item;
+    heap.push_back(e);
+    std::push_heap(heap.begin(), heap.end(), Later());
+  }
+
+  const T& front() const {
+    return heap.front().item;
+  }
+
+  double front_deadline() const {
+    return heap.front().deadline;
+  }
+
+  void pop() {
+    std::pop_heap(heap.begin(), heap.end(), Later());
+    heap.pop_back();
+  }
+
+  bool empty() const {
+    return heap.empty();
+  }
+
+  size_t size() const {
+    return heap.size();
+  }
+};
+
+/*
+ * ClassDeadlineQueue --
+ *
+ * One DeadlineQueue per class of item (the master uses the command
+ * name), so an item that cannot be placed yet only holds up its own
+ * class.  drain() places heads earliest deadline first across the
+ * classes; a class whose head is refused is skipped for the rest of
+ * the drain.  Not thread safe.
+ */
+template <class T>
+class ClassDeadlineQueue {
+private:
+  struct Class {
+    std::string name;
+    DeadlineQueue<T> queue;
+  };
+
+  std::vector<Class> classes;
+  size_t count;
+
+  DeadlineQueue<T>& queue_of(const std::string& name) {
+    for (size_t i = 0; i < classes.size(); ++i) {
+      if (classes[i].name == name) {
+        return classes[i].queue;
+      }
+    }
+    classes.push_back(Class());
+    classes.back().name = name;
+    return classes.back().queue;
+  }
+
+public:
+  ClassDeadlineQueue() : count(0) {}
+
+  void push(const T& item, const std::string& name, double deadline) {
+    queue_of(name).push(item, deadline);
+    ++count;
+  }
+
+  /*
+   * drain --
+   *
+   * Offer heads to 'place' (a functor taking const T&, returning
+   * true if it took the item) until every class is empty or refused
+   * once.  Returns the number placed.
+   */
+  template <class F>
+  size_t drain(F& place) {
+    std::vector<bool> refused(classes.size(), false);
+    size_t placed = 0;
+    while (true) {
+      int best = -1;
+      for (size_t i = 0; i < classes.size(); ++i) {
+        if (refused[i] || classes[i].queue.empty()) {
+          continue;
+        }
+        if (best < 0 || classes[i].queue.front_deadline() <
+                        classes[best].queue.front_deadline()) {
+          best = i;
+        }
+      }
+      if (best < 0) {
+        return placed;
+      }
+      if (!place(classes[best].queue.front())) {
+        refused[best] = true;
+        continue;
+      }
+      classes[best].queue.pop();
+      --count;
+      ++placed;
+    }
+  }
+
+  // per class, for forecasts
+  size_t num_classes() const {
+    return classes.size();
+  }
+
+  const std::string& class_name(size_t i) const {
+    return classes[i].name;
+  }
+
+  size_t class_size(size_t i) const {
+    return classes[i].queue.size();
+  }
+
+  bool empty() const {
+    return count == 0;
+  }
+
+  size_t size() const {
+    return count;
+  }
+};
+
+#endif  // __TOOLS_DEADLINE_QUEUE_H__
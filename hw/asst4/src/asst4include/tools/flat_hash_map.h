@@ -0,0 +1,200 @@
+#ifndef __TOOLS_FLAT_HASH_MAP_H__
+#define __TOOLS_FLAT_HASH_MAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <utility>
+#include <vector>
+
+/*
+ * FlatHashMap --
+ *
+ * Open-addressing hash map with robin-hood probing and backward-shift
+ * deletion.  All entries live in one flat array (no per-node
+ * allocation, no tombstones), so lookups touch one or two cache lines
+ * and a map whose keys come and go stays the same size in memory.
+ *
+ * The interface is a small subset of std::map: find() returns a
+ * pointer to the value (NULL if absent), operator[] inserts a default
+ * value, erase() returns whether the key was present.  Iteration
+ * order is unspecified, and any insert or erase invalidates pointers
+ * and iterators.
+ */
+template <class K, class V, class Hash = std::hash<K> >
+class FlatHashMap {
+private:
+  struct Slot {
+    // 0 = empty, otherwise 1 + distance from the home bucket
+    uint32_t dist;
+    K key;
+    V value;
+
+    Slot() : dist(0), key(), value() {}
+  };
+
+  std::vector<Slot> slots;
+  size_t mask;
+  size_t count;
+  Hash hasher;
+
+  static const size_t INITIAL_CAPACITY = 16;
+
+  // Finalizer from MurmurHash3: std::hash is the identity for
+  // integers and pointers, whose low bits are often all zero.
+  size_t home(const K& key) const {
+    uint64_t h = static_cast<uint64_t>(hasher(key));
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return static_cast<size_t>(h) & mask;
+  }
+
+  size_t find_index(const K& key) const {
+    size_t pos = home(key);
+    for (uint32_t dist = 1; ; ++dist) {
+      const Slot& s = slots[pos];
+      // robin hood invariant: once we pass a richer slot the key
+      // cannot be further along
+      if (s.dist < dist) {
+        return slots.size();
+      }
+      if (s.dist == dist && s.key == key) {
+        return pos;
+      }
+      pos = (pos + 1) & mask;
+    }
+  }
+
+  void grow() {
+    std::vector<Slot> old;
+    old.swap(slots);
+    slots.resize(old.size() * 2);
+    mask = slots.size() - 1;
+    count = 0;
+    for (size_t i = 0; i < old.size(); ++i) {
+      if (old[i].dist != 0) {
+        insert_new(old[i].key, old[i].value);
+      }
+    }
+  }
+
+  // Insert a key known to be absent; returns its final position.
+  size_t insert_new(const K& key, const V& value) {
+    Slot carry;
+    carry.dist = 1;
+    carry.key = key;
+    carry.value = value;
+
+    size_t pos = home(key);
+    size_t result = slots.size();
+    while (true) {
+      Slot& s = slots[pos];
+      if (s.dist == 0) {
+        s = carry;
+        count++;
+        return result == slots.size() ? pos : result;
+      }
+      if (s.dist < carry.dist) {
+        std::swap(s, carry);
+        if (result == slots.size()) {
+          result = pos;
+        }
+      }
+      carry.dist++;
+      pos = (pos + 1) & mask;
+    }
+  }
+
+public:
+
+  class iterator {
+  private:
+    FlatHashMap* map;
+    size_t pos;
+
+    void skip_empty() {
+      while (pos < map->slots.size() && map->slots[pos].dist == 0) {
+        pos++;
+      }
+    }
+
+  public:
+    iterator(FlatHashMap* m, size_t p) : map(m), pos(p) { skip_empty(); }
+
+    const K& key() const { return map->slots[pos].key; }
+    V& value() const { return map->slots[pos].value; }
+
+    iterator& operator++() {
+      pos++;
+      skip_empty();
+      return *this;
+    }
+    bool operator!=(const iterator& other) const { return pos != other.pos; }
+    bool operator==(const iterator& other) const { return pos == other.pos; }
+  };
+
+  FlatHashMap() : slots(INITIAL_CAPACITY), mask(INITIAL_CAPACITY - 1),
+                  count(0) {}
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, slots.size()); }
+
+  V* find(const K& key) {
+    size_t pos = find_index(key);
+    return pos == slots.size() ? NULL : &slots[pos].value;
+  }
+
+  const V* find(const K& key) const {
+    size_t pos = find_index(key);
+    return pos == slots.size() ? NULL : &slots[pos].value;
+  }
+
+  bool contains(const K& key) const {
+    return find_index(key) != slots.size();
+  }
+
+  V& operator[](const K& key) {
+    size_t pos = find_index(key);
+    if (pos != slots.size()) {
+      return slots[pos].value;
+    }
+    // keep the load factor at or below 7/8
+    if ((count + 1) * 8 > slots.size() * 7) {
+      grow();
+    }
+    return slots[insert_new(key, V())].value;
+  }
+
+  bool erase(const K& key) {
+    size_t pos = find_index(key);
+    if (pos == slots.size()) {
+      return false;
+    }
+    // backward shift: pull following displaced entries one step
+    // closer to home instead of leaving a tombstone
+    size_t next = (pos + 1) & mask;
+    while (slots[next].dist > 1) {
+      slots[pos] = slots[next];
+      slots[pos].dist--;
+      pos = next;
+      next = (next + 1) & mask;
+    }
+    slots[pos] = Slot();
+    count--;
+    return true;
+  }
+
+  void clear() {
+    slots.assign(slots.size(), Slot());
+    count = 0;
+  }
+};
+
+#endif  // __TOOLS_FLAT_HASH_MAP_H__
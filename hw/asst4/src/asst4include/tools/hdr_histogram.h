@@ -0,0 +1,127 @@
+#ifndef __TOOLS_HDR_HISTOGRAM_H__
+#define __TOOLS_HDR_HISTOGRAM_H__
+
+#include <stdint.h>
+
+#include <ostream>
+#include <vector>
+
+/*
+ * HdrHistogram --
+ *
+ * High dynamic range histogram of non-negative integer values (the
+ * tracer records microseconds).  Values below 128 get a bucket each;
+ * above that every power of two is split into 64 buckets, so any
+ * value is kept to within 1/64 (about 1.5%) whatever its magnitude,
+ * from microseconds to hours, in a few KB.  Percentiles report the
+ * highest value in the bucket, so they never understate a tail.
+ */
+class HdrHistogram {
+private:
+  static const int LINEAR = 128;
+  static const int SUB_BITS = 6;                  // 64 buckets per octave
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+
+  std::vector<uint64_t> counts;   // grown on demand
+  uint64_t total;
+  uint64_t max_value;
+  double sum;
+
+  static int msb(uint64_t v) {
+    return 63 - __builtin_clzll(v);
+  }
+
+  static size_t index_of(uint64_t v) {
+    if (v < static_cast<uint64_t>(LINEAR)) {
+      return v;
+    }
+    int shift = msb(v) - SUB_BITS;    // v >> shift is in [64, 128)
+    return LINEAR + (shift - 1) * SUB_BUCKETS + ((v >> shift) - SUB_BUCKETS);
+  }
+
+  // largest value that lands in bucket 'index'
+  static uint64_t highest_in(size_t index) {
+    if (index < static_cast<size_t>(LINEAR)) {
+      return index;
+    }
+    size_t i = index - LINEAR;
+    int shift = i / SUB_BUCKETS + 1;
+    uint64_t lead = SUB_BUCKETS + i % SUB_BUCKETS;
+    return ((lead + 1) << shift) - 1;
+  }
+
+public:
+  HdrHistogram() : total(0), max_value(0), sum(0.0) {}
+
+  void record(uint64_t value) {
+    size_t i = index_of(value);
+    if (i >= counts.size()) {
+      counts.resize(i + 1, 0);
+    }
+    counts[i]++;
+    total++;
+    sum += value;
+    if (value > max_value) {
+      max_value = value;
+    }
+  }
+
+  void merge(const HdrHistogram& other) {
+    if (other.counts.size() > counts.size()) {
+      counts.resize(other.counts.size(), 0);
+    }
+    for (size_t i = 0; i < other.counts.size(); ++i) {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sum += other.sum;
+    if (other.max_value > max_value) {
+      max_value = other.max_value;
+    }
+  }
+
+  uint64_t count() const {
+    return total;
+  }
+
+  uint64_t max() const {
+    return max_value;
+  }
+
+  double mean() const {
+    return total == 0 ? 0.0 : sum / total;
+  }
+
+  // The value at or below which 'percent' of the values are.
+  uint64_t percentile(double percent) const {
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(percent / 100.0 * total + 0.5);
+    if (rank < 1) {
+      rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+      seen += counts[i];
+      if (seen >= rank) {
+        uint64_t v = highest_in(i);
+        return v < max_value ? v : max_value;
+      }
+    }
+    return max_value;
+  }
+
+  // "n=... mean=... p50=... p90=... p99=... p99.9=... max=..."
+  void dump(std::ostream& out) const {
+    out << "n=" << total
+        << " mean=" << static_cast<uint64_t>(mean())
+        << " p50=" << percentile(50.0)
+        << " p90=" << percentile(90.0)
+        << " p99=" << percentile(99.0)
+        << " p99.9=" << percentile(99.9)
+        << " max=" << max_value;
+  }
+};
+
+#endif  // __TOOLS_HDR_HISTOGRAM_H__
@@ -0,0 +1,251 @@
+#ifndef __TOOLS_JOB_ARENA_H__
+#define __TOOLS_JOB_ARENA_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+// What an arena is backed by; see JobArenaPool.
+enum ArenaPages {
+  ARENA_SMALL_PAGES,
+  ARENA_TRANSPARENT_HUGE_PAGES,   // madvise(MADV_HUGEPAGE)
+  ARENA_HUGETLB_PAGES,            // reserved 2 MB pages, MAP_HUGETLB
+};
+
+inline const char* arena_pages_name(ArenaPages pages) {
+  switch (pages) {
+  case ARENA_HUGETLB_PAGES:
+    return "hugetlb";
+  case ARENA_TRANSPARENT_HUGE_PAGES:
+    return "thp";
+  default:
+    return "small";
+  }
+}
+
+/*
+ * JobArenaPool --
+ *
+ * Large scratch regions for the memory-heavy jobs, mapped and
+ * pre-faulted once (at worker boot) and then reused, so a job pays no
+ * mmap/munmap and no page faults for its buffers.  A job holds one
+ * arena for its whole run (see ScopedArena), so the pool needs one
+ * arena per job that may run at the same time; when all are taken a
+ * job falls back to malloc.  Free arenas are handed out last in,
+ * first out, so the one most likely still in cache is reused.
+ *
+ * Arenas can be backed by 2 MB pages, so the random hops of the
+ * projectidea job and the stream of the bandwidth job miss the TLB
+ * far less.  Asking for hugetlb pages falls back to transparent huge
+ * pages when none are reserved, and those to small pages where the
+ * kernel has no THP; each arena records what it actually got.
+ */
+class JobArenaPool {
+public:
+  struct Arena {
+    char* base;
+    size_t capacity;
+    size_t mapped;      // for munmap
+    ArenaPages pages;
+  };
+
+  struct Stats {
+    long acquired;
+    long exhausted;   // acquire() found no free arena
+  };
+
+private:
+  size_t arena_bytes;
+  std::vector<Arena*> all;
+  std::vector<Arena*> free_list;
+  pthread_mutex_t lock;
+  std::atomic<long> acquired;
+  std::atomic<long> exhausted;
+
+  JobArenaPool(const JobArenaPool&);
+  JobArenaPool& operator=(const JobArenaPool&);
+
+  static const size_t HUGE_PAGE_BYTES = 2 << 20;
+
+  // Map 'a->capacity' bytes with the best pages up to 'want'.
+  static bool map_arena(Arena* a, ArenaPages want) {
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    size_t rounded = (a->capacity + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1);
+#ifdef MAP_HUGETLB
+    if (want == ARENA_HUGETLB_PAGES) {
+      void* p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+      if (p != MAP_FAILED) {
+        a->base = static_cast<char*>(p);
+        a->mapped = rounded;
+        a->pages = ARENA_HUGETLB_PAGES;
+        return true;
+      }
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    if (want != ARENA_SMALL_PAGES) {
+      // THP only backs 2 MB aligned ranges: over-map, trim to alignment
+      void* p = mmap(NULL, rounded + HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE, flags, -1, 0);
+      if (p == MAP_FAILED) {
+        return false;
+      }
+      char* raw = static_cast<char*>(p);
+      char* base = reinterpret_cast<char*>(
+        (reinterpret_cast<uintptr_t>(raw) + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1));
+      if (base > raw) {
+        munmap(raw, base - raw);
+      }
+      munmap(base + rounded, raw + HUGE_PAGE_BYTES - base);
+      a->base = base;
+      a->mapped = rounded;
+      a->pages = madvise(base, rounded, MADV_HUGEPAGE) == 0 ?
+        ARENA_TRANSPARENT_HUGE_PAGES : ARENA_SMALL_PAGES;
+      return true;
+    }
+#endif
+    void* p = mmap(NULL, a->capacity, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+    a->base = static_cast<char*>(p);
+    a->mapped = a->capacity;
+    a->pages = ARENA_SMALL_PAGES;
+    return true;
+  }
+
+public:
+  JobArenaPool(int count, size_t bytes, ArenaPages pages = ARENA_SMALL_PAGES)
+    : arena_bytes(bytes), acquired(0), exhausted(0) {
+    pthread_mutex_init(&lock, NULL);
+    long page = sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < count; ++i) {
+      Arena* a = new Arena;
+      a->capacity = bytes;
+      if (!map_arena(a, pages)) {
+        delete a;
+        break;
+      }
+      // fault every page in now rather than in the first job
+      for (size_t off = 0; off < bytes; off += page) {
+        a->base[off] = 0;
+      }
+      all.push_back(a);
+      free_list.push_back(a);
+    }
+  }
+
+  ~JobArenaPool() {
+    for (size_t i = 0; i < all.size(); ++i) {
+      munmap(all[i]->base, all[i]->mapped);
+      delete all[i];
+    }
+  }
+
+  // A free arena, or NULL if all are in use.
+  Arena* acquire() {
+    Arena* a = NULL;
+    pthread_mutex_lock(&lock);
+    if (!free_list.empty()) {
+      a = free_list.back();
+      free_list.pop_back();
+    }
+    pthread_mutex_unlock(&lock);
+    if (a != NULL) {
+      acquired.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      exhausted.fetch_add(1, std::memory_order_relaxed);
+    }
+    return a;
+  }
+
+  void release(Arena* a) {
+    pthread_mutex_lock(&lock);
+    free_list.push_back(a);
+    pthread_mutex_unlock(&lock);
+  }
+
+  int arena_count() const {
+    return all.size();
+  }
+
+  size_t bytes_per_arena() const {
+    return arena_bytes;
+  }
+
+  // Arenas that got 'pages'.
+  int arenas_with(ArenaPages pages) const {
+    int n = 0;
+    for (size_t i = 0; i < all.size(); ++i) {
+      n += all[i]->pages == pages;
+    }
+    return n;
+  }
+
+  Stats get_stats() const {
+    Stats s;
+    s.acquired = acquired.load();
+    s.exhausted = exhausted.load();
+    return s;
+  }
+};
+
+/*
+ * ScopedArena --
+ *
+ * One job's allocations: bump-allocated from an arena of 'pool' held
+ * until the ScopedArena goes out of scope, or from malloc when there
+ * is no pool, no free arena, or the arena is full.  Memory is not
+ * zeroed; everything is released together at the end of the scope.
+ */
+class ScopedArena {
+private:
+  static const size_t ALIGN = 64;
+
+  JobArenaPool* pool;
+  JobArenaPool::Arena* arena;
+  size_t used;
+  std::vector<void*> fallback;
+
+  ScopedArena(const ScopedArena&);
+  ScopedArena& operator=(const ScopedArena&);
+
+public:
+  explicit ScopedArena(JobArenaPool* p)
+    : pool(p), arena(p != NULL ? p->acquire() : NULL), used(0) {}
+
+  ~ScopedArena() {
+    if (arena != NULL) {
+      pool->release(arena);
+    }
+    for (size_t i = 0; i < fallback.size(); ++i) {
+      free(fallback[i]);
+    }
+  }
+
+  template <class T>
+  T* alloc(size_t count) {
+    size_t bytes = (count * sizeof(T) + ALIGN - 1) & ~(ALIGN - 1);
+    if (arena != NULL && used + bytes <= arena->capacity) {
+      T* p = reinterpret_cast<T*>(arena->base + used);
+      used += bytes;
+      return p;
+    }
+    void* p = malloc(bytes);
+    if (p != NULL) {
+      fallback.push_back(p);
+    }
+    return static_cast<T*>(p);
+  }
+
+  bool from_arena() const {
+    return arena != NULL;
+  }
+};
+
+#endif  // __TOOLS_JOB_ARENA_H__
@@ -0,0 +1,212 @@
+#ifndef __WORKER_MPMC_QUEUE_H__
+#define __WORKER_MPMC_QUEUE_H__
+
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+#define MPMC_CACHE_LINE 64
+
+// Number of times a thread retries an empty (or full) queue before
+// parking itself on the futex.
+#define MPMC_SPIN_COUNT 128
+
+/*
+ * EventCount --
+ *
+ * A tiny futex-based parking lot.  A waiter reads the current epoch
+ * with prepare_wait(), re-checks its condition, and only then sleeps
+ * in wait().  Any notify() issued after prepare_wait() bumps the
+ * epoch, so the futex call returns immediately instead of missing
+ * the wakeup.
+ */
+class EventCount {
+private:
+  std::atomic<int> epoch;
+  std::atomic<int> waiters;
+
+  static long futex(std::atomic<int>* addr, int op, int val) {
+    return syscall(SYS_futex, reinterpret_cast<int*>(addr),
+                   op, val, NULL, NULL, 0);
+  }
+
+public:
+  EventCount() : epoch(0), waiters(0) {}
+
+  int prepare_wait() {
+    waiters.fetch_add(1);
+    return epoch.load();
+  }
+
+  void cancel_wait() {
+    waiters.fetch_sub(1);
+  }
+
+  void wait(int key) {
+    futex(&epoch, FUTEX_WAIT_PRIVATE, key);
+    waiters.fetch_sub(1);
+  }
+
+  void notify_one() {
+    // pairs with the fetch_add in prepare_wait(): either the waiter
+    // sees the new item, or we see the waiter
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed) > 0) {
+      epoch.fetch_add(1);
+      futex(&epoch, FUTEX_WAKE_PRIVATE, 1);
+    }
+  }
+};
+
+/*
+ * MPMCWorkQueue --
+ *
+ * Bounded lock-free multi-producer/multi-consumer ring queue (each
+ * cell carries a sequence number that tells producers and consumers
+ * whose turn it is, so a push or pop is a single CAS on the
+ * enqueue/dequeue cursor).  Idle consumers spin briefly and then park
+ * on a futex, as do producers when the ring is full.
+ *
+ * Drop-in replacement for WorkQueue: get_work() blocks until an item
+ * is available, put_work() blocks only while the ring is full.
+ * Capacity is rounded up to a power of two.
+ */
+template <class T>
+class MPMCWorkQueue {
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  std::vector<Cell> buffer;
+  size_t mask;
+
+  char pad0[MPMC_CACHE_LINE];
+  std::atomic<size_t> enqueue_pos;
+  char pad1[MPMC_CACHE_LINE];
+  std::atomic<size_t> dequeue_pos;
+  char pad2[MPMC_CACHE_LINE];
+
+  EventCount not_empty;
+  EventCount not_full;
+
+  MPMCWorkQueue(const MPMCWorkQueue&);
+  MPMCWorkQueue& operator=(const MPMCWorkQueue&);
+
+  static size_t round_up_pow2(size_t n) {
+    size_t size = 2;
+    while (size < n) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+public:
+
+  explicit MPMCWorkQueue(size_t capacity = 4096)
+    : buffer(round_up_pow2(capacity)) {
+    size_t size = buffer.size();
+    mask = size - 1;
+    for (size_t i = 0; i < size; ++i) {
+      buffer[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    enqueue_pos.store(0, std::memory_order_relaxed);
+    dequeue_pos.store(0, std::memory_order_relaxed);
+  }
+
+  bool try_put_work(const T& item) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &buffer[pos & mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;  // full
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = item;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    not_empty.notify_one();
+    return true;
+  }
+
+  bool try_get_work(T& item) {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &buffer[pos & mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;  // empty
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    item = cell->data;
+    cell->data = T();  // drop references held by the stale copy
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    not_full.notify_one();
+    return true;
+  }
+
+  T get_work() {
+    T item;
+    while (true) {
+      for (int i = 0; i < MPMC_SPIN_COUNT; ++i) {
+        if (try_get_work(item)) {
+          return item;
+        }
+      }
+      int key = not_empty.prepare_wait();
+      if (try_get_work(item)) {
+        not_empty.cancel_wait();
+        return item;
+      }
+      not_empty.wait(key);
+    }
+  }
+
+  void put_work(const T& item) {
+    while (true) {
+      for (int i = 0; i < MPMC_SPIN_COUNT; ++i) {
+        if (try_put_work(item)) {
+          return;
+        }
+      }
+      int key = not_full.prepare_wait();
+      if (try_put_work(item)) {
+        not_full.cancel_wait();
+        return;
+      }
+      not_full.wait(key);
+    }
+  }
+
+  // Approximate number of queued items (racy by nature).
+  size_t size() const {
+    size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+    size_t head = dequeue_pos.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+  }
+};
+
+#endif  // __WORKER_MPMC_QUEUE_H__
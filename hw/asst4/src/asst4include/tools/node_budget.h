@@ -0,0 +1,85 @@
+#ifndef __TOOLS_NODE_BUDGET_H__
+#define __TOOLS_NODE_BUDGET_H__
+
+#include <string>
+
+// Budgets of one worker node (2 x Xeon E5-2620 v3).  Threads are the
+// caller's slot count; the other two are shared hardware:
+//
+//  - memory bandwidth, in streaming jobs: high_bandwidth_job scans a
+//    64 MB buffer, and a couple of them saturate the memory system
+//  - last level cache, in MB: cachefootprint_job needs ~14 MB of the
+//    15 MB LLC, and a streaming scan evicts a few MB of it as it goes
+//
+// Threads are not pinned to a socket, so the cache is budgeted as one
+// socket's worth.
+const int NODE_BANDWIDTH_UNITS = 2;
+const int NODE_LLC_MB = 15;
+
+// Hardware threads: 2 sockets x 6 cores x 2-way hyperthreading.
+const int NODE_HW_THREADS = 24;
+
+// What streaming sustains of the node's 119 GB/s peak (2 sockets x 4
+// channels of DDR4-1866), in MB/s, for comparing with the bandwidth
+// workers measure and report.
+const int NODE_MEMORY_BANDWIDTH_MBPS = 95000;
+
+struct ResourceDemand {
+  int threads;
+  int bandwidth;
+  int llc_mb;
+};
+
+inline ResourceDemand resource_demand(const std::string& cmd) {
+  ResourceDemand d;
+  d.threads = 1;
+  d.bandwidth = 0;
+  d.llc_mb = 0;
+  if (cmd == "bandwidth") {
+    d.bandwidth = 1;
+    d.llc_mb = 4;
+  } else if (cmd == "projectidea") {
+    d.llc_mb = 14;
+  }
+  return d;
+}
+
+/*
+ * NodeUsage --
+ *
+ * What the jobs running on a node hold of each budget.  A job is only
+ * admitted if all of its demands fit next to them, so streaming jobs
+ * are never co-scheduled with a projectidea whose working set they
+ * would flush.
+ */
+struct NodeUsage {
+  int threads;
+  int bandwidth;
+  int llc_mb;
+
+  NodeUsage() : threads(0), bandwidth(0), llc_mb(0) {}
+
+  bool admits(const ResourceDemand& d, int thread_budget) const {
+    return threads + d.threads <= thread_budget &&
+           bandwidth + d.bandwidth <= NODE_BANDWIDTH_UNITS &&
+           llc_mb + d.llc_mb <= NODE_LLC_MB;
+  }
+
+  void acquire(const ResourceDemand& d) {
+    threads += d.threads;
+    bandwidth += d.bandwidth;
+    llc_mb += d.llc_mb;
+  }
+
+  void release(const ResourceDemand& d) {
+    threads -= d.threads;
+    bandwidth -= d.bandwidth;
+    llc_mb -= d.llc_mb;
+  }
+
+  bool empty() const {
+    return threads == 0 && bandwidth == 0 && llc_mb == 0;
+  }
+};
+
+#endif  // __TOOLS_NODE_BUDGET_H__
@@ -0,0 +1,78 @@
+#ifndef __TOOLS_NODE_MODEL_H__
+#define __TOOLS_NODE_MODEL_H__
+
+#include <math.h>
+
+#include <algorithm>
+#include <string>
+
+#include "tools/node_budget.h"
+
+// Model of a worker node for the offline tools (admission_replay,
+// cluster_sim): every job runs at once, and makes progress at a rate
+// that drops when more jobs than hardware threads share the node,
+// when streaming jobs exceed the bandwidth budget, or, for
+// projectidea, when the LLC is oversubscribed.
+
+// how fast a projectidea runs with its working set evicted
+const double LLC_THRASH_RATE = 0.25;
+
+/*
+ * @brief Service time of a request (ms) on an idle node: the master's
+ * cost priors, with countprimes scaled by n
+ */
+inline double node_service_ms(const std::string& cmd, double n) {
+  if (cmd == "418wisdom") {
+    return 700.0;
+  } else if (cmd == "countprimes") {
+    return std::max(1.0, 700.0 * pow(n / 1e6, 1.5));
+  } else if (cmd == "bandwidth") {
+    return 300.0;
+  } else if (cmd == "projectidea") {
+    return 400.0;
+  }
+  return 1.0;
+}
+
+/*
+ * @brief Progress a job of type 'cmd' makes per ms of wall time on a
+ * node running 'jobs' jobs that together hold 'usage'
+ */
+inline double node_job_rate(int jobs, const NodeUsage& usage, const std::string& cmd,
+                            const ResourceDemand& demand) {
+  double r = 1.0;
+  if (jobs > NODE_HW_THREADS) {
+    r *= static_cast<double>(NODE_HW_THREADS) / jobs;
+  }
+  if (demand.bandwidth > 0 && usage.bandwidth > NODE_BANDWIDTH_UNITS) {
+    r *= static_cast<double>(NODE_BANDWIDTH_UNITS) / usage.bandwidth;
+  }
+  if (cmd == "projectidea" && usage.llc_mb > NODE_LLC_MB) {
+    r *= LLC_THRASH_RATE;
+  }
+  return r;
+}
+
+/*
+ * @brief Field 'name' of one line of a trace in tests/ (a flat JSON
+ * object), without quotes; "" if it is missing
+ */
+inline std::string trace_json_field(const std::string& line, const char* name) {
+  std::string key = std::string("\"") + name + "\":";
+  size_t pos = line.find(key);
+  if (pos == std::string::npos) {
+    return "";
+  }
+  pos += key.size();
+  while (pos < line.size() && line[pos] == ' ') {
+    pos++;
+  }
+  if (pos < line.size() && line[pos] == '"') {
+    size_t end = line.find('"', pos + 1);
+    return line.substr(pos + 1, end - pos - 1);
+  }
+  size_t end = line.find_first_of(",}", pos);
+  return line.substr(pos, end - pos);
+}
+
+#endif  // __TOOLS_NODE_MODEL_H__
@@ -0,0 +1,180 @@
+#ifndef __TOOLS_PRIME_SIEVE_H__
+#define __TOOLS_PRIME_SIEVE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+/*
+ * count_odd_primes --
+ *
+ * Odd primes in [lo, hi), by the same trial division as
+ * count_primes_job (one pass instead of its ten), so ranges can be
+ * counted on different threads and summed.
+ */
+inline long count_odd_primes(int lo, int hi) {
+  long count = 0;
+  int start = lo < 3 ? 3 : (lo | 1);
+  for (int i = start; i < hi; i += 2) {
+    int div1 = 1;
+    int div2;
+    int rem;
+    do {
+      div1 += 2;
+      div2 = i / div1;
+      rem = i % div1;
+    } while (rem != 0 && div1 <= div2);
+    if (rem != 0 || div1 == i) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/*
+ * PrimeCountTable --
+ *
+ * Prime counts for countprimes without trial division.  Odd numbers
+ * are sieved (segmented Eratosthenes) one segment at a time; a
+ * segment's bitmap is 32 KB, so each pass over it stays in L1/L2.
+ * Next to every 64-bit word of the bitmap the table keeps the number
+ * of odd primes before it, so a count is one lookup plus a popcount.
+ *
+ * The table only grows, a segment at a time and under a lock, when a
+ * query asks beyond what is covered.  Finished segments are never
+ * written again and are published with a release store of 'covered',
+ * so queries inside the covered range take no lock.
+ *
+ * count_primes(n) matches count_primes_job in work_engine.cpp exactly:
+ * 2 counts for n >= 2, odd primes count when they are below n.
+ */
+class PrimeCountTable {
+private:
+  static const int SEGMENT_WORDS = 4096;
+  static const int64_t SEGMENT_ODDS = SEGMENT_WORDS * 64;
+
+  // bit k of segment i is the odd number 2 * (i * SEGMENT_ODDS + k) + 1
+  struct Segment {
+    uint64_t bits[SEGMENT_WORDS];
+    uint32_t before[SEGMENT_WORDS];   // odd primes below this word
+  };
+
+  int64_t max_n;
+  std::vector<Segment*> segments;     // sized up front, see above
+  std::vector<uint32_t> base_primes;  // odd primes up to sqrt(max_n)
+  std::atomic<int64_t> covered;       // odd numbers sieved
+  uint32_t primes_so_far;             // odd primes in covered range
+  pthread_mutex_t grow_lock;
+
+  void sieve_segment(int64_t index) {
+    Segment* s = new Segment;
+    int64_t first_odd = index * SEGMENT_ODDS;
+    int64_t lo = 2 * first_odd + 1;                 // first number
+    int64_t hi = 2 * (first_odd + SEGMENT_ODDS);    // past the last
+
+    for (int w = 0; w < SEGMENT_WORDS; ++w) {
+      s->bits[w] = ~0ULL;
+    }
+    if (index == 0) {
+      s->bits[0] &= ~1ULL;   // 1 is not prime
+    }
+    for (size_t i = 0; i < base_primes.size(); ++i) {
+      int64_t p = base_primes[i];
+      if (p * p >= hi) {
+        break;
+      }
+      int64_t m = p * p;
+      if (m < lo) {
+        // first odd multiple of p at or after lo
+        m = (lo + p - 1) / p * p;
+        if (m % 2 == 0) {
+          m += p;
+        }
+      }
+      for (; m < hi; m += 2 * p) {
+        int64_t k = (m - 1) / 2 - first_odd;
+        s->bits[k >> 6] &= ~(1ULL << (k & 63));
+      }
+    }
+
+    for (int w = 0; w < SEGMENT_WORDS; ++w) {
+      s->before[w] = primes_so_far;
+      primes_so_far += __builtin_popcountll(s->bits[w]);
+    }
+    segments[index] = s;
+  }
+
+  void grow_to(int64_t odds) {
+    pthread_mutex_lock(&grow_lock);
+    int64_t have = covered.load(std::memory_order_relaxed);
+    while (have < odds) {
+      sieve_segment(have / SEGMENT_ODDS);
+      have += SEGMENT_ODDS;
+      covered.store(have, std::memory_order_release);
+    }
+    pthread_mutex_unlock(&grow_lock);
+  }
+
+public:
+  // Queries above 'limit' are not answered (see count_primes()).
+  explicit PrimeCountTable(int64_t limit)
+    : max_n(limit), covered(0), primes_so_far(0) {
+    pthread_mutex_init(&grow_lock, NULL);
+    segments.assign(limit / 2 / SEGMENT_ODDS + 1, NULL);
+
+    // odd primes up to sqrt(limit), by a plain sieve
+    int64_t root = 1;
+    while (root * root <= limit) {
+      root++;
+    }
+    std::vector<bool> composite(root + 1, false);
+    for (int64_t i = 3; i <= root; i += 2) {
+      if (!composite[i]) {
+        base_primes.push_back(i);
+        for (int64_t j = i * i; j <= root; j += 2 * i) {
+          composite[j] = true;
+        }
+      }
+    }
+  }
+
+  ~PrimeCountTable() {
+    for (size_t i = 0; i < segments.size(); ++i) {
+      delete segments[i];
+    }
+  }
+
+  int64_t limit() const {
+    return max_n;
+  }
+
+  /*
+   * count_primes --
+   *
+   * The countprimes response for 'n', or -1 if n is above limit().
+   */
+  long count_primes(int64_t n) {
+    if (n > max_n) {
+      return -1;
+    }
+    if (n < 2) {
+      return 0;
+    }
+    int64_t odds = n / 2;   // odd numbers below n
+    if (covered.load(std::memory_order_acquire) < odds) {
+      grow_to(odds);
+    }
+    // odd primes among the first 'odds' odd numbers
+    int64_t last = odds - 1;
+    const Segment* s = segments[last / SEGMENT_ODDS];
+    int64_t k = last % SEGMENT_ODDS;
+    uint64_t word = s->bits[k >> 6];
+    int bit = k & 63;
+    uint64_t mask = bit == 63 ? ~0ULL : (2ULL << bit) - 1;
+    return 1 + s->before[k >> 6] + __builtin_popcountll(word & mask);
+  }
+};
+
+#endif  // __TOOLS_PRIME_SIEVE_H__
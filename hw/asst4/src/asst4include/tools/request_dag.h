@@ -0,0 +1,187 @@
+#ifndef __TOOLS_REQUEST_DAG_H__
+#define __TOOLS_REQUEST_DAG_H__
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "tools/flat_hash_map.h"
+
+// Builds a composite request's response from its parts' responses,
+// in the order the parts were declared.
+typedef std::string (*dag_combine_t)(const std::vector<std::string>& results);
+
+struct DagCompletion {
+  int tag;                // the composite request
+  std::string response;
+};
+
+/*
+ * RequestDag --
+ *
+ * Composite requests (parents) that depend on the results of simple
+ * sub-requests (nodes).  A node is keyed by its request string, so
+ * two parents that need the same sub-result while it is in flight
+ * share one node and the work is done once.  A parent completes --
+ * resolve() or fill() hand back its combined response -- when its
+ * last dependency arrives, whatever order they arrive in and whether
+ * or not they needed a worker at all.
+ *
+ * The caller declares a parent, then each dependency either as a
+ * result it already has (fill(), e.g. a cache hit) or as a key to
+ * wait on (depend(), which says whether the key still has to be sent
+ * to a worker; if so, issued() records the tag it went out with).
+ */
+class RequestDag {
+public:
+  struct Stats {
+    long parents;
+    long dependencies;  // waited on, i.e. not filled from the cache
+    long shared;      // waited on a node another parent had issued
+    long issued;
+  };
+
+private:
+  struct Waiter {
+    int parent;
+    int slot;
+  };
+
+  struct Node {
+    int tag;          // -1 until issued
+    std::vector<Waiter> waiters;
+  };
+
+  struct Parent {
+    dag_combine_t combine;
+    std::vector<std::string> results;
+    int remaining;
+  };
+
+  FlatHashMap<std::string, Node> nodes;      // in flight
+  FlatHashMap<int, std::string> node_keys;   // issued tag -> key
+  FlatHashMap<int, Parent> parents;
+  Stats stats;
+
+public:
+  RequestDag() {
+    stats.parents = 0;
+    stats.dependencies = 0;
+    stats.shared = 0;
+    stats.issued = 0;
+  }
+
+  void add_parent(int tag, int num_deps, dag_combine_t combine) {
+    Parent& p = parents[tag];
+    p.combine = combine;
+    p.results.assign(num_deps, std::string());
+    p.remaining = num_deps;
+    stats.parents++;
+  }
+
+  /*
+   * depend --
+   *
+   * Dependency 'slot' of 'parent' is the result of 'key'.  Returns
+   * true if nothing is computing 'key' yet, in which case the caller
+   * must send it and call issued().
+   */
+  bool depend(int parent, int slot, const std::string& key) {
+    Waiter w;
+    w.parent = parent;
+    w.slot = slot;
+    stats.dependencies++;
+    Node* node = nodes.find(key);
+    if (node != NULL) {
+      node->waiters.push_back(w);
+      stats.shared++;
+      return false;
+    }
+    Node& fresh = nodes[key];
+    fresh.tag = -1;
+    fresh.waiters.push_back(w);
+    return true;
+  }
+
+  void issued(const std::string& key, int tag) {
+    Node* node = nodes.find(key);
+    if (node != NULL) {
+      node->tag = tag;
+      node_keys[tag] = key;
+      stats.issued++;
+    }
+  }
+
+  // Dependency 'slot' of 'parent' is already known.
+  void fill(int parent, int slot, const std::string& result,
+            std::vector<DagCompletion>* done) {
+    Parent* p = parents.find(parent);
+    if (p == NULL) {
+      return;
+    }
+    p->results[slot] = result;
+    if (--p->remaining == 0) {
+      DagCompletion c;
+      c.tag = parent;
+      c.response = p->combine(p->results);
+      parents.erase(parent);
+      done->push_back(c);
+    }
+  }
+
+  // Whether 'tag' is a sub-request issued through the DAG.
+  bool owns(int tag) const {
+    return node_keys.contains(tag);
+  }
+
+  // A parent waiting on the sub-request 'tag', or -1.
+  int parent_of(int tag) const {
+    const std::string* key = node_keys.find(tag);
+    if (key == NULL) {
+      return -1;
+    }
+    const Node* node = nodes.find(*key);
+    if (node == NULL || node->waiters.empty()) {
+      return -1;
+    }
+    return node->waiters[0].parent;
+  }
+
+  /*
+   * resolve --
+   *
+   * The sub-request 'tag' finished with 'result': fill it into every
+   * parent waiting on it and append the parents that are now complete
+   * to 'done'.
+   */
+  void resolve(int tag, const std::string& result, std::vector<DagCompletion>* done) {
+    std::string* key = node_keys.find(tag);
+    if (key == NULL) {
+      return;
+    }
+    std::vector<Waiter> waiters;
+    Node* node = nodes.find(*key);
+    if (node != NULL) {
+      waiters.swap(node->waiters);
+      nodes.erase(*key);
+    }
+    node_keys.erase(tag);
+    for (size_t i = 0; i < waiters.size(); ++i) {
+      fill(waiters[i].parent, waiters[i].slot, result, done);
+    }
+  }
+
+  const Stats& get_stats() const {
+    return stats;
+  }
+
+  void dump_stats(std::ostream& out) const {
+    out << "request dag: parents=" << stats.parents
+        << " dependencies=" << stats.dependencies
+        << " shared=" << stats.shared
+        << " issued=" << stats.issued
+        << " in_flight=" << nodes.size();
+  }
+};
+
+#endif  // __TOOLS_REQUEST_DAG_H__
@@ -0,0 +1,379 @@
+#ifndef __TOOLS_REQUEST_TRACE_H__
+#define __TOOLS_REQUEST_TRACE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "tools/flat_hash_map.h"
+#include "tools/hdr_histogram.h"
+
+// Points in a request's life, in the order it passes them.  The
+// master sees the first five, a worker the rest.
+enum TraceStage {
+  TRACE_ARRIVAL,          // the harness read it from the client
+  TRACE_ENQUEUE,          // the master tagged and queued it
+  TRACE_DISPATCH,         // sent to a worker
+  TRACE_WORKER_RESPONSE,  // the worker's response is back
+  TRACE_DONE,             // answered; the master forgets the tag
+  TRACE_RECEIVED,         // the worker read it from the master
+  TRACE_DEQUEUED,         // a worker thread took it
+  TRACE_EXEC_START,
+  TRACE_EXEC_END,
+  TRACE_SENT,             // the response went to the master
+  NUM_TRACE_STAGES
+};
+
+// The trace clock (CLOCK_MONOTONIC, ns).
+inline uint64_t trace_now_ns() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return static_cast<uint64_t>(t.tv_sec) * 1000000000ULL + t.tv_nsec;
+}
+
+struct TraceEvent {
+  uint64_t ns;
+  int32_t tag;
+  uint8_t stage;
+  char cmd[19];   // truncated
+};
+
+/*
+ * TraceRing --
+ *
+ * Single-producer single-consumer ring of trace events: the owning
+ * thread pushes without locks or syscalls, the collector pops.  When
+ * the collector falls behind, new events are dropped (and counted)
+ * rather than blocking the traced thread.
+ */
+class TraceRing {
+private:
+  static const uint64_t SIZE = 4096;
+
+  TraceEvent slots[SIZE];
+  std::atomic<uint64_t> head;   // next push, written by the owner
+  std::atomic<uint64_t> tail;   // next pop, written by the collector
+  std::atomic<uint64_t> dropped;
+
+public:
+  int index;   // trace "thread id"
+
+  TraceRing() : head(0), tail(0), dropped(0), index(0) {}
+
+  void push(const TraceEvent& e) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= SIZE) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    slots[h % SIZE] = e;
+    head.store(h + 1, std::memory_order_release);
+  }
+
+  bool pop(TraceEvent* e) {
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *e = slots[t % SIZE];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  uint64_t dropped_events() const {
+    return dropped.load();
+  }
+};
+
+/*
+ * RequestTracer --
+ *
+ * Per-request tracing for one process.  record() stamps a stage of a
+ * request (by tag) into the calling thread's TraceRing.  collect(),
+ * from any one thread at a time, drains the rings and pieces the
+ * stages of each tag together; when a request reaches its last stage
+ * here (TRACE_DONE on the master, TRACE_SENT on a worker) the time
+ * between stages goes into HDR histograms per command, and the
+ * request is written to a Chrome trace (chrome://tracing, Perfetto).
+ *
+ * Timestamps are CLOCK_MONOTONIC, so the traces of a master and
+ * workers on one host line up; the trace files use the JSON array
+ * format without the closing bracket, which the viewers accept, so
+ * they can be appended to while the process runs and concatenated
+ * afterwards.  The master and worker share tags, so a request can be
+ * followed across them.
+ *
+ * Threads find their ring through a thread_local, so a process has at
+ * most one tracer.
+ */
+class RequestTracer {
+public:
+  struct Interval {
+    TraceStage from;
+    TraceStage to;
+    const char* name;
+    bool whole;   // the whole request, named by its command in traces
+  };
+
+private:
+  struct Span {
+    uint64_t at[NUM_TRACE_STAGES];   // 0 = not seen
+    int16_t thread[NUM_TRACE_STAGES];
+    char cmd[sizeof(TraceEvent::cmd)];
+  };
+
+  // Requests not finished after this many are dropped, so tags that
+  // never finish here cannot grow the table without bound.
+  static const size_t MAX_OPEN_SPANS = 1 << 16;
+
+  std::string process;
+  FILE* trace_file;
+  int pid;
+
+  pthread_mutex_t rings_lock;
+  std::vector<TraceRing*> rings;
+
+  pthread_mutex_t collect_lock;
+  FlatHashMap<int, Span> open;
+  std::vector<int> finishing;   // reached their last stage
+  std::map<std::string, std::vector<HdrHistogram> > histograms;
+  long finished;
+  long abandoned;
+
+  RequestTracer(const RequestTracer&);
+  RequestTracer& operator=(const RequestTracer&);
+
+  // what goes into the histograms
+  static const Interval* intervals(size_t* count) {
+    static const Interval list[] = {
+      { TRACE_ARRIVAL, TRACE_ENQUEUE, "admit", false },
+      { TRACE_ENQUEUE, TRACE_DISPATCH, "queued", false },
+      { TRACE_DISPATCH, TRACE_WORKER_RESPONSE, "on worker", false },
+      { TRACE_WORKER_RESPONSE, TRACE_DONE, "reply", false },
+      { TRACE_ARRIVAL, TRACE_DONE, "total", true },
+      { TRACE_RECEIVED, TRACE_DEQUEUED, "worker queue", false },
+      { TRACE_EXEC_START, TRACE_EXEC_END, "exec", false },
+      { TRACE_EXEC_END, TRACE_SENT, "send", false },
+      { TRACE_RECEIVED, TRACE_SENT, "worker total", true },
+    };
+    *count = sizeof(list) / sizeof(list[0]);
+    return list;
+  }
+
+  TraceRing* my_ring() {
+    static thread_local TraceRing* ring = NULL;
+    if (ring == NULL) {
+      ring = new TraceRing;
+      pthread_mutex_lock(&rings_lock);
+      ring->index = rings.size();
+      rings.push_back(ring);
+      pthread_mutex_unlock(&rings_lock);
+    }
+    return ring;
+  }
+
+  void write_async(const char* phase, const char* name, const Span& s, int tag,
+                   uint64_t ns) {
+    fprintf(trace_file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"id\":%d,"
+            "\"pid\":%d,\"tid\":0,\"ts\":%.3f,\"args\":{\"tag\":%d}},\n",
+            name, s.cmd, phase, tag, pid, ns / 1000.0, tag);
+  }
+
+  void write_span(const Span& s, int tag) {
+    if (trace_file == NULL) {
+      return;
+    }
+    // the whole request and its waits as async slices on one track
+    // per request; execution as a slice on the thread that ran it
+    size_t count;
+    const Interval* all = intervals(&count);
+    for (size_t i = 0; i < count; ++i) {
+      const Interval& in = all[i];
+      if (in.to == TRACE_EXEC_END || s.at[in.from] == 0 || s.at[in.to] == 0) {
+        continue;
+      }
+      const char* name = in.whole ? s.cmd : in.name;
+      write_async("b", name, s, tag, s.at[in.from]);
+      write_async("e", name, s, tag, s.at[in.to]);
+    }
+    if (s.at[TRACE_EXEC_START] != 0 && s.at[TRACE_EXEC_END] != 0) {
+      fprintf(trace_file, "{\"name\":\"%s\",\"cat\":\"exec\",\"ph\":\"X\",\"pid\":%d,"
+              "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"tag\":%d}},\n",
+              s.cmd, pid, s.thread[TRACE_EXEC_START], s.at[TRACE_EXEC_START] / 1000.0,
+              (s.at[TRACE_EXEC_END] - s.at[TRACE_EXEC_START]) / 1000.0, tag);
+    }
+  }
+
+  void finish(const Span& s, int tag) {
+    size_t count;
+    const Interval* all = intervals(&count);
+    std::vector<HdrHistogram>& h = histograms[s.cmd];
+    h.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      if (s.at[all[i].from] != 0 && s.at[all[i].to] >= s.at[all[i].from]) {
+        h[i].record((s.at[all[i].to] - s.at[all[i].from]) / 1000);
+      }
+    }
+    write_span(s, tag);
+    finished++;
+  }
+
+  void apply(const TraceEvent& e, int thread) {
+    Span* s = open.find(e.tag);
+    if (s == NULL) {
+      if (open.size() >= MAX_OPEN_SPANS) {
+        abandoned++;
+        return;
+      }
+      s = &open[e.tag];
+      memset(s, 0, sizeof(*s));
+    }
+    if (s->at[e.stage] == 0) {
+      s->at[e.stage] = e.ns;
+      s->thread[e.stage] = thread;
+    }
+    if (s->cmd[0] == '\0') {
+      memcpy(s->cmd, e.cmd, sizeof(s->cmd));
+    }
+    if (e.stage == TRACE_DONE || e.stage == TRACE_SENT) {
+      finishing.push_back(e.tag);
+    }
+  }
+
+  /*
+   * A request's stages may be in several threads' rings, and a ring
+   * drained early in a pass can miss a stage that a ring drained
+   * later already follows.  So a request that reached its last stage
+   * is only finished after the next pass, by which time everything
+   * before that stage is visible.
+   */
+  void drain() {
+    std::vector<int> ready;
+    ready.swap(finishing);
+
+    pthread_mutex_lock(&rings_lock);
+    std::vector<TraceRing*> snapshot(rings);
+    pthread_mutex_unlock(&rings_lock);
+    TraceEvent e;
+    for (size_t i = 0; i < snapshot.size(); ++i) {
+      while (snapshot[i]->pop(&e)) {
+        apply(e, snapshot[i]->index);
+      }
+    }
+
+    for (size_t i = 0; i < ready.size(); ++i) {
+      Span* s = open.find(ready[i]);
+      if (s != NULL) {
+        Span done = *s;
+        open.erase(ready[i]);
+        finish(done, ready[i]);
+      }
+    }
+    if (trace_file != NULL) {
+      fflush(trace_file);
+    }
+  }
+
+public:
+  /*
+   * 'process' names the process in the trace; 'trace_path' is the
+   * Chrome trace file to write, or empty for histograms only.
+   */
+  RequestTracer(const std::string& process_name, const std::string& trace_path)
+    : process(process_name), trace_file(NULL), pid(getpid()), finished(0), abandoned(0) {
+    pthread_mutex_init(&rings_lock, NULL);
+    pthread_mutex_init(&collect_lock, NULL);
+    if (!trace_path.empty()) {
+      trace_file = fopen(trace_path.c_str(), "w");
+    }
+    if (trace_file != NULL) {
+      fprintf(trace_file, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+              "\"args\":{\"name\":\"%s\"}},\n", pid, process.c_str());
+    }
+  }
+
+  ~RequestTracer() {
+    if (trace_file != NULL) {
+      fclose(trace_file);
+    }
+    for (size_t i = 0; i < rings.size(); ++i) {
+      delete rings[i];
+    }
+  }
+
+  bool writing_trace() const {
+    return trace_file != NULL;
+  }
+
+  void record_at(TraceStage stage, int tag, const std::string& cmd, uint64_t ns) {
+    TraceEvent e;
+    e.ns = ns;
+    e.tag = tag;
+    e.stage = stage;
+    size_t len = cmd.size() < sizeof(e.cmd) - 1 ? cmd.size() : sizeof(e.cmd) - 1;
+    memcpy(e.cmd, cmd.data(), len);
+    e.cmd[len] = '\0';
+    my_ring()->push(e);
+  }
+
+  // The command only needs to be given with one stage of a request.
+  void record(TraceStage stage, int tag, const std::string& cmd = std::string()) {
+    record_at(stage, tag, cmd, trace_now_ns());
+  }
+
+  /*
+   * collect --
+   *
+   * Drain every thread's ring (see drain()).  Returns false without
+   * waiting if another thread is collecting.
+   */
+  bool collect() {
+    if (pthread_mutex_trylock(&collect_lock) != 0) {
+      return false;
+    }
+    drain();
+    pthread_mutex_unlock(&collect_lock);
+    return true;
+  }
+
+  // Histograms per command, in microseconds, of everything recorded
+  // so far.
+  void dump_histograms(std::ostream& out) {
+    pthread_mutex_lock(&collect_lock);
+    drain();
+    drain();
+    uint64_t dropped = 0;
+    pthread_mutex_lock(&rings_lock);
+    for (size_t i = 0; i < rings.size(); ++i) {
+      dropped += rings[i]->dropped_events();
+    }
+    pthread_mutex_unlock(&rings_lock);
+    out << "request trace (" << process << ", us): finished=" << finished
+        << " open=" << open.size() << " abandoned=" << abandoned
+        << " dropped_events=" << dropped;
+    size_t count;
+    const Interval* all = intervals(&count);
+    for (std::map<std::string, std::vector<HdrHistogram> >::const_iterator it =
+           histograms.begin(); it != histograms.end(); ++it) {
+      for (size_t i = 0; i < it->second.size(); ++i) {
+        if (it->second[i].count() == 0) {
+          continue;
+        }
+        out << "\n  " << it->first << " " << all[i].name << ": ";
+        it->second[i].dump(out);
+      }
+    }
+    pthread_mutex_unlock(&collect_lock);
+  }
+};
+
+#endif  // __TOOLS_REQUEST_TRACE_H__
@@ -0,0 +1,244 @@
+#ifndef __TOOLS_RESPONSE_CACHE_H__
+#define __TOOLS_RESPONSE_CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ostream>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tools/flat_hash_map.h"
+
+typedef enum {
+  CACHE_LRU,    // evict the least recently used entry
+  CACHE_LFU,    // evict the least frequently used entry (with aging)
+  CACHE_COST    // evict the entry that is cheapest to recompute per byte
+} cache_policy_t;
+
+/*
+ * ResponseCache --
+ *
+ * Request string -> response string cache bounded by a byte budget
+ * (keys, values and per-entry overhead all count against it).
+ *
+ * LFU and COST both use GreedyDual-Size-Frequency priorities:
+ *
+ *   H = L + frequency * cost / size
+ *
+ * where L is the priority of the last evicted entry, so entries that
+ * were popular long ago age out.  LFU uses cost = size = 1; COST
+ * uses the caller's cost estimate, so an expensive countprimes or
+ * 418wisdom result outlives many cheap tellmenow ones.
+ */
+class ResponseCache {
+public:
+  struct Stats {
+    long hits;
+    long misses;
+    long insertions;
+    long evictions;
+    size_t bytes;
+    size_t entries;
+  };
+
+private:
+  // rough bookkeeping cost per entry: the entry itself, its hash
+  // slot and its place in the eviction order
+  static const size_t ENTRY_OVERHEAD = 128;
+
+  static const uint32_t NIL = 0xffffffff;
+
+  struct Entry {
+    std::string key;
+    std::string value;
+    double cost;
+    double priority;
+    long frequency;
+    size_t bytes;
+    uint32_t prev;   // LRU list, towards most recent
+    uint32_t next;   // LRU list, towards least recent
+  };
+
+  cache_policy_t policy;
+  size_t budget;
+  Stats stats;
+
+  FlatHashMap<std::string, uint32_t> index;
+  std::vector<Entry> entries;
+  std::vector<uint32_t> free_list;
+
+  // LRU: most recent at head
+  uint32_t head;
+  uint32_t tail;
+
+  // LFU / COST: (priority, entry) ordered by priority
+  std::set<std::pair<double, uint32_t> > order;
+  double inflation;
+
+  void list_unlink(uint32_t id) {
+    Entry& e = entries[id];
+    if (e.prev != NIL) entries[e.prev].next = e.next; else head = e.next;
+    if (e.next != NIL) entries[e.next].prev = e.prev; else tail = e.prev;
+    e.prev = e.next = NIL;
+  }
+
+  void list_push_front(uint32_t id) {
+    Entry& e = entries[id];
+    e.prev = NIL;
+    e.next = head;
+    if (head != NIL) entries[head].prev = id;
+    head = id;
+    if (tail == NIL) tail = id;
+  }
+
+  double compute_priority(const Entry& e) const {
+    if (policy == CACHE_LFU) {
+      return inflation + e.frequency;
+    }
+    return inflation + e.frequency * e.cost / e.bytes;
+  }
+
+  void touch(uint32_t id) {
+    Entry& e = entries[id];
+    e.frequency++;
+    if (policy == CACHE_LRU) {
+      list_unlink(id);
+      list_push_front(id);
+    } else {
+      order.erase(std::make_pair(e.priority, id));
+      e.priority = compute_priority(e);
+      order.insert(std::make_pair(e.priority, id));
+    }
+  }
+
+  uint32_t victim() const {
+    if (policy == CACHE_LRU) {
+      return tail;
+    }
+    return order.empty() ? NIL : order.begin()->second;
+  }
+
+  void remove(uint32_t id) {
+    Entry& e = entries[id];
+    if (policy == CACHE_LRU) {
+      list_unlink(id);
+    } else {
+      order.erase(std::make_pair(e.priority, id));
+    }
+    index.erase(e.key);
+    stats.bytes -= e.bytes;
+    stats.entries--;
+    // release the strings' memory, not just their contents
+    std::string().swap(e.key);
+    std::string().swap(e.value);
+    free_list.push_back(id);
+  }
+
+  void evict_one() {
+    uint32_t id = victim();
+    if (policy != CACHE_LRU) {
+      inflation = entries[id].priority;
+    }
+    remove(id);
+    stats.evictions++;
+  }
+
+public:
+  ResponseCache(size_t budget_bytes, cache_policy_t eviction_policy)
+    : policy(eviction_policy), budget(budget_bytes),
+      head(NIL), tail(NIL), inflation(0.0) {
+    stats.hits = stats.misses = stats.insertions = stats.evictions = 0;
+    stats.bytes = stats.entries = 0;
+  }
+
+  /*
+   * lookup --
+   *
+   * Returns the cached response for 'key', or NULL.  The pointer is
+   * valid until the next insert().
+   */
+  const std::string* lookup(const std::string& key) {
+    uint32_t* id = index.find(key);
+    if (id == NULL) {
+      stats.misses++;
+      return NULL;
+    }
+    stats.hits++;
+    touch(*id);
+    return &entries[*id].value;
+  }
+
+  bool contains(const std::string& key) const {
+    return index.contains(key);
+  }
+
+  /*
+   * insert --
+   *
+   * Cache 'value' for 'key', evicting as needed to stay within the
+   * budget.  'cost' is the estimated work to recompute the value (any
+   * unit, only ratios matter); it is ignored by LRU and LFU.
+   */
+  void insert(const std::string& key, const std::string& value, double cost) {
+    size_t bytes = key.size() + value.size() + ENTRY_OVERHEAD;
+    if (bytes > budget) {
+      return;
+    }
+
+    uint32_t* existing = index.find(key);
+    if (existing != NULL) {
+      remove(*existing);
+    }
+    while (stats.bytes + bytes > budget) {
+      evict_one();
+    }
+
+    uint32_t id;
+    if (!free_list.empty()) {
+      id = free_list.back();
+      free_list.pop_back();
+    } else {
+      id = entries.size();
+      entries.push_back(Entry());
+    }
+
+    Entry& e = entries[id];
+    e.key = key;
+    e.value = value;
+    e.cost = cost > 0 ? cost : 1.0;
+    e.frequency = 1;
+    e.bytes = bytes;
+    e.prev = e.next = NIL;
+    if (policy == CACHE_LRU) {
+      list_push_front(id);
+    } else {
+      e.priority = compute_priority(e);
+      order.insert(std::make_pair(e.priority, id));
+    }
+
+    index[key] = id;
+    stats.bytes += bytes;
+    stats.entries++;
+    stats.insertions++;
+  }
+
+  const Stats& get_stats() const {
+    return stats;
+  }
+
+  void dump_stats(std::ostream& out) const {
+    long lookups = stats.hits + stats.misses;
+    out << "cache: entries=" << stats.entries
+        << " bytes=" << stats.bytes << "/" << budget
+        << " hits=" << stats.hits
+        << " misses=" << stats.misses
+        << " hit_rate=" << (lookups ? 100.0 * stats.hits / lookups : 0.0) << "%"
+        << " insertions=" << stats.insertions
+        << " evictions=" << stats.evictions;
+  }
+};
+
+#endif  // __TOOLS_RESPONSE_CACHE_H__
@@ -0,0 +1,228 @@
+#ifndef __TOOLS_TIMER_WHEEL_H__
+#define __TOOLS_TIMER_WHEEL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+typedef void (*timer_callback_t)(void* arg);
+
+/*
+ * TimerWheel --
+ *
+ * One-shot timers on a hashed timing wheel: time is cut into ticks
+ * of 'resolution_ms' and a timer due at tick t lives in slot
+ * t % num_slots, next to timers due whole rotations later.  Starting,
+ * cancelling and expiring a timer are O(1); advancing the wheel costs
+ * one slot per elapsed tick.
+ *
+ * Timers live in a pool and are linked into their slot by index.  A
+ * timer id is its pool index plus the generation of that pool entry,
+ * so cancelling a timer that already fired (or was cancelled) is a
+ * harmless no-op even after the entry was reused.
+ *
+ * Callbacks run from advance() and may start or cancel timers,
+ * including ones due in the same call.
+ */
+class TimerWheel {
+public:
+  typedef uint64_t timer_id_t;
+
+private:
+  static const int32_t NIL = -1;
+
+  enum TimerState { FREE, PENDING, DUE };
+
+  struct Timer {
+    int64_t expires;   // in ticks
+    timer_callback_t callback;
+    void* arg;
+    uint32_t generation;
+    TimerState state;
+    int32_t prev;
+    int32_t next;      // also the free list link
+  };
+
+  double resolution_ms;
+  int64_t mask;
+  int64_t current;     // last tick that was processed
+  std::vector<Timer> timers;
+  std::vector<int32_t> slots;
+  int32_t free_head;
+  size_t pending;
+
+  int32_t allocate() {
+    if (free_head == NIL) {
+      Timer t;
+      t.generation = 0;
+      t.state = FREE;
+      timers.push_back(t);
+      return timers.size() - 1;
+    }
+    int32_t index = free_head;
+    free_head = timers[index].next;
+    return index;
+  }
+
+  void release(int32_t index) {
+    Timer& t = timers[index];
+    t.state = FREE;
+    t.generation++;
+    t.next = free_head;
+    free_head = index;
+  }
+
+  void link(int32_t index) {
+    Timer& t = timers[index];
+    int32_t& head = slots[t.expires & mask];
+    t.prev = NIL;
+    t.next = head;
+    if (head != NIL) {
+      timers[head].prev = index;
+    }
+    head = index;
+  }
+
+  void unlink(int32_t index) {
+    Timer& t = timers[index];
+    if (t.prev != NIL) {
+      timers[t.prev].next = t.next;
+    } else {
+      slots[t.expires & mask] = t.next;
+    }
+    if (t.next != NIL) {
+      timers[t.next].prev = t.prev;
+    }
+  }
+
+  // Moves the timers of 'slot' due at or before 'limit' to 'due'.
+  void collect(int64_t slot, int64_t limit, std::vector<timer_id_t>* due) {
+    int32_t index = slots[slot];
+    while (index != NIL) {
+      Timer& t = timers[index];
+      int32_t next = t.next;
+      if (t.expires <= limit) {
+        unlink(index);
+        t.state = DUE;
+        due->push_back(make_id(index, t.generation));
+      }
+      index = next;
+    }
+  }
+
+  static timer_id_t make_id(int32_t index, uint32_t generation) {
+    return (static_cast<timer_id_t>(generation) << 32) | static_cast<uint32_t>(index);
+  }
+
+  // Index of the live timer 'id' names, or NIL.
+  int32_t lookup(timer_id_t id) const {
+    uint32_t index = static_cast<uint32_t>(id);
+    if (index >= timers.size()) {
+      return NIL;
+    }
+    const Timer& t = timers[index];
+    if (t.state == FREE || t.generation != static_cast<uint32_t>(id >> 32)) {
+      return NIL;
+    }
+    return index;
+  }
+
+public:
+  // 'num_slots' is rounded up to a power of two; a rotation should
+  // cover the usual timeout so most timers never wait out a lap.
+  TimerWheel(double resolution, int num_slots, double now_ms)
+    : resolution_ms(resolution), free_head(NIL), pending(0) {
+    int size = 1;
+    while (size < num_slots) {
+      size <<= 1;
+    }
+    mask = size - 1;
+    slots.assign(size, static_cast<int32_t>(NIL));
+    current = static_cast<int64_t>(now_ms / resolution_ms);
+  }
+
+  /*
+   * schedule --
+   *
+   * Run 'callback(arg)' once, on the first advance() at or after
+   * now_ms + delay_ms.  Returns an id for cancel().
+   */
+  timer_id_t schedule(double now_ms, double delay_ms, timer_callback_t callback,
+                      void* arg) {
+    int64_t expires = static_cast<int64_t>((now_ms + delay_ms) / resolution_ms);
+    if (expires <= current) {
+      expires = current + 1;
+    }
+    int32_t index = allocate();
+    Timer& t = timers[index];
+    t.expires = expires;
+    t.callback = callback;
+    t.arg = arg;
+    t.state = PENDING;
+    link(index);
+    pending++;
+    return make_id(index, t.generation);
+  }
+
+  // Returns false if the timer already fired or was cancelled.
+  bool cancel(timer_id_t id) {
+    int32_t index = lookup(id);
+    if (index == NIL) {
+      return false;
+    }
+    if (timers[index].state == PENDING) {
+      unlink(index);
+    }
+    release(index);
+    pending--;
+    return true;
+  }
+
+  /*
+   * advance --
+   *
+   * Fire every timer due at or before now_ms, in tick order (timers
+   * more than a rotation late fire together).  Returns how many ran.
+   */
+  int advance(double now_ms) {
+    int64_t target = static_cast<int64_t>(now_ms / resolution_ms);
+    if (target <= current) {
+      return 0;
+    }
+    int64_t gap = target - current;
+    int64_t steps = gap > mask ? mask + 1 : gap;
+
+    std::vector<timer_id_t> due;
+    for (int64_t i = 1; i <= steps; ++i) {
+      int64_t tick = current + i;
+      collect(tick & mask, gap > mask ? target : tick, &due);
+    }
+    current = target;
+
+    int fired = 0;
+    for (size_t i = 0; i < due.size(); ++i) {
+      int32_t index = lookup(due[i]);
+      if (index == NIL) {
+        continue;   // cancelled by an earlier callback
+      }
+      timer_callback_t callback = timers[index].callback;
+      void* arg = timers[index].arg;
+      release(index);
+      pending--;
+      callback(arg);
+      fired++;
+    }
+    return fired;
+  }
+
+  size_t size() const {
+    return pending;
+  }
+
+  double get_resolution_ms() const {
+    return resolution_ms;
+  }
+};
+
+#endif  // __TOOLS_TIMER_WHEEL_H__
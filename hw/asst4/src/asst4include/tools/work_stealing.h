@@ -0,0 +1,525 @@
+#ifndef __WORKER_WORK_STEALING_H__
+#define __WORKER_WORK_STEALING_H__
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <ostream>
+#include <vector>
+
+#include "tools/cpu_topology.h"
+#include "tools/deadline_queue.h"
+#include "tools/mpmc_queue.h"
+
+/*
+ * ChaseLevDeque --
+ *
+ * Single-owner work-stealing deque (Chase & Lev, with the C11 memory
+ * orderings from Le et al., PPoPP'13).  The owning thread pushes and
+ * pops at the bottom (LIFO, cache hot); any other thread may steal
+ * from the top (FIFO, oldest first).  Items are pointers; NULL means
+ * "nothing there" (or a lost race, for steal()).
+ */
+template <class T>
+class ChaseLevDeque {
+private:
+  struct Array {
+    long size;
+    std::atomic<T*>* slots;
+
+    explicit Array(long n) : size(n), slots(new std::atomic<T*>[n]) {}
+    ~Array() { delete [] slots; }
+
+    T* get(long i) const {
+      return slots[i & (size - 1)].load(std::memory_order_relaxed);
+    }
+    void put(long i, T* x) {
+      slots[i & (size - 1)].store(x, std::memory_order_relaxed);
+    }
+  };
+
+  char pad0[MPMC_CACHE_LINE];
+  std::atomic<long> top;
+  char pad1[MPMC_CACHE_LINE];
+  std::atomic<long> bottom;
+  char pad2[MPMC_CACHE_LINE];
+  std::atomic<Array*> array;
+
+  // Old arrays may still be read by in-flight thieves, so they are
+  // only freed with the deque.
+  std::vector<Array*> retired;
+
+  ChaseLevDeque(const ChaseLevDeque&);
+  ChaseLevDeque& operator=(const ChaseLevDeque&);
+
+  Array* grow(Array* a, long t, long b) {
+    Array* bigger = new Array(a->size * 2);
+    for (long i = t; i < b; ++i) {
+      bigger->put(i, a->get(i));
+    }
+    retired.push_back(a);
+    array.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+
+public:
+  explicit ChaseLevDeque(long capacity = 256)
+    : top(0), bottom(0), array(new Array(capacity)) {}
+
+  ~ChaseLevDeque() {
+    delete array.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < retired.size(); ++i) {
+      delete retired[i];
+    }
+  }
+
+  // owner only
+  void push(T* x) {
+    long b = bottom.load(std::memory_order_relaxed);
+    long t = top.load(std::memory_order_acquire);
+    Array* a = array.load(std::memory_order_relaxed);
+    if (b - t > a->size - 1) {
+      a = grow(a, t, b);
+    }
+    a->put(b, x);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // owner only
+  T* pop() {
+    long b = bottom.load(std::memory_order_relaxed) - 1;
+    Array* a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return NULL;
+    }
+    T* x = a->get(b);
+    if (t == b) {
+      // last item: race against thieves for it
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+        x = NULL;
+      }
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return x;
+  }
+
+  // any thread
+  T* steal() {
+    long t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+      return NULL;
+    }
+    Array* a = array.load(std::memory_order_acquire);
+    T* x = a->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      return NULL;
+    }
+    return x;
+  }
+
+  long size() const {
+    long b = bottom.load(std::memory_order_relaxed);
+    long t = top.load(std::memory_order_relaxed);
+    return b > t ? b - t : 0;
+  }
+};
+
+/*
+ * WorkStealingPool --
+ *
+ * A pool of detached worker threads grouped into lanes.  put_work()
+ * hands an item to one thread of a lane (round robin) through that
+ * thread's MPMC inbox; spawn() pushes onto the calling thread's own
+ * Chase-Lev deque.  A thread drains its deque, then its inbox, and
+ * when both are empty steals from the deque or inbox of a random
+ * victim in any lane, so a backlog on one lane is picked up by idle
+ * threads of another.  With stealing disabled every lane behaves like
+ * its own private queue.
+ *
+ * An ordered lane instead keeps one earliest-deadline-first queue
+ * shared by its threads (and thieves), for work that should not be
+ * served in arrival order.
+ *
+ * Threads float over all CPUs until pin_thread() places them.
+ */
+template <class T>
+class WorkStealingPool {
+public:
+  typedef void (*Handler)(const T&);
+
+  struct ThreadStats {
+    long executed;
+    long steals;
+    long failed_steals;
+    int cpu;          // -1 if not pinned
+    int llc;
+  };
+
+private:
+  struct Lane;
+
+  struct Thread {
+    WorkStealingPool* pool;
+    int index;
+    int lane;
+    Lane* home;
+    pthread_t tid;
+    unsigned int seed;
+    ChaseLevDeque<T> deque;
+    MPMCWorkQueue<T*> inbox;
+    EventCount parked;
+    std::atomic<bool> busy;
+
+    std::atomic<long> executed;
+    std::atomic<long> steals;
+    std::atomic<long> failed_steals;
+
+    // placement, set by pin_thread(); the memory policy can only be
+    // set by the thread itself, so it applies 'mem_node' before its
+    // next item
+    std::atomic<int> cpu;
+    std::atomic<int> llc;
+    std::atomic<int> mem_node;
+    int applied_node;
+
+    Thread() : busy(false), executed(0), steals(0), failed_steals(0),
+               cpu(-1), llc(-1), mem_node(-1), applied_node(-1) {}
+  };
+
+  struct Lane {
+    std::vector<int> threads;
+    std::atomic<unsigned int> next;
+
+    // reserved lanes keep their threads for their own work
+    bool can_steal;
+
+    // ordered lanes only
+    bool ordered;
+    pthread_mutex_t lock;
+    DeadlineQueue<T*> pending;
+    std::atomic<long> queued;
+  };
+
+  Handler handler;
+  bool steal_enabled;
+
+  // Sized once up front: thread structs are read by thieves while
+  // lanes are still being added.
+  std::vector<Thread*> threads;
+  std::atomic<int> num_threads;
+  std::vector<Lane*> lanes;
+
+  WorkStealingPool(const WorkStealingPool&);
+  WorkStealingPool& operator=(const WorkStealingPool&);
+
+  static thread_local Thread* self;
+
+  static void* thread_main(void* arg) {
+    Thread* me = reinterpret_cast<Thread*>(arg);
+    self = me;
+    me->pool->run(me);
+    return NULL;
+  }
+
+  static T* take_ordered(Lane* lane) {
+    if (!lane->ordered || lane->queued.load() == 0) {
+      return NULL;
+    }
+    T* item = NULL;
+    pthread_mutex_lock(&lane->lock);
+    if (!lane->pending.empty()) {
+      item = lane->pending.front();
+      lane->pending.pop();
+      lane->queued.fetch_sub(1);
+    }
+    pthread_mutex_unlock(&lane->lock);
+    return item;
+  }
+
+  T* find_local(Thread* me) {
+    T* item = me->deque.pop();
+    if (item == NULL) {
+      me->inbox.try_get_work(item);
+    }
+    if (item == NULL) {
+      item = take_ordered(me->home);
+    }
+    return item;
+  }
+
+  T* try_steal(Thread* me) {
+    int n = num_threads.load(std::memory_order_acquire);
+    if (!steal_enabled || !me->home->can_steal || n < 2) {
+      return NULL;
+    }
+    // one random probe per other thread
+    for (int attempt = 0; attempt < n - 1; ++attempt) {
+      int victim = rand_r(&me->seed) % n;
+      if (victim == me->index) {
+        continue;
+      }
+      Thread* v = threads[victim];
+      T* item = v->deque.steal();
+      if (item == NULL) {
+        v->inbox.try_get_work(item);
+      }
+      if (item == NULL) {
+        item = take_ordered(v->home);
+      }
+      if (item != NULL) {
+        me->steals.fetch_add(1, std::memory_order_relaxed);
+        return item;
+      }
+      me->failed_steals.fetch_add(1, std::memory_order_relaxed);
+    }
+    return NULL;
+  }
+
+  // Deterministic sweep used right before parking, so a thread never
+  // sleeps while stealable work exists.
+  T* sweep(Thread* me) {
+    int n = num_threads.load(std::memory_order_acquire);
+    for (int i = 0; steal_enabled && me->home->can_steal && i < n; ++i) {
+      if (i == me->index) {
+        continue;
+      }
+      T* item = threads[i]->deque.steal();
+      if (item == NULL) {
+        threads[i]->inbox.try_get_work(item);
+      }
+      if (item == NULL) {
+        item = take_ordered(threads[i]->home);
+      }
+      if (item != NULL) {
+        me->steals.fetch_add(1, std::memory_order_relaxed);
+        return item;
+      }
+    }
+    return NULL;
+  }
+
+  void run(Thread* me) {
+    while (true) {
+      T* item = find_local(me);
+      if (item == NULL) {
+        item = try_steal(me);
+      }
+      if (item == NULL) {
+        me->busy.store(false);
+        int key = me->parked.prepare_wait();
+        item = find_local(me);
+        if (item == NULL) {
+          item = sweep(me);
+        }
+        if (item == NULL) {
+          me->parked.wait(key);
+          me->busy.store(true);
+          continue;
+        }
+        me->parked.cancel_wait();
+        me->busy.store(true);
+      }
+      int node = me->mem_node.load(std::memory_order_relaxed);
+      if (node != me->applied_node) {
+        prefer_memory_node(node);
+        me->applied_node = node;
+      }
+      handler(*item);
+      delete item;
+      me->executed.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Wake the owner; if it is busy and stealing is on, wake an idle
+  // thread that may steal so the item does not wait behind a long job.
+  void wake(Thread* owner) {
+    owner->parked.notify_one();
+    if (!steal_enabled || !owner->busy.load()) {
+      return;
+    }
+    int n = num_threads.load(std::memory_order_acquire);
+    for (int i = 0; i < n; ++i) {
+      if (threads[i]->home->can_steal && !threads[i]->busy.load()) {
+        threads[i]->parked.notify_one();
+        return;
+      }
+    }
+  }
+
+public:
+
+  WorkStealingPool(Handler fn, int max_threads, bool enable_stealing = true)
+    : handler(fn), steal_enabled(enable_stealing),
+      threads(max_threads), num_threads(0) {}
+
+  /*
+   * add_lane --
+   *
+   * Start 'count' detached threads serving a new lane and return the
+   * lane id to pass to put_work().  An ordered lane serves its work
+   * earliest deadline first.  Threads of a lane that cannot steal only
+   * run the lane's own work (other threads may still steal from it).
+   */
+  int add_lane(int count, bool ordered = false, bool can_steal = true) {
+    Lane* lane = new Lane;
+    lane->next.store(0);
+    lane->can_steal = can_steal;
+    lane->ordered = ordered;
+    pthread_mutex_init(&lane->lock, NULL);
+    lane->queued.store(0);
+    int lane_id = lanes.size();
+    for (int i = 0; i < count; ++i) {
+      int index = num_threads.load();
+      if (index >= static_cast<int>(threads.size())) {
+        break;
+      }
+      Thread* t = new Thread;
+      t->pool = this;
+      t->index = index;
+      t->lane = lane_id;
+      t->home = lane;
+      t->seed = index * 7919 + 1;
+      t->busy.store(true);
+      threads[index] = t;
+      lane->threads.push_back(index);
+      num_threads.store(index + 1, std::memory_order_release);
+
+      pthread_create(&t->tid, NULL, thread_main, t);
+      pthread_detach(t->tid);
+    }
+    lanes.push_back(lane);
+    return lane_id;
+  }
+
+  // 'deadline' (any clock, smaller is more urgent) only matters on
+  // ordered lanes.
+  void put_work(const T& item, int lane_id, double deadline = 0.0) {
+    Lane* lane = lanes[lane_id];
+    unsigned int slot = lane->next.fetch_add(1) % lane->threads.size();
+    Thread* owner = threads[lane->threads[slot]];
+    if (lane->ordered) {
+      pthread_mutex_lock(&lane->lock);
+      lane->pending.push(new T(item), deadline);
+      lane->queued.fetch_add(1);
+      pthread_mutex_unlock(&lane->lock);
+      // any thread of the lane can take it: prefer an idle one
+      for (size_t i = 0; i < lane->threads.size(); ++i) {
+        if (!threads[lane->threads[i]]->busy.load()) {
+          owner = threads[lane->threads[i]];
+          break;
+        }
+      }
+    } else {
+      owner->inbox.put_work(new T(item));
+    }
+    wake(owner);
+  }
+
+  /*
+   * spawn --
+   *
+   * Push a sub-task onto the calling pool thread's own deque, where it
+   * stays cache hot unless another thread steals it.  Must be called
+   * from a pool thread.
+   */
+  void spawn(const T& item) {
+    self->deque.push(new T(item));
+    wake(self);
+  }
+
+  /*
+   * pin_thread --
+   *
+   * Run thread 'index' only on 'cpu' (in LLC domain 'llc', for the
+   * stats) and make its allocations prefer NUMA node 'node'.  Returns
+   * false if the affinity could not be set.
+   */
+  bool pin_thread(int index, int cpu, int llc, int node) {
+    Thread* t = threads[index];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(t->tid, sizeof(set), &set) != 0) {
+      return false;
+    }
+    t->cpu.store(cpu);
+    t->llc.store(llc);
+    t->mem_node.store(node);
+    return true;
+  }
+
+  // Thread ids of a lane, for placing them.
+  const std::vector<int>& lane_threads(int lane_id) const {
+    return lanes[lane_id]->threads;
+  }
+
+  int thread_count() const {
+    return num_threads.load();
+  }
+
+  int idle_threads(bool stealers_only = false) const {
+    int idle = 0;
+    int n = num_threads.load();
+    for (int i = 0; i < n; ++i) {
+      if (stealers_only && !threads[i]->home->can_steal) {
+        continue;
+      }
+      if (!threads[i]->busy.load()) {
+        idle++;
+      }
+    }
+    return idle;
+  }
+
+  // Approximate backlog of one lane (inboxes plus deques).
+  long lane_backlog(int lane_id) const {
+    long total = 0;
+    const Lane* lane = lanes[lane_id];
+    for (size_t i = 0; i < lane->threads.size(); ++i) {
+      const Thread* t = threads[lane->threads[i]];
+      total += t->inbox.size() + t->deque.size();
+    }
+    return total + lane->queued.load();
+  }
+
+  ThreadStats get_stats(int index) const {
+    ThreadStats s;
+    s.executed = threads[index]->executed.load();
+    s.steals = threads[index]->steals.load();
+    s.failed_steals = threads[index]->failed_steals.load();
+    s.cpu = threads[index]->cpu.load();
+    s.llc = threads[index]->llc.load();
+    return s;
+  }
+
+  void dump_stats(std::ostream& out) const {
+    int n = num_threads.load();
+    for (int i = 0; i < n; ++i) {
+      ThreadStats s = get_stats(i);
+      out << "thread " << i << " (lane " << threads[i]->lane << "):"
+          << " executed=" << s.executed
+          << " steals=" << s.steals
+          << " failed_steals=" << s.failed_steals;
+      if (s.cpu >= 0) {
+        out << " cpu=" << s.cpu << " llc=" << s.llc;
+      }
+      out << "\n";
+    }
+  }
+};
+
+template <class T>
+thread_local typename WorkStealingPool<T>::Thread* WorkStealingPool<T>::self = NULL;
+
+#endif  // __WORKER_WORK_STEALING_H__
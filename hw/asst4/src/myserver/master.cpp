@@ -1,37 +1,159 @@
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <map>
+#include <string.h>
 #include <queue>
 #include <vector>
 #include <iostream>
+#include <sstream>
 #include <climits>
 
 #include "server/messages.h"
 #include "server/master.h"
+#include "tools/autoscaler.h"
+#include "tools/cache_snapshot.h"
+#include "tools/consistent_hash.h"
+#include "tools/cost_model.h"
+#include "tools/deadline_queue.h"
+#include "tools/flat_hash_map.h"
+#include "tools/node_budget.h"
+#include "tools/request_dag.h"
+#include "tools/request_trace.h"
+#include "tools/response_cache.h"
 
 #define DEBUG
 #define PRINT_MESSAGE
 
 using namespace std;
 
-const int THREAD_NUM = 30;
-const double THRESHOLD = 1.4;
-const int CLOSE_NUM = static_cast<int>(THREAD_NUM * THRESHOLD * THRESHOLD);
 const int PROJECT_IDEA_COST = 5;
 
+// rough recompute cost of each request type (ms on one worker
+// thread), used by the cost-aware cache policy and as the cost
+// model's priors
+const double WISDOM_RECOMPUTE_COST = 700;
+const double COUNTPRIMES_RECOMPUTE_COST = 700;
+const double PROJECTIDEA_RECOMPUTE_COST = 400;
+const double BANDWIDTH_RECOMPUTE_COST = 300;
+const double TELLMENOW_RECOMPUTE_COST = 1;
+// four countprimes
+const double COMPAREPRIMES_RECOMPUTE_COST = 4 * COUNTPRIMES_RECOMPUTE_COST;
+
+// how many requests of each resource class run side by side on a node
+// (NODE_HW_THREADS, tools/node_budget.h) before they slow each other
+// down (a couple of streaming jobs saturate memory bandwidth; two
+// LLC-sized working sets already thrash the cache)
+const double RESOURCE_PARALLELISM[NUM_RESOURCES] = { 24, 2, 1, 24 };
+
+// weight of each new latency sample in the cost estimates
+const double COST_MODEL_ALPHA = 0.2;
+
+// predictive autoscaler: how often it decides (ms), smoothing of the
+// demand level and trend, how busy the forecast may keep a worker's
+// hardware threads, and how many decisions the forecast must stay low
+// before a worker is killed (5 s)
+const int AUTOSCALE_PERIOD_MS = 250;
+const double AUTOSCALE_ALPHA = 0.3;
+const double AUTOSCALE_BETA = 0.1;
+const double AUTOSCALE_UTILIZATION = 0.8;
+const int AUTOSCALE_COOLDOWN_TICKS = 20;
+// assumed worker boot time until the first one has been measured (s)
+const double WORKER_BOOT_PRIOR = 5.0;
+
+// latency budgets that order the queues (earliest deadline first);
+// other requests get --slo_ms
+const int TELLMENOW_DEADLINE_MS = 150;
+const int PROJECTIDEA_DEADLINE_MS = 2000;
+
+// points per worker on the hash ring used by --routing=hash
+const int HASH_RING_REPLICAS = 64;
+
+// --cache_dir: compact the log early once it grows past this, so a
+// restart never replays much of it
+const size_t CACHE_LOG_COMPACT_BYTES = 64 * 1024 * 1024;
+
+// a worker's load report is used for placement until this many
+// report periods have passed; then the tick asks for a new one
+const int STATS_STALE_PERIODS = 4;
+
+// the tracer's rings hold 4096 events (about 800 requests)
+const int TRACE_COLLECT_INTERVAL = 256;
+
+DEFINE_int32(cache_mb, 64, "Memory budget of the master's response cache (MB)");
+DEFINE_string(cache_policy, "cost", "Response cache eviction policy: lru, lfu or cost");
+DEFINE_string(cache_dir, "", "Persist the response cache in this directory (a log "
+              "and a memory-mapped snapshot) and reload it at start");
+DEFINE_int32(cache_snapshot_s, 60, "Seconds between compactions of the cache log "
+             "into the snapshot");
+DEFINE_int32(cache_snapshot_mb, 1024, "Size cap of the cache snapshot (MB)");
+DEFINE_string(scheduler, "cost", "Request placement: cost (earliest predicted "
+              "completion from learned per-command costs) or slots (first fit)");
+DEFINE_string(autoscaler, "predictive", "Worker scaling: predictive (forecast "
+              "demand a boot time ahead) or reactive (grow on queueing)");
+DEFINE_int32(slo_ms, 2500, "Latency objective reported per trace (ms)");
+DEFINE_string(admission, "budgets", "When a worker may take a request: budgets "
+              "(threads, memory bandwidth and LLC must all fit) or slots");
+// slot policy: the first worker gets threshold times thread_num
+// slots, the others thread_num, and idle workers are killed while
+// thread_num * threshold^2 slots would still be free
+DEFINE_int32(thread_num, 30, "Request slots per worker");
+DEFINE_double(threshold, 1.4, "Slot headroom of the first worker and of the "
+              "rule that kills idle workers");
+DEFINE_string(routing, "load", "Placement of 418wisdom, countprimes and bandwidth: "
+              "load (by --scheduler) or hash (consistent hashing of the request "
+              "string with bounded load, so repeats hit one worker's memo cache)");
+DEFINE_double(hash_load_factor, 1.25, "With --routing=hash, a worker takes a request "
+              "only while its load is under this times the average");
+DEFINE_int32(worker_memo_mb, 64, "Memory budget of each worker's response memo "
+             "cache with --routing=hash (MB)");
+DEFINE_int32(worker_stats_ms, 250, "Period of the load reports workers push (ms); "
+             "0 = no reports, placement by the master's own bookkeeping");
+DEFINE_bool(worker_steal, true, "Let idle worker threads steal queued requests "
+            "from busy ones");
+DEFINE_bool(worker_sieve, true, "Answer countprimes on workers from a prime "
+            "sieve built at boot");
+DEFINE_bool(worker_parallel, true, "Split large countprimes across idle worker "
+            "threads (needs --worker_steal)");
+DEFINE_bool(worker_pin, false, "Pin worker threads to cores, keeping projectidea's "
+            "LLC domain clear of request threads");
+DEFINE_string(trace_dir, "", "Trace every request: Chrome traces of the master "
+              "and workers are written here and latency histograms logged");
+
 typedef struct {
     int max_slots;
     int remaining_slots;
     int tag;
     bool processing_project_idea;
+    int inflight;
+    int fast_inflight; // tellmenows in the worker's fast lane
+    // predicted work in flight on the worker, per resource (ms)
+    double backlog_ms[NUM_RESOURCES];
+    // threads, bandwidth and LLC held by the requests in flight
+    NodeUsage usage;
+    // the worker's last load report and when it came (-1: none yet),
+    // and requests sent to / answered by it since
+    worker_stats_t load;
+    double load_time;
+    int sent_since_load;
+    int done_since_load;
 } Info;
 
 typedef struct {
-    int tag;
-    int n[4];
-    int count; // count how many count primes have returned from worker
-} compPrime;
+    Worker_handle worker;
+    string cmd;
+    resource_t resource;
+    ResourceDemand demand;
+    double predicted_ms;
+    double start_time;
+    int concurrency; // requests in flight on the worker, this one included
+} Dispatch;
+
+typedef struct {
+    double time;
+    Timer_handle deadline; // 0 once fired or when there is none
+} Arrival;
 
 static struct Master_state {
 
@@ -58,29 +180,74 @@ static struct Master_state {
   // workers
   vector<Worker_handle> workers;
   // key: worker handle, value: worker infomation
-  map<Worker_handle, Info> worker_info;
+  FlatHashMap<Worker_handle, Info> worker_info;
 
   // key: request tag, value: client handle
-  map<int, Client_handle> waiting_client;
+  // entries are erased once the client has its response
+  FlatHashMap<int, Client_handle> waiting_client;
 
   // key: request tag, value: request string 
-  map<int, string> request_map;
+  // entries are erased once the response has been handled
+  FlatHashMap<int, string> request_map;
   
-  // key: request tag, value: compPrime
-  // handles comparePrimes request
-  map<int, compPrime*> prime_map;
-
-  // request cache, key: request string, value: response msg
-  map<string, Response_msg> request_cache;
+  // composite requests (compareprimes) waiting on their sub-requests
+  RequestDag* subrequests;
+
+  // request cache, key: request string, value: response string
+  ResponseCache* request_cache;
+
+  // --cache_dir: responses on disk, consulted when request_cache
+  // misses; NULL when off
+  CacheSnapshot* cache_snapshot;
+  double last_compaction_time;
+
+  // learned per-command costs, and the requests out on workers
+  // key: request tag, value: where and when it was sent
+  CostModel* cost_model;
+  FlatHashMap<int, Dispatch> dispatched;
+  bool cost_scheduling;
+  bool budget_admission;
+
+  // --routing=hash: workers on a consistent hash ring, each with a
+  // memo cache for the request strings that hash to it
+  bool hash_routing;
+  ConsistentHashRing<Worker_handle>* ring;
+  // ring ids are the master's own, one per worker that came online
+  uint64_t next_ring_id;
+
+  // predictive scaling: work that arrived since the last tick (thread
+  // ms), workers requested but not online yet and when they were asked
+  // for, and the measured boot time (s)
+  Autoscaler* autoscaler;
+  bool predictive_scaling;
+  double arrived_work_ms;
+  int booting_workers;
+  queue<double> boot_request_times;
+  double boot_latency;
+  double last_scale_time;
+  double last_tick_time;
+
+  // per trace report: worker seconds, and per command requests and
+  // latency objective misses
+  // key: request tag, value: arrival time and deadline timer of the
+  // client request
+  double worker_seconds;
+  FlatHashMap<int, Arrival> arrivals;
+  FlatHashMap<string, pair<long, long> > slo_stats;
+  long deadline_boots;
+
+  // per-request tracing, NULL unless --trace_dir is set
+  RequestTracer* tracer;
+  long traced_requests;
 
   // This map is used to avoid sending the same request to worker while it is processing by worker
   // key: processing request, value: list of tag that has the same request string
-  map<string, vector<int>> processing_cache;
+  FlatHashMap<string, vector<int>> processing_cache;
 
   // project idea queue
-  queue<Request_msg> project_idea_queue;
-  // compute intensive queue
-  queue<Request_msg> compute_intensive_queue;
+  DeadlineQueue<Request_msg> project_idea_queue;
+  // compute intensive queue, one per command
+  ClassDeadlineQueue<Request_msg> compute_intensive_queue;
 } mstate;
 
 inline Info get_worker_info(Worker_handle);
@@ -88,6 +255,7 @@ inline Client_handle get_client_handle(int tag);
 inline void worker_process_request(Worker_handle, Info&, const Request_msg&, bool flag = false);
 
 bool check_cache(Client_handle, const Request_msg&);
+bool lookup_cache(const string& req_str, string* response);
 void start_new_worker(int num = 1);
 void update_cache(int, const Response_msg&);
 void process_request(const Request_msg&);
@@ -98,10 +266,32 @@ void clear_compute_intensive_queue();
 void clear_project_idea_queue();
 void process_compare_primes(const Request_msg&);
 void create_computeprimes_req(Request_msg& req, int n);
+string combine_compare_primes(const vector<string>& counts);
+void complete_composites(const vector<DagCompletion>& done);
 void process_project_idea_request(const Request_msg&);
 bool check_processing_cache(const string&, int tag);
 void update_processing_cache(const string&, int tag);
 void forward_response(const string&, const Response_msg&);
+void finish_request(int tag);
+double request_cost(const string&);
+void track_dispatch(Worker_handle, Info&, const Request_msg&);
+void complete_dispatch(int tag);
+Worker_handle pick_worker(const string& cmd);
+Worker_handle pick_hashed_worker(const Request_msg&);
+Worker_handle place_compute_request(const Request_msg&);
+void remove_worker(Worker_handle);
+bool worker_admits(const Info&, const string& cmd);
+const worker_stats_t* fresh_load(const Info&);
+int worker_occupancy(const Info&);
+void boot_workers(int num);
+void autoscale();
+void handle_autoscale_timer(void*);
+void handle_request_deadline(void* arg);
+double request_deadline(const Request_msg&);
+Worker_handle pick_fast_lane();
+double arrival_work_ms(const Request_msg&);
+inline void trace(TraceStage stage, int tag, const string& cmd = "");
+void dump_scaling_report(ostream&);
 
 void master_node_init(int max_workers, int& tick_period) {
   // set up tick handler to fire every 1 seconds. 
@@ -117,6 +307,100 @@ void master_node_init(int max_workers, int& tick_period) {
   mstate.processing_project_idea_num = 0;
   mstate.total_remaining_slots = 0;
 
+  cache_policy_t policy = CACHE_COST;
+  if (FLAGS_cache_policy == "lru") {
+    policy = CACHE_LRU;
+  } else if (FLAGS_cache_policy == "lfu") {
+    policy = CACHE_LFU;
+  } else if (FLAGS_cache_policy != "cost") {
+    LOG(WARNING) << "Unknown cache policy " << FLAGS_cache_policy << ", using cost" << endl;
+  }
+  mstate.request_cache = new ResponseCache(
+      static_cast<size_t>(FLAGS_cache_mb) * 1024 * 1024, policy);
+
+  mstate.cache_snapshot = NULL;
+  mstate.last_compaction_time = master_time_seconds();
+  if (!FLAGS_cache_dir.empty()) {
+    mstate.cache_snapshot = new CacheSnapshot(
+        FLAGS_cache_dir, static_cast<size_t>(FLAGS_cache_snapshot_mb) * 1024 * 1024);
+    if (mstate.cache_snapshot->load(mstate.request_cache)) {
+      ostringstream oss;
+      mstate.cache_snapshot->dump_stats(oss);
+      LOG(INFO) << oss.str() << endl;
+    } else {
+      LOG(WARNING) << "Cannot persist the cache in " << FLAGS_cache_dir << endl;
+      delete mstate.cache_snapshot;
+      mstate.cache_snapshot = NULL;
+    }
+  }
+
+  mstate.cost_model = new CostModel(COST_MODEL_ALPHA, TELLMENOW_RECOMPUTE_COST);
+  mstate.subrequests = new RequestDag();
+  mstate.cost_model->add_command("418wisdom", RESOURCE_CPU, WISDOM_RECOMPUTE_COST);
+  mstate.cost_model->add_command("countprimes", RESOURCE_CPU, COUNTPRIMES_RECOMPUTE_COST);
+  mstate.cost_model->add_command("bandwidth", RESOURCE_MEMORY, BANDWIDTH_RECOMPUTE_COST);
+  mstate.cost_model->add_command("projectidea", RESOURCE_CACHE, PROJECTIDEA_RECOMPUTE_COST);
+  mstate.cost_model->add_command("tellmenow", RESOURCE_NONE, TELLMENOW_RECOMPUTE_COST);
+
+  mstate.cost_scheduling = true;
+  if (FLAGS_scheduler == "slots") {
+    mstate.cost_scheduling = false;
+  } else if (FLAGS_scheduler != "cost") {
+    LOG(WARNING) << "Unknown scheduler " << FLAGS_scheduler << ", using cost" << endl;
+  }
+
+  Autoscaler::Config scaling;
+  scaling.alpha = AUTOSCALE_ALPHA;
+  scaling.beta = AUTOSCALE_BETA;
+  scaling.threads_per_worker = NODE_HW_THREADS;
+  scaling.target_utilization = AUTOSCALE_UTILIZATION;
+  scaling.cooldown_ticks = AUTOSCALE_COOLDOWN_TICKS;
+  scaling.min_workers = 1;
+  scaling.max_workers = max_workers;
+  mstate.autoscaler = new Autoscaler(scaling);
+  mstate.arrived_work_ms = 0.0;
+  mstate.booting_workers = 0;
+  mstate.boot_latency = WORKER_BOOT_PRIOR;
+  mstate.last_scale_time = master_time_seconds();
+  mstate.last_tick_time = master_time_seconds();
+  mstate.worker_seconds = 0.0;
+  mstate.deadline_boots = 0;
+
+  mstate.predictive_scaling = true;
+  if (FLAGS_autoscaler == "reactive") {
+    mstate.predictive_scaling = false;
+  } else if (FLAGS_autoscaler != "predictive") {
+    LOG(WARNING) << "Unknown autoscaler " << FLAGS_autoscaler << ", using predictive" << endl;
+  }
+  if (mstate.predictive_scaling) {
+    start_timer(AUTOSCALE_PERIOD_MS, handle_autoscale_timer, NULL);
+  }
+
+  mstate.tracer = NULL;
+  mstate.traced_requests = 0;
+  if (!FLAGS_trace_dir.empty()) {
+    mstate.tracer = new RequestTracer("master", FLAGS_trace_dir + "/master.trace.json");
+    if (!mstate.tracer->writing_trace()) {
+      LOG(WARNING) << "Cannot write a trace to " << FLAGS_trace_dir << endl;
+    }
+  }
+
+  mstate.hash_routing = false;
+  mstate.ring = new ConsistentHashRing<Worker_handle>(HASH_RING_REPLICAS);
+  mstate.next_ring_id = 0;
+  if (FLAGS_routing == "hash") {
+    mstate.hash_routing = true;
+  } else if (FLAGS_routing != "load") {
+    LOG(WARNING) << "Unknown routing " << FLAGS_routing << ", using load" << endl;
+  }
+
+  mstate.budget_admission = true;
+  if (FLAGS_admission == "slots") {
+    mstate.budget_admission = false;
+  } else if (FLAGS_admission != "budgets") {
+    LOG(WARNING) << "Unknown admission " << FLAGS_admission << ", using budgets" << endl;
+  }
+
   // don't mark the server as ready until the server is ready to go.
   // This is actually when the first worker is up and running, not
   // when 'master_node_init' returnes
@@ -135,13 +419,36 @@ void start_new_worker(int num) {
 #ifdef DEBUG
     DLOG(INFO) << "Lets start " << num << "workers" << endl;
 #endif
-    for (int i = 0; i < num; ++i) {
-      int tag = mstate.next_tag++;
-      Request_msg req(tag);
-      req.set_arg("tag", "" + tag);
-      mstate.starting_worker = true;
-      request_new_worker_node(req);
+    boot_workers(num);
+  }
+}
+
+/*
+ * Request 'num' worker nodes, whether or not others are still booting
+ */
+void boot_workers(int num) {
+  double now = master_time_seconds();
+  for (int i = 0; i < num; ++i) {
+    int tag = mstate.next_tag++;
+    Request_msg req(tag);
+    req.set_arg("tag", to_string(tag));
+    if (mstate.tracer != NULL) {
+      req.set_arg("trace", FLAGS_trace_dir);
+    }
+    if (mstate.hash_routing) {
+      req.set_arg("memo_mb", to_string(FLAGS_worker_memo_mb));
     }
+    if (FLAGS_worker_stats_ms > 0) {
+      req.set_arg("stats_ms", to_string(FLAGS_worker_stats_ms));
+    }
+    req.set_arg("steal", FLAGS_worker_steal ? "1" : "0");
+    req.set_arg("sieve", FLAGS_worker_sieve ? "1" : "0");
+    req.set_arg("parallel", FLAGS_worker_parallel ? "1" : "0");
+    req.set_arg("pin", FLAGS_worker_pin ? "1" : "0");
+    mstate.starting_worker = true;
+    mstate.booting_workers++;
+    mstate.boot_request_times.push(now);
+    request_new_worker_node(req);
   }
 }
 
@@ -154,23 +461,44 @@ void start_new_worker(int num) {
 void handle_new_worker_online(Worker_handle worker_handle, int tag) {
   Info info;
   
-  info.max_slots = static_cast<int>(THREAD_NUM * THRESHOLD);
+  info.max_slots = static_cast<int>(FLAGS_thread_num * FLAGS_threshold);
   if (tag != 0) {  // set first worker as special one
     // for better load balancing
     Worker_handle prev_worker_handle = mstate.workers[mstate.worker_num - 1];
     Info prev_info = get_worker_info(prev_worker_handle);
-    mstate.total_remaining_slots -= (prev_info.max_slots - THREAD_NUM);
-    prev_info.max_slots = THREAD_NUM;
+    mstate.total_remaining_slots -= (prev_info.max_slots - FLAGS_thread_num);
+    prev_info.max_slots = FLAGS_thread_num;
     mstate.worker_info[prev_worker_handle] = prev_info;
   }
   info.remaining_slots = info.max_slots;
   info.tag = tag;
   info.processing_project_idea = false;
+  info.inflight = 0;
+  info.fast_inflight = 0;
+  for (int i = 0; i < NUM_RESOURCES; ++i) {
+    info.backlog_ms[i] = 0.0;
+  }
+  info.usage = NodeUsage();
+  memset(&info.load, 0, sizeof(info.load));
+  info.load_time = -1.0;
+  info.sent_since_load = 0;
+  info.done_since_load = 0;
 
   mstate.worker_info[worker_handle] = info;
   mstate.workers.push_back(worker_handle);
+  mstate.ring->add(worker_handle, mstate.next_ring_id++);
   mstate.worker_num++;
   mstate.starting_worker = false;
+
+  // workers come up roughly in the order they were asked for
+  if (mstate.booting_workers > 0) {
+    mstate.booting_workers--;
+  }
+  if (!mstate.boot_request_times.empty()) {
+    double boot_time = master_time_seconds() - mstate.boot_request_times.front();
+    mstate.boot_request_times.pop();
+    mstate.boot_latency += 0.5 * (boot_time - mstate.boot_latency);
+  }
   mstate.total_remaining_slots += info.max_slots;
 
 #ifdef PRINT_MESSAGE
@@ -200,52 +528,37 @@ void handle_worker_response(Worker_handle worker_handle, const Response_msg& res
 
   // send response to client
   int resp_tag = resp.get_tag();
-  map<int, compPrime*>::iterator prime_it = mstate.prime_map.find(resp_tag);
-  // find a pending comp prime request
-  if (prime_it != mstate.prime_map.end()) {
-    compPrime* cp = prime_it -> second;
-    cp -> count++;
-    int index = resp_tag - cp -> tag - 1;
-    int result = atoi(resp.get_response().c_str());
-    cp -> n[index] = result;
-    if (cp -> count == 4) {
-      Response_msg response;
-      response.set_tag(cp -> tag);
-      int first = cp -> n[1] - cp -> n[0];
-      int second = cp -> n[3] - cp -> n[2];
-      if (first > second) {
-        response.set_response("There are more primes in first range.");
-      } else {
-        response.set_response("There are more primes in second range.");
-      }
-      Client_handle client_handle = get_client_handle(cp -> tag);
-      send_client_response(client_handle, response);
-    } else {
-      update_cache(resp_tag, resp);
-      Info info = get_worker_info(worker_handle);
-      ++info.remaining_slots;
-      ++mstate.total_remaining_slots;
-      //DLOG(INFO) << "add slot, worker " << info.tag<< " remaining slots: " << info.remaining_slots << endl;
-      mstate.worker_info[worker_handle] = info;
-      clear_queue();
-      return;
-    }
-  } else { 
-
-     Client_handle client_handle = get_client_handle(resp_tag);
-     send_client_response(client_handle, resp);
-     mstate.num_pending_client_requests--;
+  trace(TRACE_WORKER_RESPONSE, resp_tag);
+  complete_dispatch(resp_tag);
+  // a sub-request of one or more compareprimes
+  if (mstate.subrequests->owns(resp_tag)) {
+    update_cache(resp_tag, resp);
+    vector<DagCompletion> done;
+    mstate.subrequests->resolve(resp_tag, resp.get_response(), &done);
+    finish_request(resp_tag);
+    Info info = get_worker_info(worker_handle);
+    ++info.remaining_slots;
+    ++mstate.total_remaining_slots;
+    mstate.worker_info[worker_handle] = info;
+    complete_composites(done);
+    clear_queue();
+    return;
   }
+
+  Client_handle client_handle = get_client_handle(resp_tag);
+  send_client_response(client_handle, resp);
+  mstate.num_pending_client_requests--;
   // add response message to cache
   update_cache(resp_tag, resp);
 
   // check processing cache, if exist, forward it to all clients
-  map<int, string>::iterator request_it = mstate.request_map.find(resp_tag);
+  string* request_it = mstate.request_map.find(resp_tag);
   string req_str;
-  if (request_it != mstate.request_map.end()) {
-    req_str = request_it->second;
+  if (request_it != NULL) {
+    req_str = *request_it;
   }
   forward_response(req_str, resp);
+  finish_request(resp_tag);
 
   // update worker info
   Info info = get_worker_info(worker_handle);
@@ -270,6 +583,23 @@ void handle_worker_response(Worker_handle worker_handle, const Response_msg& res
   clear_compute_intensive_queue();
 }
 
+/*
+ * A worker's load report replaces what the master has counted for it
+ * since the previous one.  It may show room the master's bookkeeping
+ * did not (stolen work, memo hits), so the queues get another look.
+ */
+void handle_worker_stats(Worker_handle worker_handle, const worker_stats_t& stats) {
+  Info* info = mstate.worker_info.find(worker_handle);
+  if (info == NULL) {
+    return;
+  }
+  info->load = stats;
+  info->load_time = master_time_seconds();
+  info->sent_since_load = 0;
+  info->done_since_load = 0;
+  clear_queue();
+}
+
 void handle_client_request(Client_handle client_handle, const Request_msg& client_req) {
 
 #ifdef PRINT_MESSAGE
@@ -285,6 +615,50 @@ void handle_client_request(Client_handle client_handle, const Request_msg& clien
   // exists because it might be useful for debugging to dump
   // information about the entire run here: statistics, etc.
   if (client_req.get_arg("cmd") == "lastrequest") {
+    ostringstream oss;
+    mstate.request_cache->dump_stats(oss);
+    LOG(INFO) << oss.str() << endl;
+
+    if (mstate.cache_snapshot != NULL) {
+      oss.str("");
+      mstate.cache_snapshot->dump_stats(oss);
+      LOG(INFO) << oss.str() << endl;
+      mstate.cache_snapshot->flush();
+    }
+
+    oss.str("");
+    mstate.subrequests->dump_stats(oss);
+    LOG(INFO) << oss.str() << endl;
+
+    oss.str("");
+    dump_scaling_report(oss);
+    LOG(INFO) << oss.str() << endl;
+
+    for (int i = 0; i < mstate.worker_num; ++i) {
+      Info info = get_worker_info(mstate.workers[i]);
+      if (info.load_time >= 0) {
+        LOG(INFO) << "worker " << info.tag << " last report: " << info.load << endl;
+      }
+    }
+
+    if (mstate.tracer != NULL) {
+      oss.str("");
+      mstate.tracer->dump_histograms(oss);
+      LOG(INFO) << oss.str() << endl;
+    }
+
+    if (mstate.hash_routing) {
+      oss.str("");
+      mstate.ring->dump_stats(oss);
+      LOG(INFO) << oss.str() << endl;
+    }
+
+    oss.str("");
+    oss << "scheduler: " << (mstate.cost_scheduling ? "cost" : "slots")
+        << ", admission: " << (mstate.budget_admission ? "budgets" : "slots") << ", ";
+    mstate.cost_model->dump_stats(oss);
+    LOG(INFO) << oss.str() << endl;
+
     Response_msg resp(0);
     resp.set_response("ack");
     send_client_response(client_handle, resp);
@@ -298,6 +672,18 @@ void handle_client_request(Client_handle client_handle, const Request_msg& clien
   mstate.waiting_client[tag] = client_handle;
   mstate.request_map[tag] = client_req.get_request_string();
   mstate.num_pending_client_requests++;
+  if (mstate.tracer != NULL) {
+    string cmd = client_req.get_arg("cmd");
+    mstate.tracer->record_at(TRACE_ARRIVAL, tag, cmd, client_request_arrival_ns());
+    trace(TRACE_ENQUEUE, tag, cmd);
+  }
+  Arrival& arrival = mstate.arrivals[tag];
+  arrival.time = master_time_seconds();
+  arrival.deadline = 0;
+  if (mstate.predictive_scaling) {
+    arrival.deadline = start_timer(FLAGS_slo_ms / 2, handle_request_deadline,
+                                   reinterpret_cast<void*>(static_cast<intptr_t>(tag)));
+  }
 
   // check processing request map, to avoid resending the same request
   string req_str = client_req.get_request_string();
@@ -306,6 +692,7 @@ void handle_client_request(Client_handle client_handle, const Request_msg& clien
   }
   // update processing request map
   update_processing_cache(req_str, tag);
+  mstate.arrived_work_ms += arrival_work_ms(client_req);
 
   // Fire off the request to the worker.  Eventually the worker will
   // respond, and your 'handle_worker_response' event handler will be
@@ -322,10 +709,10 @@ void handle_client_request(Client_handle client_handle, const Request_msg& clien
 void process_request(const Request_msg& request_msg) {
   string cmd = request_msg.get_arg("cmd");
 
-  // There is always a free slot to process tell me now in worker[0]
+  // Every worker keeps a fast lane thread for tellmenow
   DLOG(INFO) << "cmd: " << cmd << endl;
   if (cmd.compare("tellmenow") == 0) {
-    Worker_handle worker_handle = mstate.workers[0];
+    Worker_handle worker_handle = pick_fast_lane();
     Info info = get_worker_info(worker_handle);
     worker_process_request(worker_handle, info, request_msg);
   } else if (cmd.compare("projectidea") == 0) {
@@ -338,49 +725,63 @@ void process_request(const Request_msg& request_msg) {
   }
 }
 
+/*
+ * @brief compareprimes is four countprimes.  Each comes from the
+ * cache, from an identical countprimes another compareprimes already
+ * has in flight, or from a new sub-request
+ */
 void process_compare_primes(const Request_msg& request_msg) {
+  static const char* args[4] = { "n1", "n2", "n3", "n4" };
   int tag = request_msg.get_tag();
-  int params[4];
+  vector<DagCompletion> done;
 
-  params[0] = atoi(request_msg.get_arg("n1").c_str());
-  params[1] = atoi(request_msg.get_arg("n2").c_str());
-  params[2] = atoi(request_msg.get_arg("n3").c_str());
-  params[3] = atoi(request_msg.get_arg("n4").c_str());
-
-  compPrime* cp = new compPrime();
-  cp->tag = tag;
-  
-  for (int j = 0; j < 4; ++j) {
-    cp -> n[j] = params[j];
+  mstate.subrequests->add_parent(tag, 4, combine_compare_primes);
+  for (int i = 0; i < 4; ++i) {
+    Request_msg sub_req(mstate.next_tag++);
+    create_computeprimes_req(sub_req, atoi(request_msg.get_arg(args[i]).c_str()));
+    string sub_str = sub_req.get_request_string();
+
+    string cached;
+    if (lookup_cache(sub_str, &cached)) {
+      mstate.subrequests->fill(tag, i, cached, &done);
+    } else if (mstate.subrequests->depend(tag, i, sub_str)) {
+      mstate.subrequests->issued(sub_str, sub_req.get_tag());
+      mstate.request_map[sub_req.get_tag()] = sub_str;
+      process_compute_intensive_request(sub_req);
+    }
   }
-  cp -> count = 0;
-
-  int index1 = tag + 1;
-  int index2 = tag + 2;
-  int index3 = tag + 3;
-  int index4 = tag + 4;
+  // all four may have been cached
+  complete_composites(done);
+}
 
-  mstate.prime_map[index1] = cp;
-  mstate.prime_map[index2] = cp;
-  mstate.prime_map[index3] = cp;
-  mstate.prime_map[index4] = cp;
+string combine_compare_primes(const vector<string>& counts) {
+  int first = atoi(counts[1].c_str()) - atoi(counts[0].c_str());
+  int second = atoi(counts[3].c_str()) - atoi(counts[2].c_str());
+  if (first > second) {
+    return "There are more primes in first range.";
+  }
+  return "There are more primes in second range.";
+}
 
-  for (int i = 0; i < 4; ++i) {
-    Request_msg dummy_req(mstate.next_tag++);
-    create_computeprimes_req(dummy_req, params[i]);
-    map<string, Response_msg>::iterator request_it = mstate.request_cache.find(dummy_req.get_request_string());
-    
-    // if countprime(n) is in cache
-    if (request_it != mstate.request_cache.end()) {
-      Response_msg resp = request_it->second;
-      int result = atoi(resp.get_response().c_str());
-      cp->n[i] = result;
-      cp->count++;
-    } else {
-      mstate.request_map[dummy_req.get_tag()] = dummy_req.get_request_string();
-      process_compute_intensive_request(dummy_req);
+/*
+ * @brief Answer composite requests whose sub-requests have all
+ * resolved, cache their responses and answer identical requests that
+ * queued up behind them
+ */
+void complete_composites(const vector<DagCompletion>& done) {
+  for (size_t i = 0; i < done.size(); ++i) {
+    Response_msg resp(done[i].tag);
+    resp.set_response(done[i].response);
+    send_client_response(get_client_handle(done[i].tag), resp);
+    mstate.num_pending_client_requests--;
+
+    update_cache(done[i].tag, resp);
+    string* request_it = mstate.request_map.find(done[i].tag);
+    if (request_it != NULL) {
+      string req_str = *request_it;
+      forward_response(req_str, resp);
     }
-
+    finish_request(done[i].tag);
   }
 }
 
@@ -392,22 +793,21 @@ void create_computeprimes_req(Request_msg& req, int n) {
 }
 
 void process_compute_intensive_request(const Request_msg& request_msg) {
-  for (int i = 0; i < mstate.worker_num; ++i) {
-    Worker_handle worker_handle = mstate.workers[i];
-    Info info = get_worker_info(worker_handle);
-
-    if (info.remaining_slots > 0) {
-      worker_process_request(worker_handle, info, request_msg); 
-      return;
-    }
+  // go through the queue, so a new request cannot take capacity that
+  // an earlier deadline of the same or another command could use
+  mstate.compute_intensive_queue.push(request_msg, request_msg.get_arg("cmd"),
+                                      request_deadline(request_msg));
+  clear_compute_intensive_queue();
+  if (mstate.compute_intensive_queue.empty()) {
+    return;
   }
-  // reach here if no slots
-  mstate.compute_intensive_queue.push(request_msg);
+  // reach here if work is left waiting
 #ifdef DEBUG
   DLOG(INFO) << "add request " << request_msg.get_tag() << "to queue, size: " << mstate.compute_intensive_queue.size() << endl;
 #endif
-  // ask for a new node
-  if (!mstate.starting_worker) {
+  // ask for a new node (the predictive autoscaler counts the queue
+  // on its next tick instead)
+  if (!mstate.predictive_scaling && !mstate.starting_worker) {
     start_new_worker();
 #ifdef PRINT_MESSAGE
     DLOG(INFO) << "Starting new worker now" << endl;
@@ -420,7 +820,7 @@ void process_project_idea_request(const Request_msg& request_msg) {
   for (int i = 0; i < mstate.worker_num; ++i) {
     Worker_handle worker_handle = mstate.workers[i];
     Info info = get_worker_info(worker_handle);
-    if (!info.processing_project_idea) {
+    if (worker_admits(info, "projectidea")) {
       info.processing_project_idea = true;
       mstate.processing_project_idea_num++;
       worker_process_request(worker_handle, info, request_msg, true); 
@@ -433,11 +833,11 @@ void process_project_idea_request(const Request_msg& request_msg) {
   }
 
   // reach here if no slots
-  mstate.project_idea_queue.push(request_msg);
+  mstate.project_idea_queue.push(request_msg, request_deadline(request_msg));
 #ifdef DEBUG
   DLOG(INFO) << "send project idea request " << request_msg.get_tag() << " to queue, size: " << mstate.project_idea_queue.size() << endl;
 #endif
-  if (!mstate.starting_worker) {
+  if (!mstate.predictive_scaling && !mstate.starting_worker) {
     start_new_worker();
 #ifdef PRINT_MESSAGE
     DLOG(INFO) << "Starting new worker now" << endl;
@@ -455,20 +855,25 @@ void clear_queue() {
   }
 }
 
-void clear_compute_intensive_queue() {
-  for (int i = 0; i < mstate.worker_num; ++i) {
-    if (mstate.compute_intensive_queue.empty()) {
-        break;
+/*
+ * @brief Send a queued request to the worker placement picks for it;
+ * false leaves it queued
+ */
+struct DispatchQueued {
+  bool operator()(const Request_msg& request_msg) const {
+    Worker_handle worker_handle = place_compute_request(request_msg);
+    if (worker_handle == NULL) {
+      return false;
     }
-    Worker_handle worker_handle = mstate.workers[i];
     Info info = get_worker_info(worker_handle);
-    while (!mstate.compute_intensive_queue.empty() &&
-            info.remaining_slots > 0) {
-      Request_msg request_msg = mstate.compute_intensive_queue.front();
-      mstate.compute_intensive_queue.pop();
-      worker_process_request(worker_handle, info, request_msg);
-    }
+    worker_process_request(worker_handle, info, request_msg);
+    return true;
   }
+};
+
+void clear_compute_intensive_queue() {
+  DispatchQueued dispatch;
+  mstate.compute_intensive_queue.drain(dispatch);
 }
 
 void clear_project_idea_queue() {
@@ -478,12 +883,12 @@ void clear_project_idea_queue() {
     }
     Worker_handle worker_handle = mstate.workers[i];
     Info info = get_worker_info(worker_handle);
-    if (!info.processing_project_idea) {
+    if (worker_admits(info, "projectidea")) {
       Request_msg request_msg = mstate.project_idea_queue.front();
       mstate.project_idea_queue.pop();
       info.processing_project_idea = true;
       mstate.processing_project_idea_num++;
-      worker_process_request(worker_handle, info, request_msg);
+      worker_process_request(worker_handle, info, request_msg, true);
     }
   }
 }
@@ -494,8 +899,14 @@ void clear_project_idea_queue() {
  */
 inline void worker_process_request(Worker_handle worker_handle, 
         Info& info, const Request_msg& worker_req, bool flag) {
-  // send request
-  send_request_to_worker(worker_handle, worker_req);
+  // send request, with the time it has left so the worker can serve
+  // its queue earliest deadline first
+  Request_msg timed_req(worker_req);
+  int left_ms = static_cast<int>((request_deadline(worker_req) - master_time_seconds()) * 1000.0);
+  timed_req.set_arg("deadline", to_string(max(0, left_ms)));
+  send_request_to_worker(worker_handle, timed_req);
+  trace(TRACE_DISPATCH, worker_req.get_tag(), worker_req.get_arg("cmd"));
+  track_dispatch(worker_handle, info, worker_req);
   if (flag) {
     info.remaining_slots -= PROJECT_IDEA_COST;
     mstate.total_remaining_slots -= PROJECT_IDEA_COST;
@@ -510,12 +921,37 @@ inline void worker_process_request(Worker_handle worker_handle,
 #endif
 }
 
+/*
+ * @brief The cached response to a request string, from memory or,
+ * failing that, from the snapshot of an earlier run (which moves it
+ * back into memory)
+ */
+bool lookup_cache(const string& req_str, string* response) {
+  const string* cached = mstate.request_cache->lookup(req_str);
+  if (cached != NULL) {
+    *response = *cached;
+    return true;
+  }
+  double cost;
+  if (mstate.cache_snapshot != NULL
+      && mstate.cache_snapshot->lookup(req_str, response, &cost)) {
+    mstate.request_cache->insert(req_str, *response, cost);
+    return true;
+  }
+  return false;
+}
+
 bool check_cache(Client_handle client_handle, const Request_msg& client_req) {
-  map<string, Response_msg>::iterator request_it = mstate.request_cache.find(client_req.get_request_string());
-  if (request_it != mstate.request_cache.end()) {
-    Response_msg resp = request_it->second;
+  string cached;
+  if (lookup_cache(client_req.get_request_string(), &cached)) {
     // reset tag number
-    resp.set_tag(mstate.next_tag++);
+    Response_msg resp(mstate.next_tag++);
+    resp.set_response(cached);
+    if (mstate.tracer != NULL) {
+      string cmd = client_req.get_arg("cmd");
+      mstate.tracer->record_at(TRACE_ARRIVAL, resp.get_tag(), cmd, client_request_arrival_ns());
+      trace(TRACE_DONE, resp.get_tag(), cmd);
+    }
 
     send_client_response(client_handle, resp);
 #ifdef DEBUG
@@ -527,21 +963,284 @@ bool check_cache(Client_handle client_handle, const Request_msg& client_req) {
 }
 
 void update_cache(int resp_tag, const Response_msg& resp) {
-  map<int, string>::iterator request_it = mstate.request_map.find(resp_tag);
-  if (request_it != mstate.request_map.end()) {
-    string request_string = request_it->second;
-    mstate.request_cache[request_string] = resp;
+  string* request_it = mstate.request_map.find(resp_tag);
+  if (request_it != NULL) {
+    double cost = request_cost(*request_it);
+    mstate.request_cache->insert(*request_it, resp.get_response(), cost);
+    if (mstate.cache_snapshot != NULL) {
+      mstate.cache_snapshot->append(*request_it, resp.get_response(), cost);
+    }
   } else {
     DLOG(ERROR) << "Cannot find tag" << endl;
   }
 }
 
+/*
+ * @brief Estimated cost of recomputing the response to req_str
+ */
+double request_cost(const string& req_str) {
+  if (req_str.find("cmd=418wisdom") != string::npos) {
+    return WISDOM_RECOMPUTE_COST;
+  } else if (req_str.find("cmd=countprimes") != string::npos) {
+    return COUNTPRIMES_RECOMPUTE_COST;
+  } else if (req_str.find("cmd=projectidea") != string::npos) {
+    return PROJECTIDEA_RECOMPUTE_COST;
+  } else if (req_str.find("cmd=bandwidth") != string::npos) {
+    return BANDWIDTH_RECOMPUTE_COST;
+  } else if (req_str.find("cmd=compareprimes") != string::npos) {
+    return COMPAREPRIMES_RECOMPUTE_COST;
+  }
+  return TELLMENOW_RECOMPUTE_COST;
+}
+
+/*
+ * @brief Remember when and where a request went, and charge its
+ * predicted cost to the worker
+ */
+void track_dispatch(Worker_handle worker_handle, Info& info, const Request_msg& req) {
+  Dispatch d;
+  d.worker = worker_handle;
+  d.cmd = req.get_arg("cmd");
+  d.resource = mstate.cost_model->resource(d.cmd);
+  d.demand = resource_demand(d.cmd);
+  info.usage.acquire(d.demand);
+  d.predicted_ms = mstate.cost_model->predict(d.cmd);
+  d.start_time = master_time_seconds();
+  info.inflight++;
+  info.sent_since_load++;
+  if (d.cmd == "tellmenow") {
+    info.fast_inflight++;
+  }
+  d.concurrency = info.inflight;
+  info.backlog_ms[d.resource] += d.predicted_ms;
+  mstate.dispatched[req.get_tag()] = d;
+}
+
+/*
+ * @brief Feed the measured latency of a finished request to the cost
+ * model and release its predicted cost on the worker
+ */
+void complete_dispatch(int tag) {
+  Dispatch* d = mstate.dispatched.find(tag);
+  if (d == NULL) {
+    return;
+  }
+  double latency_ms = (master_time_seconds() - d->start_time) * 1000.0;
+  // with more requests in flight than hardware threads the worker
+  // time-slices them, so scale back to the cost on a thread of its own
+  double share = min(1.0, static_cast<double>(NODE_HW_THREADS) / d->concurrency);
+  mstate.cost_model->observe(d->cmd, latency_ms * share);
+
+  Info* info = mstate.worker_info.find(d->worker);
+  if (info != NULL) {
+    info->inflight--;
+    info->done_since_load++;
+    if (d->cmd == "tellmenow") {
+      info->fast_inflight--;
+    }
+    info->usage.release(d->demand);
+    info->backlog_ms[d->resource] = max(0.0, info->backlog_ms[d->resource] - d->predicted_ms);
+  }
+  mstate.dispatched.erase(tag);
+}
+
+/*
+ * @brief When a request should be answered by (s): its client's
+ * arrival plus the budget of the client's command.  The countprimes
+ * of a compareprimes share their parent's deadline
+ */
+double request_deadline(const Request_msg& req) {
+  int tag = req.get_tag();
+  int parent = mstate.subrequests->parent_of(tag);
+  if (parent >= 0) {
+    tag = parent;
+  }
+  string cmd = req.get_arg("cmd");
+  int budget_ms = FLAGS_slo_ms;
+  if (cmd == "tellmenow") {
+    budget_ms = TELLMENOW_DEADLINE_MS;
+  } else if (cmd == "projectidea") {
+    budget_ms = PROJECTIDEA_DEADLINE_MS;
+  }
+  Arrival* arrival = mstate.arrivals.find(tag);
+  double start = arrival != NULL ? arrival->time : master_time_seconds();
+  return start + budget_ms / 1000.0;
+}
+
+/*
+ * @brief The worker whose fast lane has the fewest tellmenows, so a
+ * burst spreads over all nodes
+ */
+Worker_handle pick_fast_lane() {
+  Worker_handle best = mstate.workers[0];
+  int best_inflight = get_worker_info(best).fast_inflight;
+  for (int i = 1; i < mstate.worker_num && best_inflight > 0; ++i) {
+    Info info = get_worker_info(mstate.workers[i]);
+    if (info.fast_inflight < best_inflight) {
+      best = mstate.workers[i];
+      best_inflight = info.fast_inflight;
+    }
+  }
+  return best;
+}
+
+/*
+ * @brief The worker's last load report if it is recent enough to
+ * place requests by, else NULL
+ */
+const worker_stats_t* fresh_load(const Info& info) {
+  if (FLAGS_worker_stats_ms <= 0 || info.load_time < 0) {
+    return NULL;
+  }
+  double age_ms = (master_time_seconds() - info.load_time) * 1000.0;
+  return age_ms <= STATS_STALE_PERIODS * FLAGS_worker_stats_ms ? &info.load : NULL;
+}
+
+/*
+ * @brief Requests on the worker now: running and queued as of its
+ * last report, plus those sent and minus those answered since.  The
+ * master's own in-flight count if there is no fresh report
+ */
+int worker_occupancy(const Info& info) {
+  const worker_stats_t* load = fresh_load(info);
+  if (load == NULL) {
+    return info.inflight;
+  }
+  int queued = 0;
+  for (int i = 0; i < NUM_STATS_QUEUES; ++i) {
+    queued += load->queue_depth[i];
+  }
+  return max(0, load->busy_threads + queued + info.sent_since_load - info.done_since_load);
+}
+
+/*
+ * @brief Predicted time until a new request of type 'cmd' would be
+ * done on this worker.  Work of the same resource class shares that
+ * resource; other classes mostly overlap with it, which is what makes
+ * mixing compute and bandwidth jobs on a node pay off.  With a fresh
+ * load report the request costs what it has lately taken on this
+ * node, and the node is as busy as it says
+ */
+double predicted_completion(const Info& info, const string& cmd) {
+  resource_t resource = mstate.cost_model->resource(cmd);
+  double cost = mstate.cost_model->predict(cmd);
+  const worker_stats_t* load = fresh_load(info);
+  int command = stats_command(cmd);
+  if (load != NULL && command >= 0 && load->service_ms[command] > 0) {
+    cost = load->service_ms[command];
+  }
+  double t = max(cost, (info.backlog_ms[resource] + cost) / RESOURCE_PARALLELISM[resource]);
+  // more requests than hardware threads: everything time-slices
+  int occupancy = worker_occupancy(info);
+  if (occupancy + 1 > NODE_HW_THREADS) {
+    t *= static_cast<double>(occupancy + 1) / NODE_HW_THREADS;
+  }
+  return t;
+}
+
+/*
+ * @brief Whether a worker can take one more request of type 'cmd'
+ * right now: under budgets every resource the request needs must fit,
+ * otherwise it needs a free slot (projectideas: one per worker)
+ */
+bool worker_admits(const Info& info, const string& cmd) {
+  if (mstate.budget_admission) {
+    // the node says its memory system is already saturated
+    ResourceDemand demand = resource_demand(cmd);
+    const worker_stats_t* load = fresh_load(info);
+    if (demand.bandwidth > 0 && load != NULL
+        && load->bandwidth_mbps >= NODE_MEMORY_BANDWIDTH_MBPS) {
+      return false;
+    }
+    return info.usage.admits(demand, info.max_slots);
+  }
+  if (cmd == "projectidea") {
+    return !info.processing_project_idea;
+  }
+  return info.remaining_slots > 0;
+}
+
+/*
+ * @brief The admitting worker that is predicted to finish a
+ * request of type 'cmd' first, or NULL if none can take it now
+ */
+Worker_handle pick_worker(const string& cmd) {
+  Worker_handle best = NULL;
+  double best_time = 0.0;
+  for (int i = 0; i < mstate.worker_num; ++i) {
+    Worker_handle worker_handle = mstate.workers[i];
+    Info info = get_worker_info(worker_handle);
+    if (!worker_admits(info, cmd)) {
+      continue;
+    }
+    double t = predicted_completion(info, cmd);
+    if (best == NULL || t < best_time) {
+      best = worker_handle;
+      best_time = t;
+    }
+  }
+  return best;
+}
+
+/*
+ * @brief Bounded load for the hash ring: a worker may take the
+ * request if it admits it and holds fewer requests than
+ * hash_load_factor times the average (counting this one)
+ */
+struct HashRouteAccept {
+  string cmd;
+  int bound;
+
+  bool operator()(Worker_handle worker_handle) const {
+    Info info = get_worker_info(worker_handle);
+    return worker_occupancy(info) < bound && worker_admits(info, cmd);
+  }
+};
+
+/*
+ * @brief The worker the request string hashes to, or the next one
+ * clockwise on the ring that is not overloaded; NULL if none admits
+ * it now
+ */
+Worker_handle pick_hashed_worker(const Request_msg& req) {
+  int inflight = 0;
+  for (int i = 0; i < mstate.worker_num; ++i) {
+    inflight += worker_occupancy(get_worker_info(mstate.workers[i]));
+  }
+  HashRouteAccept accept;
+  accept.cmd = req.get_arg("cmd");
+  accept.bound = static_cast<int>(ceil(FLAGS_hash_load_factor * (inflight + 1) /
+                                       max(1, mstate.worker_num)));
+  Worker_handle worker_handle = NULL;
+  mstate.ring->pick(req.get_request_string(), accept, &worker_handle);
+  return worker_handle;
+}
+
+/*
+ * @brief The worker to send a compute request to now, or NULL if none
+ * can take it: by hash, by predicted completion, or (slot scheduling)
+ * the first one with room
+ */
+Worker_handle place_compute_request(const Request_msg& req) {
+  if (mstate.hash_routing) {
+    return pick_hashed_worker(req);
+  }
+  string cmd = req.get_arg("cmd");
+  if (mstate.cost_scheduling) {
+    return pick_worker(cmd);
+  }
+  for (int i = 0; i < mstate.worker_num; ++i) {
+    if (worker_admits(get_worker_info(mstate.workers[i]), cmd)) {
+      return mstate.workers[i];
+    }
+  }
+  return NULL;
+}
+
 bool check_processing_cache(const string& req_str, int tag) {
-  map<string, vector<int>>::iterator request_it = mstate.processing_cache.find(req_str);
-  if (request_it != mstate.processing_cache.end()) {
-    vector<int> tags = request_it->second;
-    tags.push_back(tag);
-    mstate.processing_cache[req_str] = tags;
+  vector<int>* tags = mstate.processing_cache.find(req_str);
+  if (tags != NULL) {
+    tags->push_back(tag);
 #ifdef DEBUG
     DLOG(INFO) << "processing request: " << tag << std::endl;
 #endif
@@ -551,9 +1250,9 @@ bool check_processing_cache(const string& req_str, int tag) {
 }
 
 void forward_response(const string& req_str, const Response_msg& old_resp) {
-  map<string, vector<int>>::iterator request_it = mstate.processing_cache.find(req_str);
-  if (request_it != mstate.processing_cache.end()) {
-    vector<int> tags = request_it->second;
+  vector<int>* request_it = mstate.processing_cache.find(req_str);
+  if (request_it != NULL) {
+    vector<int> tags = *request_it;
     for (size_t i = 0; i < tags.size(); ++i) {
       Response_msg resp(tags[i]);
       resp.set_response(old_resp.get_response());
@@ -564,21 +1263,71 @@ void forward_response(const string& req_str, const Response_msg& old_resp) {
 #endif
       // forward the response
       send_client_response(client_handle, resp);
+      finish_request(tags[i]);
     }
     // delete it!
-    mstate.processing_cache.erase(request_it);
+    mstate.processing_cache.erase(req_str);
+  }
+}
+
+/*
+ * @brief Drop the per-tag bookkeeping of a request that has been
+ * answered, so the tag maps only hold in-flight requests
+ */
+void finish_request(int tag) {
+  Arrival* arrival = mstate.arrivals.find(tag);
+  if (arrival != NULL) {
+    if (arrival->deadline != 0) {
+      cancel_timer(arrival->deadline);
+    }
+    double latency_ms = (master_time_seconds() - arrival->time) * 1000.0;
+    string* req_str = mstate.request_map.find(tag);
+    string cmd = "unknown";
+    if (req_str != NULL) {
+      cmd = Request_msg(0, *req_str).get_arg("cmd");
+    }
+    pair<long, long>& stats = mstate.slo_stats[cmd];
+    stats.first++;
+    if (latency_ms > FLAGS_slo_ms) {
+      stats.second++;
+    }
+    mstate.arrivals.erase(tag);
+  }
+  mstate.waiting_client.erase(tag);
+  mstate.request_map.erase(tag);
+
+  if (mstate.tracer != NULL) {
+    trace(TRACE_DONE, tag);
+    if (++mstate.traced_requests % TRACE_COLLECT_INTERVAL == 0) {
+      mstate.tracer->collect();
+    }
+  }
+}
+
+/*
+ * @brief Stamp a stage of request 'tag' if tracing is on; the command
+ * only needs to be given once per request
+ */
+inline void trace(TraceStage stage, int tag, const string& cmd) {
+  if (mstate.tracer != NULL) {
+    mstate.tracer->record(stage, tag, cmd);
   }
 }
 
 void update_processing_cache(const string& req_str, int tag) {
-  map<string, vector<int>>::iterator request_it = mstate.processing_cache.find(req_str);
+  vector<int>* tags = mstate.processing_cache.find(req_str);
+  if (tags != NULL) {
+    tags->push_back(tag);
+  } else {
+    mstate.processing_cache[req_str] = vector<int>();
+  }
+}
 
-  vector<int> tags;
-  if (request_it != mstate.processing_cache.end()) {
-    tags = request_it->second;
-    tags.push_back(tag);
-  } 
-  mstate.processing_cache[req_str] = tags;
+/*
+ * @brief Free slots above which idle workers are killed
+ */
+inline int close_num() {
+  return static_cast<int>(FLAGS_thread_num * FLAGS_threshold * FLAGS_threshold);
 }
 
 /*
@@ -597,10 +1346,9 @@ void kill_worker() {
     DLOG(INFO) << "worker tag: " << info.tag << " remaining_slots: " << info.remaining_slots << endl;
 #endif
     if (info.remaining_slots == info.max_slots &&
-            mstate.total_remaining_slots >= CLOSE_NUM) {
+            mstate.total_remaining_slots >= close_num()) {
       it = mstate.workers.erase(it);
-      mstate.worker_info.erase(worker_handle);
-      kill_worker_node(worker_handle);
+      remove_worker(worker_handle);
       mstate.worker_num--;
       DLOG(INFO) << "KILL worker " << info.tag <<  "!" << 
           "project idea num: " << mstate.processing_project_idea_num << endl;
@@ -611,6 +1359,131 @@ void kill_worker() {
   }
 }
 
+/*
+ * @brief Forget a worker that was taken off mstate.workers, and kill it
+ */
+void remove_worker(Worker_handle worker_handle) {
+  mstate.worker_info.erase(worker_handle);
+  mstate.ring->remove(worker_handle);
+  kill_worker_node(worker_handle);
+}
+
+/*
+ * @brief Thread-milliseconds of worker time a new client request is
+ * expected to take
+ */
+double arrival_work_ms(const Request_msg& req) {
+  string cmd = req.get_arg("cmd");
+  if (cmd == "compareprimes") {
+    return 4 * mstate.cost_model->predict("countprimes");
+  }
+  return mstate.cost_model->predict(cmd);
+}
+
+/*
+ * @brief Boot or kill workers so that the forecast demand one boot
+ * time from now fits
+ */
+void autoscale() {
+  double now = master_time_seconds();
+  double tick_seconds = now - mstate.last_scale_time;
+  mstate.last_scale_time = now;
+
+  // queued work, at the current cost estimates
+  double backlog_ms =
+      mstate.project_idea_queue.size() * mstate.cost_model->predict("projectidea");
+  const ClassDeadlineQueue<Request_msg>& queue = mstate.compute_intensive_queue;
+  for (size_t i = 0; i < queue.num_classes(); ++i) {
+    backlog_ms += queue.class_size(i) * mstate.cost_model->predict(queue.class_name(i));
+  }
+
+  int current = mstate.worker_num + mstate.booting_workers;
+  int target = mstate.autoscaler->update(mstate.arrived_work_ms, tick_seconds,
+                                         backlog_ms, mstate.boot_latency, current);
+  mstate.arrived_work_ms = 0.0;
+  // every projectidea in flight or waiting needs a worker to itself
+  int project_ideas = mstate.processing_project_idea_num + mstate.project_idea_queue.size();
+  target = min(mstate.max_num_workers, max(target, project_ideas));
+
+  if (target > current) {
+#ifdef DEBUG
+    DLOG(INFO) << "autoscale: forecast " << mstate.autoscaler->forecast_threads()
+               << " threads, booting " << target - current << endl;
+#endif
+    boot_workers(target - current);
+    return;
+  }
+  // keep a spare node for project ideas, as kill_worker() does
+  if (target >= current || mstate.booting_workers > 0 ||
+      mstate.worker_num <= mstate.processing_project_idea_num + 1) {
+    return;
+  }
+
+  // shrink by one idle worker (never the first)
+  for (size_t i = mstate.workers.size(); i-- > 1; ) {
+    Worker_handle worker_handle = mstate.workers[i];
+    Info info = get_worker_info(worker_handle);
+    if (info.inflight == 0 && info.usage.empty()) {
+      mstate.workers.erase(mstate.workers.begin() + i);
+      remove_worker(worker_handle);
+      mstate.worker_num--;
+      mstate.total_remaining_slots -= info.max_slots;
+      DLOG(INFO) << "autoscale: KILL worker " << info.tag << endl;
+      return;
+    }
+  }
+}
+
+void handle_autoscale_timer(void*) {
+  clear_queue();
+  autoscale();
+  start_timer(AUTOSCALE_PERIOD_MS, handle_autoscale_timer, NULL);
+}
+
+/*
+ * @brief A request has used up half its latency objective.  If work
+ * is waiting and no worker is on its way, boot one now instead of
+ * waiting for the forecast to catch up
+ */
+void handle_request_deadline(void* arg) {
+  int tag = static_cast<int>(reinterpret_cast<intptr_t>(arg));
+  Arrival* arrival = mstate.arrivals.find(tag);
+  if (arrival == NULL) {
+    return;
+  }
+  arrival->deadline = 0;
+  if ((!mstate.compute_intensive_queue.empty() || !mstate.project_idea_queue.empty()) &&
+      mstate.booting_workers == 0 &&
+      mstate.worker_num < mstate.max_num_workers) {
+    DLOG(INFO) << "request " << tag << " at half its deadline, booting a worker" << endl;
+    mstate.deadline_boots++;
+    boot_workers(1);
+  }
+}
+
+void dump_scaling_report(ostream& out) {
+  long requests = 0;
+  long misses = 0;
+  for (FlatHashMap<string, pair<long, long> >::iterator it = mstate.slo_stats.begin();
+       it != mstate.slo_stats.end(); ++it) {
+    requests += it.value().first;
+    misses += it.value().second;
+  }
+  out << "scaling (" << (mstate.predictive_scaling ? "predictive" : "reactive") << "):"
+      << " worker_seconds=" << mstate.worker_seconds
+      << " boot_latency=" << mstate.boot_latency << "s"
+      << " requests=" << requests
+      << " slo_misses(>" << FLAGS_slo_ms << "ms)=" << misses
+      << " deadline_boots=" << mstate.deadline_boots;
+  for (FlatHashMap<string, pair<long, long> >::iterator it = mstate.slo_stats.begin();
+       it != mstate.slo_stats.end(); ++it) {
+    out << "\n  " << it.key() << ": requests=" << it.value().first
+        << " slo_misses=" << it.value().second;
+  }
+  out << "\n  ";
+  mstate.autoscaler->dump_stats(out);
+}
+
 void handle_tick() {
 
   DLOG(INFO) << "Queue length: " << mstate.compute_intensive_queue.size() << endl;
@@ -618,6 +1491,37 @@ void handle_tick() {
   // clear queue first
   clear_queue();
 
+  if (mstate.tracer != NULL) {
+    mstate.tracer->collect();
+  }
+
+  double now = master_time_seconds();
+  mstate.worker_seconds += mstate.worker_num * (now - mstate.last_tick_time);
+  mstate.last_tick_time = now;
+
+  // a worker that stopped pushing load reports is asked for one
+  for (int i = 0; i < mstate.worker_num && FLAGS_worker_stats_ms > 0; ++i) {
+    if (fresh_load(get_worker_info(mstate.workers[i])) == NULL) {
+      request_worker_stats(mstate.workers[i]);
+    }
+  }
+
+  if (mstate.cache_snapshot != NULL) {
+    CacheSnapshot* snapshot = mstate.cache_snapshot;
+    snapshot->poll();
+    snapshot->flush();
+    if (snapshot->pending_log_bytes() > 0 && !snapshot->compacting()
+        && (now - mstate.last_compaction_time >= FLAGS_cache_snapshot_s
+            || snapshot->pending_log_bytes() >= CACHE_LOG_COMPACT_BYTES)) {
+      snapshot->start_compaction();
+      mstate.last_compaction_time = now;
+    }
+  }
+  if (mstate.predictive_scaling) {
+    // scaling runs on its own sub-second timer
+    return;
+  }
+
   // add node if 
   // 1. not reach maximum allowed workers
   // 2. there is a queue of compute intensive requests
@@ -628,7 +1532,7 @@ void handle_tick() {
           || !mstate.project_idea_queue.empty()
           || mstate.processing_project_idea_num == mstate.worker_num
           || mstate.total_remaining_slots <= 10)) {
-     if (mstate.compute_intensive_queue.size() >= THREAD_NUM / 2) {
+     if (static_cast<int>(mstate.compute_intensive_queue.size()) >= FLAGS_thread_num / 2) {
        start_new_worker(2);
      } else {
        start_new_worker();
@@ -645,23 +1549,22 @@ void handle_tick() {
 }
 
 inline Client_handle get_client_handle(int tag) {
-  map<int,Client_handle>::iterator client_it = mstate.waiting_client.find(tag);
+  Client_handle* client_it = mstate.waiting_client.find(tag);
 #ifdef DEBUG
-  if (client_it == mstate.waiting_client.end()) {
+  if (client_it == NULL) {
     DLOG(ERROR) << "Cannot find client" << endl;
   }
 #endif
-  return client_it->second;
+  return *client_it;
 }
 
 inline Info get_worker_info(Worker_handle worker_handle) {
-  map<Worker_handle,Info>::iterator info_it 
-      = mstate.worker_info.find(worker_handle);
+  Info* info_it = mstate.worker_info.find(worker_handle);
 #ifdef DEBUG
-  if (info_it == mstate.worker_info.end()) {
+  if (info_it == NULL) {
     DLOG(ERROR) << "CANNOT FIND INFO" << endl;
   }
 #endif
-  Info info = info_it->second;
+  Info info = *info_it;
   return info;
 }
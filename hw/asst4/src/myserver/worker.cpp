@@ -3,59 +3,251 @@
 #include <assert.h>
 #include <sstream>
 #include <glog/logging.h>
+#include <string.h>
+#include <unistd.h>
 #include <string>
+#include <atomic>
+#include <map>
 
 #include "server/messages.h"
 #include "server/worker.h"
+#include "tools/cpu_topology.h"
 #include "tools/cycle_timer.h"
-#include "tools/work_queue.h"
+#include "tools/prime_sieve.h"
+#include "tools/request_trace.h"
+#include "tools/response_cache.h"
+#include "tools/work_stealing.h"
 
 using namespace std;
 
-WorkQueue<Request_msg>* request_queue;
-WorkQueue<Request_msg>* tellmenow_queue;
-WorkQueue<Request_msg>* projectidea_queue;
+// report per-thread steal counters every STATS_INTERVAL requests
+const int STATS_INTERVAL = 1000;
 
-bool is_special_node = false;
+// drain the trace rings every so many requests (each thread's ring
+// holds 4096 events, about 800 requests)
+const int TRACE_COLLECT_INTERVAL = 256;
 
-void* worker_thread(void*);
-void* tellmenow_worker_thread(void*);
-void* projectidea_worker_thread(void*);
-inline void do_work(const Request_msg&);
+// requests the master sent without a deadline go after all others
+const double NO_DEADLINE_SECONDS = 3600.0;
+
+// countprimes above this fall back to the reference job; the table
+// for it takes ~12 MB
+const int64_t SIEVE_LIMIT = 1 << 27;
+
+// countprimes not answered by the sieve are split into chunks once n
+// is this large and at least two threads are idle; a few chunks per
+// idle thread let stealing even out the uneven cost of the ranges
+const int PARALLEL_MIN_N = 100 * 1000;
+const int CHUNKS_PER_IDLE_THREAD = 4;
+const int MAX_CHUNKS = 64;
+
+// load reports: recent service times are smoothed over reports
+const double SERVICE_TIME_ALPHA = 0.3;
+
+// memory traffic of one bandwidth request: high_bandwidth_job writes
+// its 64 MB buffer, then reads 100 x 16M cache lines
+const double BANDWIDTH_JOB_MB = 64.0 + 100.0 * 16.0 * 64.0;
+
+WorkStealingPool<Request_msg>* pool;
+
+int request_lane;
+int tellmenow_lane;
+int projectidea_lane;
+
+std::atomic<long> completed_requests(0);
+
+// per-request tracing, NULL unless the master asks for it
+RequestTracer* tracer = NULL;
+
+// answers countprimes from a shared sieve, NULL if disabled
+PrimeCountTable* prime_table = NULL;
+
+// responses of the requests the master hashes to this worker
+// (--routing=hash), NULL unless the master asks for it
+ResponseCache* memo_cache = NULL;
+pthread_mutex_t memo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a countprimes split over several threads; the thread that finishes
+// the last chunk sends the response
+struct ParallelCount {
+  int tag;
+  int n;
+  int chunks;
+  std::atomic<long> count;
+  std::atomic<int> remaining;
+  std::atomic<long> busy_us;   // summed chunk run times
+  double start_time;
+};
+
+// load reports pushed to the master every stats_ms (0: only when
+// it asks); per-command run times since the last report, and the
+// smoothed means reported
+int stats_ms = 0;
+struct ServiceTimes {
+  std::atomic<long> total_us;
+  std::atomic<long> count;
+};
+ServiceTimes service_times[NUM_STATS_COMMANDS];
+std::atomic<int> running_bandwidth(0);
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+double recent_service_ms[NUM_STATS_COMMANDS];
+int report_seq = 0;
+
+bool parallel_countprimes = false;
+pthread_mutex_t parallel_lock = PTHREAD_MUTEX_INITIALIZER;
+map<long, ParallelCount*> parallel_counts;
+long next_parallel_id = 0;
+
+void do_work(const Request_msg&);
+string memo_key(const Request_msg&, const string& cmd);
+void place_threads();
+void request_completed();
+void record_service_time(const string& cmd, double ms);
+void* report_loop(void*);
+int resident_mb();
+bool start_parallel_count(const Request_msg&);
+void run_count_chunk(long id, ParallelCount* pc, int chunk);
 
 void worker_node_init(const Request_msg& params) {
-  int thread_num = 30;  // plus one project idea thread
+  int thread_num = 29;  // plus one tellmenow and one project idea thread
 
   DLOG(INFO) << "**** Initializing worker: " << params.get_arg("tag") << " ****\n";
 
-  int tag = stoi(params.get_arg("tag"));
+  // idle threads steal from other lanes unless the master says not to
+  bool steal = params.get_arg("steal") != "0";
+
+  // trace requests into the master's trace directory
+  string trace_dir = params.get_arg("trace");
+  if (!trace_dir.empty()) {
+    string tag = params.get_arg("tag");
+    tracer = new RequestTracer("worker " + tag, trace_dir + "/worker-" + tag + ".trace.json");
+  }
 
-  // special tellmenow thread on first node
-  if (tag == 0) {
-    pthread_t tellmenow_worker;
-    pthread_create(&tellmenow_worker, NULL, tellmenow_worker_thread, NULL);
-    pthread_detach(tellmenow_worker);
+  // countprimes from the sieve unless the master says not to
+  if (params.get_arg("sieve") != "0") {
+    prime_table = new PrimeCountTable(SIEVE_LIMIT);
+  }
 
-    // plus one special tellmenow thread
-    thread_num = 29;
+  // memoize responses when the master routes repeats here
+  int memo_mb = atoi(params.get_arg("memo_mb").c_str());
+  if (memo_mb > 0) {
+    memo_cache = new ResponseCache(static_cast<size_t>(memo_mb) * 1024 * 1024, CACHE_COST);
   }
 
-  request_queue = new WorkQueue<Request_msg>;
-  tellmenow_queue = new WorkQueue<Request_msg>;
-  projectidea_queue = new WorkQueue<Request_msg>;
+  // idle threads help with large countprimes; without stealing the
+  // chunks would all run on the thread that split the request
+  parallel_countprimes = steal && params.get_arg("parallel") != "0";
+
+  pool = new WorkStealingPool<Request_msg>(do_work, thread_num + 2, steal);
 
-  // regular worker threads
-  pthread_t workers[thread_num];
-  for (int i = 0; i < thread_num; ++i) {
-    pthread_create(&workers[i], NULL, worker_thread, NULL);
-    pthread_detach(workers[i]);
+  // fast lane: every node keeps a thread for tellmenow, so the master
+  // can send latency-critical work to any of them; it never steals, or
+  // it could be stuck in a long request when a tellmenow arrives
+  tellmenow_lane = pool->add_lane(1, false, false);
+
+  // regular worker threads, earliest deadline first
+  request_lane = pool->add_lane(thread_num, true);
+
+  // special projectidea thread, also kept to its own work
+  projectidea_lane = pool->add_lane(1, false, false);
+
+  // pin threads to cores if the master asks for it
+  if (params.get_arg("pin") == "1") {
+    place_threads();
   }
 
-  // special projectidea thread
-  pthread_t projectidea_worker;
-  pthread_create(&projectidea_worker, NULL, projectidea_worker_thread, NULL);
-  pthread_detach(projectidea_worker);
+  // push load reports if the master wants them
+  for (int i = 0; i < NUM_STATS_COMMANDS; ++i) {
+    service_times[i].total_us.store(0);
+    service_times[i].count.store(0);
+    recent_service_ms[i] = 0.0;
+  }
+  stats_ms = atoi(params.get_arg("stats_ms").c_str());
+  if (stats_ms > 0) {
+    pthread_t reporter;
+    pthread_create(&reporter, NULL, report_loop, NULL);
+    pthread_detach(reporter);
+  }
+}
+
+/*
+ * Pin every pool thread to a CPU, with memory from that CPU's node.
+ * projectidea gets a core of its own in the smallest LLC domain, and
+ * the request threads -- which run the bandwidth and cachefootprint
+ * jobs -- are spread over every other core, filling the other domains
+ * first so as few of them as possible evict its working set.  The
+ * tellmenow thread is cheap and shares projectidea's domain.
+ */
+void place_threads() {
+  CpuTopology topo;
+  const vector<CpuTopology::Cpu>& cpus = topo.get_cpus();
+  if (cpus.size() < 2) {
+    DLOG(INFO) << "Worker not pinning threads: " << cpus.size() << " CPU(s)\n";
+    return;
+  }
+
+  vector<int> domains = topo.llc_domains();
+  int project_llc = domains.back();
+  size_t fewest = cpus.size() + 1;
+  for (size_t d = 0; d < domains.size(); ++d) {
+    size_t size = 0;
+    for (size_t i = 0; i < cpus.size(); ++i) {
+      size += cpus[i].llc == domains[d];
+    }
+    if (size <= fewest) {
+      fewest = size;
+      project_llc = domains[d];
+    }
+  }
+
+  const CpuTopology::Cpu* project = NULL;
+  vector<const CpuTopology::Cpu*> other_cores; // off projectidea's core
+  vector<const CpuTopology::Cpu*> requests;    // the same, other LLCs first
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    if (cpus[i].llc == project_llc && project == NULL) {
+      project = &cpus[i];
+    }
+  }
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    if (cpus[i].core == project->core) {
+      continue;
+    }
+    other_cores.push_back(&cpus[i]);
+    if (cpus[i].llc != project_llc) {
+      requests.push_back(&cpus[i]);
+    }
+  }
+  if (other_cores.empty()) {
+    DLOG(INFO) << "Worker not pinning threads: all CPUs are one core\n";
+    return;
+  }
+  for (size_t i = 0; i < other_cores.size(); ++i) {
+    if (other_cores[i]->llc == project_llc) {
+      requests.push_back(other_cores[i]);
+    }
+  }
+
+  pool->pin_thread(pool->lane_threads(projectidea_lane)[0], project->id, project->llc,
+                   project->node);
+  const CpuTopology::Cpu* fast = other_cores.back();
+  for (size_t i = 0; i < other_cores.size(); ++i) {
+    if (other_cores[i]->llc == project_llc) {
+      fast = other_cores[i];
+      break;
+    }
+  }
+  pool->pin_thread(pool->lane_threads(tellmenow_lane)[0], fast->id, fast->llc, fast->node);
+
+  const vector<int>& lane = pool->lane_threads(request_lane);
+  for (size_t i = 0; i < lane.size(); ++i) {
+    const CpuTopology::Cpu* c = requests[i % requests.size()];
+    pool->pin_thread(lane[i], c->id, c->llc, c->node);
+  }
 
+  DLOG(INFO) << "Worker pinned threads: projectidea on cpu " << project->id
+             << " (llc " << project_llc << ", node " << project->node << "), "
+             << lane.size() << " request threads over " << requests.size()
+             << " cpus in " << domains.size() << " LLC domain(s)\n";
 }
 
 void worker_handle_request(const Request_msg& req) {
@@ -64,47 +256,270 @@ void worker_handle_request(const Request_msg& req) {
   DLOG(INFO) << "Worker got request: [" << req.get_tag() << ":" << req.get_request_string() << "]\n";
 
   string cmd = req.get_arg("cmd");
+  if (tracer != NULL) {
+    tracer->record(TRACE_RECEIVED, req.get_tag(), cmd);
+  }
 
   // do not want tellme now and projectidea to be blocked by other requests
   if (cmd == "tellmenow") {  
-    tellmenow_queue->put_work(req);
+    pool->put_work(req, tellmenow_lane);
   } else if (cmd == "projectidea") {
-    projectidea_queue->put_work(req);
+    pool->put_work(req, projectidea_lane);
   } else {
-    request_queue->put_work(req);
+    // the master sends how many ms the request has left
+    string deadline = req.get_arg("deadline");
+    double budget = deadline.empty() ? NO_DEADLINE_SECONDS : atoi(deadline.c_str()) / 1000.0;
+    pool->put_work(req, request_lane, CycleTimer::currentSeconds() + budget);
   }
 }
 
-void* worker_thread(void* thread_args) {
-  while (1) {
-    Request_msg req = request_queue->get_work();
-    do_work(req);
+void do_work(const Request_msg& req) {
+  string cmd = req.get_arg("cmd");
+  if (cmd == "countprimes_chunk") {
+    long id = atol(req.get_arg("job").c_str());
+    pthread_mutex_lock(&parallel_lock);
+    ParallelCount* pc = parallel_counts[id];
+    pthread_mutex_unlock(&parallel_lock);
+    run_count_chunk(id, pc, atoi(req.get_arg("chunk").c_str()));
+    return;
   }
-  return NULL;
+
+  if (tracer != NULL) {
+    tracer->record(TRACE_DEQUEUED, req.get_tag(), cmd);
+    tracer->record(TRACE_EXEC_START, req.get_tag(), cmd);
+  }
+  Response_msg resp= req.get_tag();
+  double startTime = CycleTimer::currentSeconds();
+  string key = memo_cache != NULL ? memo_key(req, cmd) : "";
+  bool memoized = false;
+  if (!key.empty()) {
+    pthread_mutex_lock(&memo_lock);
+    const string* cached = memo_cache->lookup(key);
+    if (cached != NULL) {
+      resp.set_response(*cached);
+      memoized = true;
+    }
+    pthread_mutex_unlock(&memo_lock);
+  }
+  long primes = -1;
+  if (!memoized && prime_table != NULL && cmd == "countprimes") {
+    primes = prime_table->count_primes(atoi(req.get_arg("n").c_str()));
+  }
+  if (!memoized && primes < 0 && cmd == "countprimes" && start_parallel_count(req)) {
+    return;
+  }
+  if (primes >= 0) {
+    char tmp_buffer[32];
+    sprintf(tmp_buffer, "%ld", primes);
+    resp.set_response(tmp_buffer);
+  } else if (!memoized) {
+    bool streaming = cmd == "bandwidth";
+    if (streaming) {
+      running_bandwidth++;
+    }
+    execute_work(req, resp);
+    if (streaming) {
+      running_bandwidth--;
+    }
+    if (!key.empty()) {
+      // cost: what it took to compute (ms)
+      double cost = (CycleTimer::currentSeconds() - startTime) * 1000.0;
+      pthread_mutex_lock(&memo_lock);
+      memo_cache->insert(key, resp.get_response(), cost);
+      pthread_mutex_unlock(&memo_lock);
+    }
+  }
+  double dt = CycleTimer::currentSeconds() - startTime;
+  DLOG(INFO) << "Worker completed work in " << (1000.f * dt) << " ms (" << req.get_tag()  << ")\n";
+  record_service_time(cmd, 1000.0 * dt);
+  if (tracer != NULL) {
+    tracer->record(TRACE_EXEC_END, req.get_tag());
+  }
+  // send a response string to the master
+  worker_send_response(resp);
+  if (tracer != NULL) {
+    tracer->record(TRACE_SENT, req.get_tag());
+  }
+  request_completed();
 }
 
-void* tellmenow_worker_thread(void* thread_args) {
-  while (1) {
-    Request_msg req = tellmenow_queue->get_work();
-    do_work(req);
+/*
+ * The memo cache key of a request: its command and the one argument
+ * the job reads (the master also sends a per-request deadline), or ""
+ * for commands not worth memoizing.
+ */
+string memo_key(const Request_msg& req, const string& cmd) {
+  if (cmd == "countprimes") {
+    return "cmd=countprimes;n=" + req.get_arg("n");
+  } else if (cmd == "418wisdom" || cmd == "bandwidth" || cmd == "projectidea") {
+    return "cmd=" + cmd + ";x=" + req.get_arg("x");
   }
-  return NULL;
+  return "";
 }
 
-void* projectidea_worker_thread(void* thread_args) {
-  while (1) {
-    Request_msg req = projectidea_queue->get_work();
-    do_work(req);
+void request_completed() {
+  long completed = ++completed_requests;
+  if (tracer != NULL && completed % TRACE_COLLECT_INTERVAL == 0) {
+    tracer->collect();
+  }
+  if (completed % STATS_INTERVAL == 0) {
+    ostringstream oss;
+    pool->dump_stats(oss);
+    if (memo_cache != NULL) {
+      oss << "\nmemo ";
+      pthread_mutex_lock(&memo_lock);
+      memo_cache->dump_stats(oss);
+      pthread_mutex_unlock(&memo_lock);
+    }
+    if (tracer != NULL) {
+      oss << "\n";
+      tracer->dump_histograms(oss);
+    }
+    DLOG(INFO) << "Worker pool stats after " << completed << " requests:\n" << oss.str();
   }
-  return NULL;
 }
 
-inline void do_work(const Request_msg& req) {
-  Response_msg resp= req.get_tag();
+/*
+ * Split a countprimes over the idle threads of the node: spawn all
+ * chunks but the first onto this thread's deque, where idle threads
+ * steal them, and count the first one here.  Returns false if the
+ * request is small or the node is busy.
+ */
+bool start_parallel_count(const Request_msg& req) {
+  int n = atoi(req.get_arg("n").c_str());
+  int idle = pool->idle_threads(true);
+  if (!parallel_countprimes || n < PARALLEL_MIN_N || idle < 2) {
+    return false;
+  }
+
+  ParallelCount* pc = new ParallelCount;
+  pc->tag = req.get_tag();
+  pc->n = n;
+  pc->chunks = min(MAX_CHUNKS, (idle + 1) * CHUNKS_PER_IDLE_THREAD);
+  pc->count.store(n >= 2 ? 1 : 0);   // 2
+  pc->remaining.store(pc->chunks);
+  pc->busy_us.store(0);
+  pc->start_time = CycleTimer::currentSeconds();
+
+  pthread_mutex_lock(&parallel_lock);
+  long id = next_parallel_id++;
+  parallel_counts[id] = pc;
+  pthread_mutex_unlock(&parallel_lock);
+
+  ostringstream job;
+  job << id;
+  for (int chunk = 1; chunk < pc->chunks; ++chunk) {
+    ostringstream index;
+    index << chunk;
+    Request_msg part(req.get_tag());
+    part.set_arg("cmd", "countprimes_chunk");
+    part.set_arg("job", job.str());
+    part.set_arg("chunk", index.str());
+    pool->spawn(part);
+  }
+  run_count_chunk(id, pc, 0);
+  return true;
+}
+
+void run_count_chunk(long id, ParallelCount* pc, int chunk) {
   double startTime = CycleTimer::currentSeconds();
-  execute_work(req, resp);
-  double dt = CycleTimer::currentSeconds() - startTime;
-  DLOG(INFO) << "Worker completed work in " << (1000.f * dt) << " ms (" << req.get_tag()  << ")\n";
-  // send a response string to the master
+  long span = (static_cast<long>(pc->n) + pc->chunks - 1) / pc->chunks;
+  long lo = chunk * span;
+  long hi = min(static_cast<long>(pc->n), lo + span);
+  if (lo < hi) {
+    pc->count.fetch_add(count_odd_primes(lo, hi));
+  }
+  pc->busy_us.fetch_add(static_cast<long>((CycleTimer::currentSeconds() - startTime) * 1e6));
+  if (pc->remaining.fetch_sub(1) != 1) {
+    return;
+  }
+
+  // last chunk: answer the request
+  char tmp_buffer[32];
+  sprintf(tmp_buffer, "%ld", pc->count.load());
+  Response_msg resp(pc->tag);
+  resp.set_response(tmp_buffer);
+  if (tracer != NULL) {
+    tracer->record(TRACE_EXEC_END, pc->tag);
+  }
   worker_send_response(resp);
+  if (tracer != NULL) {
+    tracer->record(TRACE_SENT, pc->tag);
+  }
+
+  double wall_ms = (CycleTimer::currentSeconds() - pc->start_time) * 1000.0;
+  double busy_ms = pc->busy_us.load() / 1000.0;
+  record_service_time("countprimes", wall_ms);
+  DLOG(INFO) << "Parallel countprimes n=" << pc->n << " (" << pc->tag << "): "
+             << pc->chunks << " chunks, " << wall_ms << " ms wall, "
+             << busy_ms << " ms on threads, speedup " << busy_ms / wall_ms << "x\n";
+
+  pthread_mutex_lock(&parallel_lock);
+  parallel_counts.erase(id);
+  pthread_mutex_unlock(&parallel_lock);
+  delete pc;
+  request_completed();
+}
+
+void record_service_time(const string& cmd, double ms) {
+  int c = stats_command(cmd);
+  if (c >= 0) {
+    service_times[c].total_us.fetch_add(static_cast<long>(ms * 1000.0));
+    service_times[c].count.fetch_add(1);
+  }
+}
+
+/*
+ * Load report for the master: how busy the pool is, what waits in
+ * each lane, and how long each command has been taking here.
+ */
+void worker_collect_stats(worker_stats_t* stats) {
+  pthread_mutex_lock(&report_lock);
+  stats->seq = ++report_seq;
+  stats->busy_threads = pool->thread_count() - pool->idle_threads();
+  stats->queue_depth[STATS_QUEUE_REQUESTS] = pool->lane_backlog(request_lane);
+  stats->queue_depth[STATS_QUEUE_TELLMENOW] = pool->lane_backlog(tellmenow_lane);
+  stats->queue_depth[STATS_QUEUE_PROJECTIDEA] = pool->lane_backlog(projectidea_lane);
+  for (int c = 0; c < NUM_STATS_COMMANDS; ++c) {
+    long count = service_times[c].count.exchange(0);
+    long total_us = service_times[c].total_us.exchange(0);
+    if (count > 0) {
+      double mean = total_us / 1000.0 / count;
+      double& recent = recent_service_ms[c];
+      recent = recent == 0.0 ? mean : recent + SERVICE_TIME_ALPHA * (mean - recent);
+    }
+    stats->service_ms[c] = recent_service_ms[c];
+  }
+  stats->rss_mb = resident_mb();
+  // the streaming jobs running now, each moving its traffic over the
+  // time a bandwidth request has lately taken
+  double bandwidth_s = recent_service_ms[STATS_BANDWIDTH] / 1000.0;
+  stats->bandwidth_mbps = bandwidth_s > 0.0
+    ? static_cast<int>(running_bandwidth.load() * BANDWIDTH_JOB_MB / bandwidth_s) : 0;
+  pthread_mutex_unlock(&report_lock);
+}
+
+void* report_loop(void*) {
+  while (true) {
+    usleep(stats_ms * 1000);
+    worker_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    worker_collect_stats(&stats);
+    worker_send_stats(stats);
+  }
+  return NULL;
+}
+
+int resident_mb() {
+  long pages = 0;
+  long resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(f);
+  return static_cast<int>(resident * sysconf(_SC_PAGESIZE) / (1024 * 1024));
 }